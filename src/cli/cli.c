@@ -660,6 +660,45 @@ out:
 	return 0;
 }
 
+static int health_target(char *base, int n, char **p)
+{
+	char			 url[128];
+	char			*result;
+	char			*alias = *p;
+	json_t			*parent;
+	json_error_t		 error;
+	int			 ret;
+
+	UNUSED(n);
+
+	snprintf(url, sizeof(url), "%s/%s/%s", base, alias, URI_HEALTH);
+
+	ret = exec_get(url, &result);
+	if (ret)
+		return ret;
+
+	if (formatted == RAW)
+		goto err;
+
+	parent = json_loads(result, JSON_DECODE_ANY, &error);
+	if (!parent)
+		goto err;
+
+	if (formatted) {
+		if (formatted_json(parent))
+			goto err;
+	} else
+		show_health_data(alias, parent);
+
+	goto out;
+err:
+	printf("%s\n", result);
+out:
+	free(result);
+
+	return 0;
+}
+
 /* SUBSYSTEMS */
 
 static int add_subsys(char *base, int n, char **p)
@@ -1188,6 +1227,8 @@ static struct verbs verb_list[] = {
 	  "signal the dem to reconfigure the target" },
 	{ usage_target,	 TARGET,  1, "usage", _TARGET, "<alias>",
 	  "get usage for subsystems of a target" },
+	{ health_target, TARGET,  1, "health", _TARGET, "<alias>",
+	  "get the connection health of a target" },
 	{ link_target,	 GROUP,   2, _LINK,  _TARGET, "<alias> <group>",
 	  "link a target to a group (using PUT)" },
 	{ unlink_target, GROUP,   2, _UNLINK,  _TARGET, "<alias> <group>",
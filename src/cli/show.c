@@ -403,6 +403,33 @@ void show_usage_data(json_t *parent)
 	UNUSED(parent);
 }
 
+void show_health_data(char *alias, json_t *parent)
+{
+	json_t			*attrs;
+	const char		*health;
+
+	attrs = json_object_get(parent, TAG_HEALTH);
+	if (!json_is_string(attrs))
+		return;
+
+	health = json_string_value(attrs);
+
+	printf("%s '%s' %s", TAG_TARGET, alias, health);
+
+	if (!strcmp(health, TAG_HEALTHY))
+		goto out;
+
+	attrs = json_object_get(parent, TAG_FAILURES);
+	if (json_is_integer(attrs))
+		printf(", %lld failed attempts", json_integer_value(attrs));
+
+	attrs = json_object_get(parent, TAG_NEXT_ATTEMPT);
+	if (json_is_integer(attrs))
+		printf(", retry in %lld ms", json_integer_value(attrs));
+out:
+	printf("\n");
+}
+
 void show_target_data(json_t *parent)
 {
 	json_t			*attrs;
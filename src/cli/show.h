@@ -40,6 +40,7 @@ void show_group_data(json_t *parent);
 void show_group_list(json_t *parent);
 void show_config(json_t *parent);
 void show_usage_data(json_t *parent);
+void show_health_data(char *alias, json_t *parent);
 
 #ifndef UNUSED
 #define UNUSED(x) ((void) x)
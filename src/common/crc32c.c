@@ -0,0 +1,237 @@
+// SPDX-License-Identifier: DUAL GPL-2.0/BSD
+/*
+ * NVMe over Fabrics Distributed Endpoint Management (NVMe-oF DEM).
+ * Copyright (c) 2017-2019 Intel Corporation, Inc. All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *	- Redistributions of source code must retain the above
+ *	  copyright notice, this list of conditions and the following
+ *	  disclaimer.
+ *
+ *	- Redistributions in binary form must reproduce the above
+ *	  copyright notice, this list of conditions and the following
+ *	  disclaimer in the documentation and/or other materials
+ *	  provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+#define CRC32C_POLY		0x82F63B78	/* reflected */
+
+/* slicing by 8: crc_table[k][i] is the crc of byte i followed by k zeros */
+static u32			 crc_table[8][256];
+
+static u32 (*crc32c_fn)(u32 crc, const void *buf, size_t len);
+static pthread_once_t		 crc32c_once = PTHREAD_ONCE_INIT;
+
+static u32 sw_crc32c(u32 crc, const void *buf, size_t len)
+{
+	const u8		*p = buf;
+	u64			 v;
+
+	while (len && ((uintptr_t) p & 7)) {
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+
+	while (len >= 8) {
+		memcpy(&v, p, sizeof(v));
+		v ^= crc;
+		crc = crc_table[7][v & 0xff] ^
+		      crc_table[6][(v >> 8) & 0xff] ^
+		      crc_table[5][(v >> 16) & 0xff] ^
+		      crc_table[4][(v >> 24) & 0xff] ^
+		      crc_table[3][(v >> 32) & 0xff] ^
+		      crc_table[2][(v >> 40) & 0xff] ^
+		      crc_table[1][(v >> 48) & 0xff] ^
+		      crc_table[0][v >> 56];
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+
+/* the crc32 instruction has a latency of 3 and a throughput of 1, so
+ * large buffers are run as three interleaved streams of STREAM_LEN bytes
+ * whose results are folded together with a carry-less multiply
+ */
+#define STREAM_LEN		512
+
+static u32			 fold_1;	/* x^(8 * 2 * STREAM_LEN - 33) */
+static u32			 fold_2;	/* x^(8 * STREAM_LEN - 33) */
+
+/* x^n mod P in the reflected domain */
+static u32 xpow_mod(unsigned int n)
+{
+	u32			 r = 0x80000000;	/* x^0 */
+
+	while (n--)
+		r = (r >> 1) ^ ((r & 1) ? CRC32C_POLY : 0);
+
+	return r;
+}
+
+/* crc * x^(8 * len) mod P, given k = x^(8 * len - 33) mod P.  The
+ * reflected product carries an extra x, and crc32 of the 64 bit product
+ * multiplies by x^32 as it reduces
+ */
+__attribute__((target("sse4.2,pclmul")))
+static inline u32 crc32c_shift(u32 crc, u32 k)
+{
+	__m128i			 a = _mm_cvtsi32_si128(crc);
+	__m128i			 b = _mm_cvtsi32_si128(k);
+
+	return _mm_crc32_u64(0, _mm_cvtsi128_si64(_mm_clmulepi64_si128(a, b,
+									0)));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static u32 hw_crc32c(u32 crc, const void *buf, size_t len)
+{
+	const u8		*p = buf;
+	u64			 crc0, crc1, crc2;
+	u64			 v0, v1, v2;
+	int			 i;
+
+	while (len && ((uintptr_t) p & 7)) {
+		crc = _mm_crc32_u8(crc, *p++);
+		len--;
+	}
+
+	while (len >= 3 * STREAM_LEN) {
+		crc0 = crc;
+		crc1 = 0;
+		crc2 = 0;
+
+		for (i = 0; i < STREAM_LEN; i += 8) {
+			memcpy(&v0, p + i, sizeof(v0));
+			memcpy(&v1, p + STREAM_LEN + i, sizeof(v1));
+			memcpy(&v2, p + 2 * STREAM_LEN + i, sizeof(v2));
+			crc0 = _mm_crc32_u64(crc0, v0);
+			crc1 = _mm_crc32_u64(crc1, v1);
+			crc2 = _mm_crc32_u64(crc2, v2);
+		}
+
+		crc = crc32c_shift(crc0, fold_1) ^ crc32c_shift(crc1, fold_2) ^
+		      crc2;
+
+		p += 3 * STREAM_LEN;
+		len -= 3 * STREAM_LEN;
+	}
+
+	crc0 = crc;
+
+	while (len >= 8) {
+		memcpy(&v0, p, sizeof(v0));
+		crc0 = _mm_crc32_u64(crc0, v0);
+		p += 8;
+		len -= 8;
+	}
+
+	crc = crc0;
+
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+
+#endif
+
+static void crc32c_init(void)
+{
+	u32			 crc;
+	int			 i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+		crc_table[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^
+				crc_table[0][crc_table[j - 1][i] & 0xff];
+
+	crc32c_fn = sw_crc32c;
+
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse4.2") &&
+	    __builtin_cpu_supports("pclmul")) {
+		fold_1 = xpow_mod(8 * 2 * STREAM_LEN - 33);
+		fold_2 = xpow_mod(8 * STREAM_LEN - 33);
+		crc32c_fn = hw_crc32c;
+	}
+#endif
+}
+
+u32 crc32c(u32 crc, const void *buf, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+
+	return crc32c_fn(crc, buf, len);
+}
+
+u32 crc32c_sw(u32 crc, const void *buf, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+
+	return sw_crc32c(crc, buf, len);
+}
+
+int crc32c_hw_available(void)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+
+	return crc32c_fn != sw_crc32c;
+}
+
+u32 crc32c_hw(u32 crc, const void *buf, size_t len)
+{
+#if defined(__x86_64__)
+	if (crc32c_hw_available())
+		return hw_crc32c(crc, buf, len);
+#endif
+	return crc32c_sw(crc, buf, len);
+}
@@ -54,7 +54,10 @@ struct curl_context {
 	int read_sz;
 };
 
-static struct curl_context	*ctx;
+/* a curl handle must not be used by two threads at once, so every thread
+ * that makes requests has its own, see init_curl_thread
+ */
+static __thread struct curl_context *ctx;
 static int			 debug_curl;
 
 #ifdef CURLINFO_CONTENT_LENGTH_DOWNLOAD_T
@@ -104,31 +107,32 @@ static size_t write_cb(void *contents, size_t size, size_t n, void *stream)
 	return bytes;
 }
 
-int init_curl(int debug)
+int init_curl_thread(void)
 {
 	CURL			*curl;
 
-	debug_curl = debug;
-
 	ctx = malloc(sizeof(*ctx));
 	if (!ctx) {
 		fprintf(stderr, "unable to alloc memory for curl context\n");
 		return -ENOMEM;
 	}
 
-	curl_global_init(CURL_GLOBAL_ALL);
-
 	curl = curl_easy_init();
 	if (!curl) {
 		fprintf(stderr, "unable to init curl");
 		free(ctx);
+		ctx = NULL;
 		return -EINVAL;
 	}
 
 	/* will be grown as needed by the realloc in write_cb */
 	ctx->write_data = malloc(1);
-	if (!ctx->write_data)
+	if (!ctx->write_data) {
+		curl_easy_cleanup(curl);
+		free(ctx);
+		ctx = NULL;
 		return -ENOMEM;
+	}
 
 	ctx->write_sz = 0;    /* no data at this point */
 	ctx->write_data[0] = 0;
@@ -138,21 +142,46 @@ int init_curl(int debug)
 	curl_easy_setopt(curl, CURLOPT_READFUNCTION,	(void *) read_cb);
 	curl_easy_setopt(curl, CURLOPT_READDATA,	(void *) ctx);
 
+	/* name lookups may not time out with signals outside the main thread */
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL,	1L);
+
 	ctx->curl = curl;
 
 	return 0;
 }
 
-void cleanup_curl(void)
+void cleanup_curl_thread(void)
 {
-	CURL			*curl = ctx->curl;
-
-	curl_easy_cleanup(curl);
+	if (!ctx)
+		return;
 
-	curl_global_cleanup();
+	curl_easy_cleanup(ctx->curl);
 
 	free(ctx->write_data);
 	free(ctx);
+	ctx = NULL;
+}
+
+int init_curl(int debug)
+{
+	int			 ret;
+
+	debug_curl = debug;
+
+	curl_global_init(CURL_GLOBAL_ALL);
+
+	ret = init_curl_thread();
+	if (ret)
+		curl_global_cleanup();
+
+	return ret;
+}
+
+void cleanup_curl(void)
+{
+	cleanup_curl_thread();
+
+	curl_global_cleanup();
 }
 
 static int exec_curl(char *url, char **p)
@@ -51,46 +51,60 @@ static inline void trim(char *p, int len)
 		}
 }
 
-int get_logpages(struct ctrl_queue *dq, struct nvmf_disc_rsp_page_hdr **logp,
-		 u32 *numrec)
+/* a log page read of this size returns just genctr and numrec */
+static inline int log_header_size(void)
 {
 	struct nvmf_disc_rsp_page_hdr *hdr;
-	struct nvmf_disc_rsp_page_entry *log;
-	unsigned int		 log_size = 0;
-	unsigned long		 genctr;
 	size_t			 offset;
-	u32			 i;
-	int			 ret;
 
 	offset = offsetof(struct nvmf_disc_rsp_page_hdr, numrec);
-	log_size = offset + sizeof(hdr->numrec);
-	log_size = round_up(log_size, sizeof(u32));
 
-	ret = send_get_log_page(&dq->ep, log_size, &hdr);
+	return round_up(offset + sizeof(hdr->numrec), sizeof(u32));
+}
+
+/* reads just the header for numrec and genctr */
+static int get_log_header(struct ctrl_queue *dq, u32 *numrec, u64 *genctr)
+{
+	struct nvmf_disc_rsp_page_hdr *hdr;
+	int			 ret;
+
+	ret = send_get_log_page(&dq->ep, log_header_size(), &hdr);
 	if (ret) {
 		print_err("failed to fetch number of discovery log entries");
 		return -ENODATA;
 	}
 
-	genctr = le64toh(hdr->genctr);
+	*genctr = le64toh(hdr->genctr);
 	*numrec = le32toh(hdr->numrec);
 
 	free(hdr);
 
-	if (*numrec == 0) {
+	return 0;
+}
+
+static int get_log_entries(struct ctrl_queue *dq, u32 numrec, u64 genctr,
+			   struct nvmf_disc_rsp_page_hdr **logp)
+{
+	struct nvmf_disc_rsp_page_hdr *hdr;
+	struct nvmf_disc_rsp_page_entry *log;
+	unsigned int		 log_size = 0;
+	u32			 i;
+	int			 ret;
+
+	if (numrec == 0) {
 #ifdef DEBUG_LOG_PAGES_VERBOSE
 		print_err("no discovery log on target %s", dq->target->alias);
 #endif
 		*logp = NULL;
-		return 0;
+		goto out;
 	}
 
 #ifdef DEBUG_LOG_PAGES_VERBOSE
-	print_debug("number of records to fetch is %d", *numrec);
+	print_debug("number of records to fetch is %d", numrec);
 #endif
 
 	log_size = sizeof(struct nvmf_disc_rsp_page_hdr) +
-		   sizeof(struct nvmf_disc_rsp_page_entry) * *numrec;
+		   sizeof(struct nvmf_disc_rsp_page_entry) * numrec;
 
 	ret = send_get_log_page(&dq->ep, log_size, &hdr);
 	if (ret) {
@@ -98,23 +112,63 @@ int get_logpages(struct ctrl_queue *dq, struct nvmf_disc_rsp_page_hdr **logp,
 		return -ENODATA;
 	}
 
-	if ((*numrec != le32toh(hdr->numrec)) ||
+	if ((numrec != le32toh(hdr->numrec)) ||
 	    (genctr != le64toh(hdr->genctr))) {
 		print_err("# records for last two get log pages not equal");
+		free(hdr);
 		return -EINVAL;
 	}
 
-	for (i = 0, log = hdr->entries; i < *numrec; i++, log++) {
+	for (i = 0, log = hdr->entries; i < numrec; i++, log++) {
 		trim(log->traddr, NVMF_TRADDR_SIZE);
 		trim(log->subnqn, NVMF_NQN_FIELD_LEN);
 		trim(log->trsvcid, NVMF_TRSVCID_SIZE);
 	}
 
 	*logp = hdr;
+out:
+	dq->genctr = genctr;
+	dq->have_genctr = 1;
 
 	return 0;
 }
 
+int get_logpages(struct ctrl_queue *dq, struct nvmf_disc_rsp_page_hdr **logp,
+		 u32 *numrec)
+{
+	u64			 genctr;
+	int			 ret;
+
+	ret = get_log_header(dq, numrec, &genctr);
+	if (ret)
+		return ret;
+
+	return get_log_entries(dq, *numrec, genctr, logp);
+}
+
+/* the header read of get_logpages left to complete in the background,
+ * the callback gets the header in ctx->data
+ */
+int get_log_header_async(struct ctrl_queue *dq, int timeout, cmd_done_fn fn,
+			 void *arg)
+{
+	return send_get_log_page_async(&dq->ep, log_header_size(), timeout,
+				       fn, arg);
+}
+
+/* the rest of get_logpages once the header is in, the log is only
+ * transferred when its genctr moved since the last one read on the
+ * queue, -EALREADY otherwise
+ */
+int get_changed_log_entries(struct ctrl_queue *dq, u32 numrec, u64 genctr,
+			    struct nvmf_disc_rsp_page_hdr **logp)
+{
+	if (dq->have_genctr && genctr == dq->genctr)
+		return -EALREADY;
+
+	return get_log_entries(dq, numrec, genctr, logp);
+}
+
 void print_discovery_log(struct nvmf_disc_rsp_page_hdr *log, int numrec)
 {
 #ifdef DEBUG_LOG_PAGES
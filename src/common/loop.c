@@ -0,0 +1,805 @@
+// SPDX-License-Identifier: DUAL GPL-2.0/BSD
+/*
+ * NVMe over Fabrics Distributed Endpoint Management (NVMe-oF DEM).
+ * Copyright (c) 2017-2019 Intel Corporation, Inc. All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *	- Redistributions of source code must retain the above
+ *	  copyright notice, this list of conditions and the following
+ *	  disclaimer.
+ *
+ *	- Redistributions in binary form must reproduce the above
+ *	  copyright notice, this list of conditions and the following
+ *	  disclaimer in the documentation and/or other materials
+ *	  provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* In-process loopback transport.  Both ends of a connection live in one
+ * process: messages are copied into the peer's receive queue and flag its
+ * eventfd, and rma_read/rma_write copy straight from and to the address
+ * the peer put in the SGL once its key checks out.  This drives the
+ * discovery engine end to end at memory speed for tests and benchmarks.
+ * Listeners are found by port, the address is ignored.
+ */
+
+#include "common.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+
+#include "ops.h"
+
+#define LOOP_MSG_SIZE		sizeof(struct nvme_command)
+#define LOOP_BACKLOG		16
+#define LOOP_KEY_HASH		256
+#define EVENT_TIMEOUT		200 /* ms */
+#define CONNECT_TIMEOUT		5000 /* ms */
+
+enum { LOOP_PENDING = 0, LOOP_ACCEPTED, LOOP_REJECTED };
+
+struct loop_qe {
+	struct loop_qe		*next;
+	u32			 bytes;
+	u8			 buf[LOOP_MSG_SIZE];
+};
+
+struct loop_ep;
+
+/* one connection, its lock guards both ends' queues */
+struct loop_link {
+	pthread_mutex_t		 lock;
+	pthread_cond_t		 cond;
+	struct loop_ep		*ep[2];
+	int			 state;
+	int			 refs;
+};
+
+struct loop_ep {
+	struct loop_link	*link;
+	int			 side;
+	struct loop_qe		*qe;
+	struct loop_qe		*free_qe;
+	struct loop_qe		*ready_head;
+	struct loop_qe		*ready_tail;
+	int			 efd;
+	int			 depth;
+	int			 state;
+};
+
+struct loop_pep {
+	struct loop_pep		*next;
+	int			 port;
+	struct loop_link	*pending[LOOP_BACKLOG];
+	int			 head;
+	int			 count;
+	int			 stopping;
+	pthread_cond_t		 cond;
+};
+
+struct loop_mr {
+	struct loop_mr		*next;
+	void			*buf;
+	u64			 len;
+	u32			 key;
+};
+
+/* listeners and keys, under loop_lock */
+static struct loop_pep		*listeners;
+static struct loop_mr		*keys[LOOP_KEY_HASH];
+static u32			 next_key = 1;
+static pthread_mutex_t		 loop_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void timed_wait(pthread_cond_t *cond, pthread_mutex_t *lock)
+{
+	struct timespec		 ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += EVENT_TIMEOUT * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_cond_timedwait(cond, lock, &ts);
+}
+
+static void loop_wake(struct loop_ep *ep)
+{
+	u64			 val = 1;
+
+	if (write(ep->efd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		print_errno("eventfd write failed", errno);
+}
+
+static void put_link(struct loop_link *link)
+{
+	int			 refs;
+
+	pthread_mutex_lock(&link->lock);
+	refs = --link->refs;
+	pthread_mutex_unlock(&link->lock);
+
+	if (refs)
+		return;
+
+	pthread_cond_destroy(&link->cond);
+	pthread_mutex_destroy(&link->lock);
+	free(link);
+}
+
+/* drop this end of the connection, the peer sees it as a reset */
+static void detach_link(struct loop_ep *ep)
+{
+	struct loop_link	*link = ep->link;
+	struct loop_ep		*peer;
+
+	if (!link)
+		return;
+
+	pthread_mutex_lock(&link->lock);
+
+	link->ep[ep->side] = NULL;
+	if (link->state == LOOP_PENDING)
+		link->state = LOOP_REJECTED;
+
+	peer = link->ep[!ep->side];
+	if (peer)
+		loop_wake(peer);
+
+	pthread_cond_broadcast(&link->cond);
+	pthread_mutex_unlock(&link->lock);
+
+	put_link(link);
+
+	ep->link = NULL;
+}
+
+static int loop_alloc_ep(struct loop_ep **_ep, int depth)
+{
+	struct loop_ep		*ep;
+	int			 i;
+
+	ep = calloc(1, sizeof(*ep));
+	if (!ep)
+		return -ENOMEM;
+
+	ep->qe = calloc(depth, sizeof(struct loop_qe));
+	if (!ep->qe)
+		goto err1;
+
+	for (i = 0; i < depth; i++) {
+		ep->qe[i].next = ep->free_qe;
+		ep->free_qe = &ep->qe[i];
+	}
+
+	ep->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ep->efd < 0)
+		goto err2;
+
+	ep->depth = depth;
+
+	*_ep = ep;
+
+	return 0;
+err2:
+	free(ep->qe);
+err1:
+	free(ep);
+
+	return -ENOMEM;
+}
+
+static int loop_init_endpoint(struct xp_ep **_ep, int depth)
+{
+	return loop_alloc_ep((struct loop_ep **) _ep, depth);
+}
+
+static int loop_create_endpoint(struct xp_ep **_ep, void *id, int depth)
+{
+	struct loop_link	*link = id;
+	struct loop_ep		*ep;
+	int			 ret;
+
+	ret = loop_alloc_ep(&ep, depth);
+	if (ret) {
+		pthread_mutex_lock(&link->lock);
+		link->state = LOOP_REJECTED;
+		pthread_cond_broadcast(&link->cond);
+		pthread_mutex_unlock(&link->lock);
+
+		put_link(link);
+		return ret;
+	}
+
+	/* takes over the reference the listener queue held */
+	pthread_mutex_lock(&link->lock);
+	link->ep[1] = ep;
+	pthread_mutex_unlock(&link->lock);
+
+	ep->link = link;
+	ep->side = 1;
+
+	*_ep = (struct xp_ep *) ep;
+
+	return 0;
+}
+
+static void loop_destroy_endpoint(struct xp_ep *_ep)
+{
+	struct loop_ep		*ep = (struct loop_ep *) _ep;
+
+	detach_link(ep);
+
+	close(ep->efd);
+	free(ep->qe);
+	free(ep);
+}
+
+static int loop_init_listener(struct xp_pep **_pep, char *port)
+{
+	struct loop_pep		*pep, *p;
+	int			 ret = 0;
+
+	pep = calloc(1, sizeof(*pep));
+	if (!pep)
+		return -ENOMEM;
+
+	pep->port = atoi(port);
+	pthread_cond_init(&pep->cond, NULL);
+
+	pthread_mutex_lock(&loop_lock);
+
+	for (p = listeners; p; p = p->next)
+		if (p->port == pep->port) {
+			ret = -EADDRINUSE;
+			break;
+		}
+
+	if (!ret) {
+		pep->next = listeners;
+		listeners = pep;
+	}
+
+	pthread_mutex_unlock(&loop_lock);
+
+	if (ret) {
+		pthread_cond_destroy(&pep->cond);
+		free(pep);
+		return ret;
+	}
+
+	*_pep = (struct xp_pep *) pep;
+
+	return 0;
+}
+
+static void loop_destroy_listener(struct xp_pep *_pep)
+{
+	struct loop_pep		*pep = (struct loop_pep *) _pep;
+	struct loop_pep		**p;
+	struct loop_link	*link;
+
+	pthread_mutex_lock(&loop_lock);
+
+	for (p = &listeners; *p; p = &(*p)->next)
+		if (*p == pep) {
+			*p = pep->next;
+			break;
+		}
+
+	pthread_mutex_unlock(&loop_lock);
+
+	/* refuse whatever was never picked up */
+	while (pep->count) {
+		link = pep->pending[pep->head];
+		pep->head = (pep->head + 1) % LOOP_BACKLOG;
+		pep->count--;
+
+		pthread_mutex_lock(&link->lock);
+		link->state = LOOP_REJECTED;
+		pthread_cond_broadcast(&link->cond);
+		pthread_mutex_unlock(&link->lock);
+
+		put_link(link);
+	}
+
+	pthread_cond_destroy(&pep->cond);
+	free(pep);
+}
+
+static int loop_wait_for_connection(struct xp_pep *_pep, void **_id)
+{
+	struct loop_pep		*pep = (struct loop_pep *) _pep;
+	int			 ret = 0;
+
+	pthread_mutex_lock(&loop_lock);
+
+	while (!pep->count) {
+		if (stopped || pep->stopping) {
+			ret = -ESHUTDOWN;
+			goto out;
+		}
+
+		timed_wait(&pep->cond, &loop_lock);
+	}
+
+	*_id = pep->pending[pep->head];
+
+	pep->head = (pep->head + 1) % LOOP_BACKLOG;
+	pep->count--;
+out:
+	pthread_mutex_unlock(&loop_lock);
+
+	return ret;
+}
+
+static void loop_stop_listener(struct xp_pep *_pep)
+{
+	struct loop_pep		*pep = (struct loop_pep *) _pep;
+
+	pthread_mutex_lock(&loop_lock);
+	pep->stopping = 1;
+	pthread_cond_broadcast(&pep->cond);
+	pthread_mutex_unlock(&loop_lock);
+}
+
+static int loop_settle(struct loop_ep *ep, int state)
+{
+	struct loop_link	*link = ep->link;
+	int			 ret = 0;
+
+	if (!link)
+		return -ENOTCONN;
+
+	pthread_mutex_lock(&link->lock);
+
+	if (link->state != LOOP_PENDING || !link->ep[!ep->side])
+		ret = -ECONNRESET;
+	else
+		link->state = state;
+
+	pthread_cond_broadcast(&link->cond);
+	pthread_mutex_unlock(&link->lock);
+
+	return ret;
+}
+
+static int loop_accept_connection(struct xp_ep *_ep)
+{
+	struct loop_ep		*ep = (struct loop_ep *) _ep;
+	int			 ret;
+
+	ret = loop_settle(ep, LOOP_ACCEPTED);
+	if (!ret)
+		ep->state = CONNECTED;
+
+	return ret;
+}
+
+static int loop_reject_connection(struct xp_ep *_ep, void *data, int len)
+{
+	UNUSED(data);
+	UNUSED(len);
+
+	return loop_settle((struct loop_ep *) _ep, LOOP_REJECTED);
+}
+
+static int loop_client_connect(struct xp_ep *_ep, struct sockaddr *dst,
+			       void *data, int len)
+{
+	struct loop_ep		*ep = (struct loop_ep *) _ep;
+	struct loop_link	*link;
+	struct loop_pep		*pep;
+	int			 port;
+	int			 waited = 0;
+	int			 ret = 0;
+
+	UNUSED(data);
+	UNUSED(len);
+
+	/* sin_port and sin6_port share an offset */
+	port = ntohs(((struct sockaddr_in *) dst)->sin_port);
+
+	link = calloc(1, sizeof(*link));
+	if (!link)
+		return -ENOMEM;
+
+	pthread_mutex_init(&link->lock, NULL);
+	pthread_cond_init(&link->cond, NULL);
+
+	link->ep[0] = ep;
+	link->state = LOOP_PENDING;
+	link->refs = 2; /* this end and the listener queue */
+
+	ep->link = link;
+	ep->side = 0;
+
+	pthread_mutex_lock(&loop_lock);
+
+	for (pep = listeners; pep; pep = pep->next)
+		if (pep->port == port)
+			break;
+
+	if (!pep)
+		ret = -ECONNREFUSED;
+	else if (pep->count == LOOP_BACKLOG)
+		ret = -EAGAIN;
+	else {
+		pep->pending[(pep->head + pep->count) % LOOP_BACKLOG] = link;
+		pep->count++;
+		pthread_cond_broadcast(&pep->cond);
+	}
+
+	pthread_mutex_unlock(&loop_lock);
+
+	if (ret) {
+		link->refs = 1;
+		goto err;
+	}
+
+	pthread_mutex_lock(&link->lock);
+
+	while (link->state == LOOP_PENDING && !stopped &&
+	       waited < CONNECT_TIMEOUT) {
+		timed_wait(&link->cond, &link->lock);
+		waited += EVENT_TIMEOUT;
+	}
+
+	if (link->state == LOOP_ACCEPTED)
+		ep->state = CONNECTED;
+	else if (stopped)
+		ret = -ESHUTDOWN;
+	else if (link->state == LOOP_PENDING)
+		ret = -ETIMEDOUT;
+	else
+		ret = -ECONNREFUSED;
+
+	pthread_mutex_unlock(&link->lock);
+
+	if (!ret)
+		return 0;
+err:
+	detach_link(ep);
+
+	return ret;
+}
+
+/* copy into a free receive slot of the peer, waiting for one if needed */
+static int loop_send_msg(struct xp_ep *_ep, void *msg, int len,
+			 struct xp_mr *_mr)
+{
+	struct loop_ep		*ep = (struct loop_ep *) _ep;
+	struct loop_link	*link = ep->link;
+	struct loop_ep		*peer;
+	struct loop_qe		*qe;
+	int			 ret = 0;
+
+	UNUSED(_mr);
+
+	if (!link)
+		return -ENOTCONN;
+
+	if (len > (int) LOOP_MSG_SIZE)
+		return -EMSGSIZE;
+
+	pthread_mutex_lock(&link->lock);
+
+	while (1) {
+		peer = link->ep[!ep->side];
+		if (!peer || link->state != LOOP_ACCEPTED) {
+			ret = -ECONNRESET;
+			goto out;
+		}
+
+		if (peer->free_qe)
+			break;
+
+		if (stopped) {
+			ret = -ESHUTDOWN;
+			goto out;
+		}
+
+		timed_wait(&link->cond, &link->lock);
+	}
+
+	qe = peer->free_qe;
+	peer->free_qe = qe->next;
+
+	memcpy(qe->buf, msg, len);
+	qe->bytes = len;
+	qe->next = NULL;
+
+	if (peer->ready_tail)
+		peer->ready_tail->next = qe;
+	else
+		__atomic_store_n(&peer->ready_head, qe, __ATOMIC_RELEASE);
+	peer->ready_tail = qe;
+
+	loop_wake(peer);
+out:
+	pthread_mutex_unlock(&link->lock);
+
+	return ret;
+}
+
+static int loop_poll_for_msg(struct xp_ep *_ep, struct xp_qe **_qe,
+			     void **msg, int *bytes)
+{
+	struct loop_ep		*ep = (struct loop_ep *) _ep;
+	struct loop_link	*link = ep->link;
+	struct loop_qe		*qe;
+	u64			 val;
+	int			 ret = 0;
+
+	if (!link)
+		return -ENOTCONN;
+
+	/* the eventfd is only drained once the queue is empty, so a caller
+	 * that stops early is woken again for what remains
+	 */
+	if (!__atomic_load_n(&ep->ready_head, __ATOMIC_ACQUIRE) &&
+	    read(ep->efd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		return -errno;
+
+	pthread_mutex_lock(&link->lock);
+
+	qe = ep->ready_head;
+	if (!qe) {
+		ret = (link->ep[!ep->side] || link->state != LOOP_ACCEPTED) ?
+		      -EAGAIN : -ECONNRESET;
+		goto out;
+	}
+
+	ep->ready_head = qe->next;
+	if (!ep->ready_head)
+		ep->ready_tail = NULL;
+
+	*_qe = (struct xp_qe *) qe;
+	*msg = qe->buf;
+	*bytes = qe->bytes;
+out:
+	pthread_mutex_unlock(&link->lock);
+
+	return ret;
+}
+
+static int loop_repost_recv(struct xp_ep *_ep, struct xp_qe *_qe)
+{
+	struct loop_ep		*ep = (struct loop_ep *) _ep;
+	struct loop_qe		*qe = (struct loop_qe *) _qe;
+	struct loop_link	*link = ep->link;
+
+	if (!qe)
+		return 0;
+
+	if (!link) {
+		qe->next = ep->free_qe;
+		ep->free_qe = qe;
+		return 0;
+	}
+
+	pthread_mutex_lock(&link->lock);
+
+	qe->next = ep->free_qe;
+	ep->free_qe = qe;
+
+	/* a sender may be waiting for the slot */
+	pthread_cond_broadcast(&link->cond);
+
+	pthread_mutex_unlock(&link->lock);
+
+	return 0;
+}
+
+static int loop_event_fd(struct xp_ep *_ep)
+{
+	struct loop_ep		*ep = (struct loop_ep *) _ep;
+
+	return ep->efd;
+}
+
+/* the peer's buffer must lie inside the region its key was issued for */
+static void *loop_remote_buf(struct loop_ep *ep, u64 addr, u64 len, u32 key)
+{
+	struct loop_mr		*mr;
+	void			*buf = NULL;
+
+	if (!ep->link || ep->state != CONNECTED)
+		return NULL;
+
+	pthread_mutex_lock(&loop_lock);
+
+	for (mr = keys[key % LOOP_KEY_HASH]; mr; mr = mr->next)
+		if (mr->key == key)
+			break;
+
+	if (mr && addr >= (uintptr_t) mr->buf &&
+	    addr + len <= (uintptr_t) mr->buf + mr->len)
+		buf = (void *) (uintptr_t) addr;
+
+	pthread_mutex_unlock(&loop_lock);
+
+	return buf;
+}
+
+static int loop_rma_read(struct xp_ep *_ep, void *buf, u64 addr, u64 len,
+			 u32 key, struct xp_mr *_mr)
+{
+	struct loop_ep		*ep = (struct loop_ep *) _ep;
+	void			*src;
+
+	UNUSED(_mr);
+
+	src = loop_remote_buf(ep, addr, len, key);
+	if (!src)
+		return -EFAULT;
+
+	memcpy(buf, src, len);
+
+	return 0;
+}
+
+static int loop_rma_write(struct xp_ep *_ep, void *buf, u64 addr, u64 len,
+			  u32 key, struct xp_mr *_mr, struct nvme_command *cmd)
+{
+	struct loop_ep		*ep = (struct loop_ep *) _ep;
+	void			*dst;
+
+	UNUSED(_mr);
+	UNUSED(cmd);
+
+	dst = loop_remote_buf(ep, addr, len, key);
+	if (!dst)
+		return -EFAULT;
+
+	memcpy(dst, buf, len);
+
+	return 0;
+}
+
+static int loop_alloc_key(struct xp_ep *_ep, void *buf, int len,
+			  struct xp_mr **_mr)
+{
+	struct loop_mr		*mr;
+
+	if (!_ep || !_mr) {
+		print_err("invalid arguments");
+		return -EINVAL;
+	}
+
+	mr = malloc(sizeof(*mr));
+	if (!mr)
+		return -ENOMEM;
+
+	mr->buf = buf;
+	mr->len = len;
+
+	pthread_mutex_lock(&loop_lock);
+
+	mr->key = next_key++;
+	if (!next_key)
+		next_key = 1;
+
+	mr->next = keys[mr->key % LOOP_KEY_HASH];
+	keys[mr->key % LOOP_KEY_HASH] = mr;
+
+	pthread_mutex_unlock(&loop_lock);
+
+	*_mr = (struct xp_mr *) mr;
+
+	return 0;
+}
+
+static u32 loop_remote_key(struct xp_mr *_mr)
+{
+	struct loop_mr		*mr = (struct loop_mr *) _mr;
+
+	if (!_mr) {
+		print_err("invalid arguments");
+		return 0;
+	}
+
+	return mr->key;
+}
+
+static int loop_dealloc_key(struct xp_mr *_mr)
+{
+	struct loop_mr		*mr = (struct loop_mr *) _mr;
+	struct loop_mr		**p;
+
+	if (!_mr) {
+		print_err("invalid arguments");
+		return -EINVAL;
+	}
+
+	pthread_mutex_lock(&loop_lock);
+
+	for (p = &keys[mr->key % LOOP_KEY_HASH]; *p; p = &(*p)->next)
+		if (*p == mr) {
+			*p = mr->next;
+			break;
+		}
+
+	pthread_mutex_unlock(&loop_lock);
+
+	free(mr);
+
+	return 0;
+}
+
+static int loop_build_connect_data(void **req, char *hostnqn)
+{
+	UNUSED(hostnqn);
+
+	*req = NULL;
+
+	return 0;
+}
+
+static void loop_set_sgl(struct nvme_command *cmd, u8 opcode, int len,
+			 void *data, int key)
+{
+	struct nvme_keyed_sgl_desc	*sg;
+
+	memset(cmd, 0, sizeof(*cmd));
+
+	cmd->common.opcode	= opcode;
+	cmd->common.flags	= NVME_CMD_SGL_METABUF;
+
+	sg = &cmd->common.dptr.ksgl;
+	put_unaligned_le32(key, sg->key);
+	put_unaligned_le24(len, sg->length);
+	sg->type = NVME_KEY_SGL_FMT_DATA_DESC << 4;
+
+	sg->addr = (u64) data;
+}
+
+static struct xp_ops loop_ops = {
+	.init_endpoint		= loop_init_endpoint,
+	.create_endpoint	= loop_create_endpoint,
+	.destroy_endpoint	= loop_destroy_endpoint,
+	.init_listener		= loop_init_listener,
+	.destroy_listener	= loop_destroy_listener,
+	.wait_for_connection	= loop_wait_for_connection,
+	.stop_listener		= loop_stop_listener,
+	.accept_connection	= loop_accept_connection,
+	.reject_connection	= loop_reject_connection,
+	.client_connect		= loop_client_connect,
+	.rma_read		= loop_rma_read,
+	.rma_write		= loop_rma_write,
+	.repost_recv		= loop_repost_recv,
+	.post_msg		= loop_send_msg,
+	.send_msg		= loop_send_msg,
+	.send_rsp		= loop_send_msg,
+	.poll_for_msg		= loop_poll_for_msg,
+	.event_fd		= loop_event_fd,
+	.alloc_key		= loop_alloc_key,
+	.remote_key		= loop_remote_key,
+	.dealloc_key		= loop_dealloc_key,
+	.build_connect_data	= loop_build_connect_data,
+	.set_sgl		= loop_set_sgl,
+};
+
+struct xp_ops *loop_register_ops(void)
+{
+	return &loop_ops;
+}
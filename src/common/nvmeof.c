@@ -36,6 +36,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <endian.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
@@ -200,51 +201,146 @@ found:
 	return str;
 }
 
+/* commands are built in the endpoint's registered command page, one
+ * struct nvme_command per command id, so each outstanding command keeps
+ * its own buffer and completion context
+ */
+static struct nvme_command *get_cmd(struct endpoint *ep)
+{
+	struct cmd_ctx		*ctx;
+	int			 cid;
+
+	if (!ep->cmd)
+		return NULL;
+
+	for (cid = 0; cid < NVMF_DQ_DEPTH; cid++) {
+		ctx = &ep->ctx[cid];
+		if (!ctx->busy) {
+			memset(ctx, 0, sizeof(*ctx));
+			ctx->busy = 1;
+			return &ep->cmd[cid];
+		}
+	}
+
+	print_err("no free command id on queue");
+
+	return NULL;
+}
+
+static void drop_ep_buf(struct endpoint *ep, struct xp_buf *buf);
+
+/* the transport stops landing data for the id before a buffer held for a
+ * command given up on is let go
+ */
+static void release_cmd(struct endpoint *ep, struct cmd_ctx *ctx)
+{
+	if (ep->ep && ep->ops->release_cid)
+		ep->ops->release_cid(ep->ep, ctx - ep->ctx);
+
+	if (ctx->stale && ctx->buf)
+		drop_ep_buf(ep, ctx->buf);
+
+	ctx->buf = NULL;
+	ctx->stale = 0;
+	ctx->busy = 0;
+}
+
+static inline void put_cmd(struct endpoint *ep, struct nvme_command *cmd)
+{
+	release_cmd(ep, &ep->ctx[cmd - ep->cmd]);
+}
+
+/* a completion may still arrive for a command that was sent and then given
+ * up on, so its id is held back rather than reused, along with the buffer
+ * the peer may still write
+ */
+static inline void abandon_cmd(struct cmd_ctx *ctx)
+{
+	ctx->stale = 1;
+}
+
+/* return the buffer of a synchronous command unless it went with the id */
+static void end_cmd_buf(struct endpoint *ep, struct nvme_command *cmd,
+			struct xp_buf *buf, int ret)
+{
+	struct cmd_ctx		*ctx = &ep->ctx[cmd - ep->cmd];
+
+	if (ctx->busy && ctx->stale && ctx->buf == buf)
+		return;
+
+	if (ret)
+		drop_ep_buf(ep, buf);
+	else
+		put_ep_buf(ep, buf);
+}
+
 static inline int post_cmd(struct endpoint *ep, struct nvme_command *cmd,
 			   int bytes)
 {
+	cmd->common.command_id = cmd - ep->cmd;
+
 	return ep->ops->post_msg(ep->ep, cmd, bytes, ep->mr);
 }
 
 static inline int send_cmd(struct endpoint *ep, struct nvme_command *cmd,
 			   int bytes)
 {
+	cmd->common.command_id = cmd - ep->cmd;
+
 	return ep->ops->send_msg(ep->ep, cmd, bytes, ep->mr);
 }
 
-int process_nvme_rsp(struct endpoint *ep, int ignore_status, u64 *result)
+/* take one completion off the queue and record it against its command */
+static int reap_nvme_rsp(struct endpoint *ep)
 {
 	struct xp_qe		*qe;
 	struct nvme_completion	*rsp;
-	struct timeval		 t0;
+	struct cmd_ctx		*ctx;
+	u16			 cid;
 	int			 bytes;
 	int			 ret;
 
-	gettimeofday(&t0, NULL);
+	ret = ep->ops->poll_for_msg(ep->ep, &qe, (void **) &rsp, &bytes);
+	if (ret)
+		return ret;
 
-	while (1) {
-		ret = ep->ops->poll_for_msg(ep->ep, &qe, (void **) &rsp,
-					    &bytes);
-		if (!ret)
-			break;
+	if (bytes != sizeof(*rsp)) {
+		ret = -EINVAL;
+		goto out;
+	}
 
-		if (ret != -EAGAIN)
-			return ret;
+	cid = rsp->command_id;
+	if (cid >= NVMF_DQ_DEPTH || !ep->ctx[cid].busy) {
+		print_err("completion for unknown command id %u", cid);
+		goto out;
+	}
 
-		if (stopped)
-			return -ESHUTDOWN;
+	ctx = &ep->ctx[cid];
 
-		if (msec_delta(t0) > MSG_TIMEOUT)
-			return -EAGAIN;
+	/* the command was given up on, its id can be used again now */
+	if (ctx->stale) {
+		release_cmd(ep, ctx);
+		goto out;
 	}
 
-	if (bytes != sizeof(*rsp))
-		return -EINVAL;
+	ctx->status = rsp->status >> 1;
+	ctx->result = rsp->result.U64;
+	ctx->done = 1;
+out:
+	ep->ops->repost_recv(ep->ep, qe);
+
+	return ret;
+}
+
+static int complete_cmd(struct endpoint *ep, struct cmd_ctx *ctx,
+			int ignore_status, u64 *result)
+{
+	int			 ret = ctx->status;
 
-	ret = rsp->status >> 1;
+	release_cmd(ep, ctx);
 
 	if (!ret && result)
-		*result = rsp->result.U64;
+		*result = ctx->result;
 
 	if (ret) {
 		if (ret == (NVME_SC_DNR | NVME_SC_CONNECT_INVALID_HOST))
@@ -256,190 +352,627 @@ int process_nvme_rsp(struct endpoint *ep, int ignore_status, u64 *result)
 				  ret);
 	}
 
-	ep->ops->repost_recv(ep->ep, qe);
+	return ret;
+}
+
+/* sleep until the transport has something for the queue or ms pass */
+static void wait_for_event(struct endpoint *ep, int ms)
+{
+	struct pollfd		 fds;
+
+	if (ms <= 0)
+		return;
+
+	fds.fd = ep->ops->event_fd(ep->ep);
+	fds.events = POLLIN;
+
+	poll(&fds, 1, ms);
+}
+
+/* wait for a specific command, completions for other commands on the
+ * queue are recorded as they arrive. The command id is released on
+ * return, a completion that turns up after a timeout is dropped
+ */
+static int wait_for_rsp(struct endpoint *ep, struct nvme_command *cmd,
+			int ignore_status, u64 *result, int timeout)
+{
+	struct cmd_ctx		*ctx = &ep->ctx[cmd - ep->cmd];
+	u64			 deadline = monotonic_ms() + timeout;
+	int			 ret;
+
+	while (!ctx->done) {
+		ret = reap_nvme_rsp(ep);
+		if (!ret)
+			continue;
+
+		if (ret != -EAGAIN)
+			goto err;
+
+		if (stopped) {
+			ret = -ESHUTDOWN;
+			goto err;
+		}
+
+		if (monotonic_ms() >= deadline)
+			goto err;
+
+		wait_for_event(ep, deadline - monotonic_ms());
+	}
+
+	return complete_cmd(ep, ctx, ignore_status, result);
+err:
+	abandon_cmd(ctx);
 
 	return ret;
 }
 
+static int exec_cmd(struct endpoint *ep, struct nvme_command *cmd,
+		    int ignore_status, u64 *result, int timeout)
+{
+	int			 ret;
+
+	ret = send_cmd(ep, cmd, sizeof(*cmd));
+	if (ret) {
+		put_cmd(ep, cmd);
+		return ret;
+	}
+
+	return wait_for_rsp(ep, cmd, ignore_status, result, timeout);
+}
+
+/* wait for the completion of a command nobody is waiting on, i.e. an
+ * outstanding async event request
+ */
+int process_nvme_rsp(struct endpoint *ep, int ignore_status, u64 *result)
+{
+	struct cmd_ctx		*ctx;
+	u64			 deadline = monotonic_ms() + MSG_TIMEOUT;
+	int			 cid;
+	int			 ret;
+
+	while (1) {
+		for (cid = 0; cid < NVMF_DQ_DEPTH; cid++) {
+			ctx = &ep->ctx[cid];
+			if (ctx->busy && ctx->async && ctx->done)
+				return complete_cmd(ep, ctx, ignore_status,
+						    result);
+		}
+
+		ret = reap_nvme_rsp(ep);
+		if (!ret)
+			continue;
+
+		if (ret != -EAGAIN)
+			return ret;
+
+		if (stopped)
+			return -ESHUTDOWN;
+
+		if (monotonic_ms() >= deadline)
+			return -EAGAIN;
+
+		wait_for_event(ep, deadline - monotonic_ms());
+	}
+}
+
 static int send_fabric_connect(struct ctrl_queue *ctrl)
 {
 	struct endpoint		*ep = &ctrl->ep;
 	struct nvmf_connect_data *data;
-	struct nvme_command	*cmd = ep->cmd;
-	int			 bytes;
+	struct nvme_command	*cmd;
 	int			 key;
 	int			 ret;
 	int			 ignore_status;
 
-	bytes = sizeof(*cmd);
 	data = ep->data;
 	key = ep->ops->remote_key(ep->data_mr);
 
+	data->cntlid = htole16(NVME_CNTLID_DYNAMIC);
+	strncpy(data->subsysnqn, NVME_DISC_SUBSYS_NAME, NVMF_NQN_SIZE);
+	strncpy(data->hostnqn, ctrl->hostnqn, NVMF_NQN_SIZE);
+
+	ignore_status = NVME_SC_DNR | NVME_SC_INVALID_FIELD;
+retry:
+	cmd = get_cmd(ep);
+	if (!cmd)
+		return -EBUSY;
+
 	ep->ops->set_sgl(cmd, nvme_fabrics_command, sizeof(*data), data, key);
 
 	cmd->connect.fctype	= nvme_fabrics_type_connect;
 	cmd->connect.qid	= htole16(0);
-	cmd->connect.sqsize	= htole16(NVMF_DQ_DEPTH);
+	cmd->connect.sqsize	= htole16(NVMF_DQ_DEPTH - 1);
 
 	if (!ctrl->failed_kato)
 		cmd->connect.kato = htole16(NVME_DISC_KATO_MS);
+	else
+		ignore_status = 0;
 
-	data->cntlid = htole16(NVME_CNTLID_DYNAMIC);
-	strncpy(data->subsysnqn, NVME_DISC_SUBSYS_NAME, NVMF_NQN_SIZE);
-	strncpy(data->hostnqn, ctrl->hostnqn, NVMF_NQN_SIZE);
+	ret = exec_cmd(ep, cmd, ignore_status, NULL, MSG_TIMEOUT);
+	if (ret && ret == ignore_status) {
+		ctrl->failed_kato = 1;
+		goto retry;
+	}
 
-	ret = send_cmd(ep, cmd, bytes);
-	if (ret)
-		goto out;
+	if (!ret)
+		ep->state = CONNECTED;
 
-	ignore_status = NVME_SC_DNR | NVME_SC_INVALID_FIELD;
+	return ret;
+}
 
-	ret = process_nvme_rsp(ep, ignore_status, NULL);
-	if (ret != ignore_status)
-		goto out;
+static inline int send_admin_cmd(struct endpoint *ep, u8 opcode)
+{
+	struct nvme_command		*cmd;
+	int				 ret;
 
-	cmd->connect.kato = 0;
-	ctrl->failed_kato = 1;
+	cmd = get_cmd(ep);
+	if (!cmd)
+		return -EBUSY;
 
-	ret = send_cmd(ep, cmd, bytes);
-	if (ret)
-		goto out;
+	ep->ops->set_sgl(cmd, opcode, 0, NULL, 0);
 
-	ret = process_nvme_rsp(ep, 0, NULL);
-	if (ret)
+	ret = send_cmd(ep, cmd, sizeof(*cmd));
+	if (ret) {
+		put_cmd(ep, cmd);
 		goto out;
+	}
 
-	ep->state = CONNECTED;
-
+	ret = wait_for_rsp(ep, cmd, 0, NULL, MSG_TIMEOUT);
 out:
 	return ret;
 }
 
-static inline int send_admin_cmd(struct endpoint *ep, u8 opcode)
+/* the request stays outstanding until the controller has an event to
+ * report, its completion is picked up by process_nvme_rsp
+ */
+int send_async_event_request(struct endpoint *ep)
 {
-	struct nvme_command		*cmd = ep->cmd;
-	int				 bytes;
+	struct nvme_command		*cmd;
 	int				 ret;
 
-	bytes = sizeof(*cmd);
+	cmd = get_cmd(ep);
+	if (!cmd)
+		return -EBUSY;
 
-	ep->ops->set_sgl(cmd, opcode, 0, NULL, 0);
+	ep->ops->set_sgl(cmd, nvme_admin_async_event, 0, NULL, 0);
 
-	ret = send_cmd(ep, cmd, bytes);
+	ep->ctx[cmd - ep->cmd].async = 1;
+
+	ret = send_cmd(ep, cmd, sizeof(*cmd));
 	if (ret)
+		put_cmd(ep, cmd);
+
+	return ret;
+}
+
+int send_keep_alive(struct endpoint *ep)
+{
+	return send_admin_cmd(ep, nvme_admin_keep_alive);
+}
+
+static int alloc_ep_buf(struct endpoint *ep, struct xp_buf *buf, int size)
+{
+	void			*data;
+	int			 ret;
+
+	if (posix_memalign(&data, PAGE_SIZE, size))
+		return -ENOMEM;
+
+	ret = ep->ops->alloc_key(ep->ep, data, size, &buf->mr);
+	if (ret) {
+		free(data);
+		return ret;
+	}
+
+	buf->buf = data;
+	buf->size = size;
+
+	return 0;
+}
+
+static void dealloc_ep_buf(struct endpoint *ep, struct xp_buf *buf)
+{
+	ep->ops->dealloc_key(buf->mr);
+	free(buf->buf);
+
+	buf->buf = NULL;
+	buf->mr = NULL;
+	buf->size = 0;
+}
+
+/* get a registered buffer of at least len bytes, reusing the endpoint's
+ * buffer for that size class when it is not already in use
+ */
+int get_ep_buf(struct endpoint *ep, int len, struct xp_buf **_buf)
+{
+	struct xp_buf		*buf;
+	int			 size = PAGE_SIZE << 1;
+	int			 i;
+	int			 ret;
+
+	for (i = 0; i < NUM_BUF_CLASSES; i++, size <<= 1)
+		if (len <= size)
+			break;
+
+	/* hosts may issue commands on one endpoint from several threads */
+	if (i < NUM_BUF_CLASSES &&
+	    !__atomic_exchange_n(&ep->pool[i].busy, 1, __ATOMIC_ACQUIRE)) {
+		buf = &ep->pool[i];
+		if (!buf->buf) {
+			ret = alloc_ep_buf(ep, buf, size);
+			if (ret) {
+				__atomic_store_n(&buf->busy, 0, __ATOMIC_RELEASE);
+				return ret;
+			}
+			buf->pooled = 1;
+		}
 		goto out;
+	}
+
+	buf = malloc(sizeof(*buf));
+	if (!buf)
+		return -ENOMEM;
+
+	memset(buf, 0, sizeof(*buf));
 
-	process_nvme_rsp(ep, 0, NULL);
+	ret = alloc_ep_buf(ep, buf, len);
+	if (ret) {
+		free(buf);
+		return ret;
+	}
 out:
+	buf->busy = 1;
+	*_buf = buf;
+
+	return 0;
+}
+
+void put_ep_buf(struct endpoint *ep, struct xp_buf *buf)
+{
+	if (buf->pooled) {
+		buf->used = monotonic_ms();
+		__atomic_store_n(&buf->busy, 0, __ATOMIC_RELEASE);
+		return;
+	}
+
+	dealloc_ep_buf(ep, buf);
+	free(buf);
+}
+
+/* after a failed command the peer may still write to the buffer, so its
+ * key is released rather than handed out again
+ */
+static void drop_ep_buf(struct endpoint *ep, struct xp_buf *buf)
+{
+	if (buf->pooled)
+		dealloc_ep_buf(ep, buf);
+
+	put_ep_buf(ep, buf);
+}
+
+/* release the pooled buffers not used for idle_ms */
+void trim_ep_bufs(struct endpoint *ep, int idle_ms)
+{
+	struct xp_buf		*buf;
+	u64			 now = monotonic_ms();
+	int			 i;
+
+	for (i = 0; i < NUM_BUF_CLASSES; i++) {
+		buf = &ep->pool[i];
+
+		if (__atomic_exchange_n(&buf->busy, 1, __ATOMIC_ACQUIRE))
+			continue;
+
+		if (buf->buf && now - buf->used >= (u64) idle_ms)
+			dealloc_ep_buf(ep, buf);
+
+		__atomic_store_n(&buf->busy, 0, __ATOMIC_RELEASE);
+	}
+}
+
+void free_ep_bufs(struct endpoint *ep)
+{
+	int			 i;
+
+	for (i = 0; i < NUM_BUF_CLASSES; i++)
+		if (ep->pool[i].buf) {
+			dealloc_ep_buf(ep, &ep->pool[i]);
+			ep->pool[i].busy = 0;
+		}
+}
+
+/* asynchronous commands return once the command is sent, poll_cmds run by
+ * whoever owns the queue calls back on completion or expiry.  One thread
+ * can keep many queues busy this way; a synchronous wait on the same
+ * queue records completions for poll_cmds to pick up later.
+ */
+
+/* the context is copied and the command id released before the callback
+ * runs so the callback may submit again
+ */
+static void finish_cmd(struct endpoint *ep, struct cmd_ctx *ctx, int status)
+{
+	struct cmd_ctx		 done = *ctx;
+
+	if (status == -ETIMEDOUT) {
+		abandon_cmd(ctx);
+		done.buf = NULL;
+	} else
+		release_cmd(ep, ctx);
+
+	if (done.buf) {
+		if (!status && done.len) {
+			done.data = malloc(done.len);
+			if (done.data)
+				memcpy(done.data, done.buf->buf, done.len);
+			else
+				status = -ENOMEM;
+		}
+
+		if (status)
+			drop_ep_buf(ep, done.buf);
+		else
+			put_ep_buf(ep, done.buf);
+	}
+
+	if (status > 0)
+		print_err("status %s (0x%x)", nvme_str_status(status), status);
+
+	done.status = status;
+	done.fn(ep, &done, status);
+}
+
+static void abort_cmds(struct endpoint *ep, int status)
+{
+	struct cmd_ctx		*ctx;
+	int			 cid;
+
+	for (cid = 0; cid < NVMF_DQ_DEPTH; cid++) {
+		ctx = &ep->ctx[cid];
+		if (ctx->busy && ctx->fn && !ctx->stale)
+			finish_cmd(ep, ctx, ctx->done ? ctx->status : status);
+	}
+}
+
+/* on a send failure the callback is not called and buf is released */
+static int submit_cmd(struct endpoint *ep, struct nvme_command *cmd,
+		      struct xp_buf *buf, int len, int timeout,
+		      cmd_done_fn fn, void *arg)
+{
+	struct cmd_ctx		*ctx = &ep->ctx[cmd - ep->cmd];
+	int			 ret;
+
+	ctx->fn		= fn;
+	ctx->arg	= arg;
+	ctx->buf	= buf;
+	ctx->len	= len;
+	ctx->deadline	= monotonic_ms() + timeout;
+
+	ret = send_cmd(ep, cmd, sizeof(*cmd));
+	if (ret) {
+		put_cmd(ep, cmd);
+		if (buf)
+			drop_ep_buf(ep, buf);
+	}
+
 	return ret;
 }
 
-int send_async_event_request(struct endpoint *ep)
+/* returns the number of commands completed, or the transport error that
+ * failed every outstanding command
+ */
+int poll_cmds(struct endpoint *ep)
 {
-	return send_admin_cmd(ep, nvme_admin_async_event);
+	struct cmd_ctx		*ctx;
+	u64			 now;
+	int			 cid;
+	int			 cnt = 0;
+	int			 ret;
+
+	if (!ep->cmd)
+		return -ENOTCONN;
+
+	/* a malformed response is dropped, not fatal */
+	do {
+		ret = reap_nvme_rsp(ep);
+	} while (!ret || ret == -EINVAL);
+
+	if (ret != -EAGAIN) {
+		abort_cmds(ep, ret);
+		return ret;
+	}
+
+	now = monotonic_ms();
+
+	for (cid = 0; cid < NVMF_DQ_DEPTH; cid++) {
+		ctx = &ep->ctx[cid];
+		if (!ctx->busy || !ctx->fn || ctx->stale)
+			continue;
+
+		if (ctx->done)
+			finish_cmd(ep, ctx, ctx->status);
+		else if (now >= ctx->deadline)
+			finish_cmd(ep, ctx, -ETIMEDOUT);
+		else
+			continue;
+
+		cnt++;
+	}
+
+	return cnt;
 }
 
-int send_keep_alive(struct endpoint *ep)
+/* as poll_cmds, after sleeping up to ms for the queue to have something */
+int wait_cmds(struct endpoint *ep, int ms)
 {
-	return send_admin_cmd(ep, nvme_admin_keep_alive);
+	if (!ep->cmd)
+		return -ENOTCONN;
+
+	wait_for_event(ep, ms);
+
+	return poll_cmds(ep);
+}
+
+int send_keep_alive_async(struct endpoint *ep, int timeout, cmd_done_fn fn,
+			  void *arg)
+{
+	struct nvme_command		*cmd;
+
+	cmd = get_cmd(ep);
+	if (!cmd)
+		return -EBUSY;
+
+	ep->ops->set_sgl(cmd, nvme_admin_keep_alive, 0, NULL, 0);
+
+	return submit_cmd(ep, cmd, NULL, 0, timeout, fn, arg);
 }
 
 int send_mi_receive(struct endpoint *ep, int fcid, int len, void **_data)
 {
-	struct nvme_command		*cmd = ep->cmd;
-	struct xp_mr			*mr;
-	u64				*data;
-	int				 bytes;
+	struct nvme_command		*cmd;
+	struct xp_buf			*buf;
+	void				*data;
 	int				 key;
-	int				 cnt = CONFIG_RETRY_COUNT;
 	int				 ret;
 
+	cmd = get_cmd(ep);
 	if (!cmd)
 		return -EINVAL;
 
-	bytes = sizeof(*cmd);
+	data = malloc(len);
+	if (!data) {
+		put_cmd(ep, cmd);
+		return -ENOMEM;
+	}
 
-	if (posix_memalign((void **) &data, PAGE_SIZE, len)) {
-		print_errno("posix_memalign failed", errno);
-		return errno;
+	ret = get_ep_buf(ep, len, &buf);
+	if (ret) {
+		put_cmd(ep, cmd);
+		free(data);
+		return ret;
 	}
 
-	memset(data, 0, PAGE_SIZE);
+	memset(buf->buf, 0, len);
 
-	ret = ep->ops->alloc_key(ep->ep, data, PAGE_SIZE, &mr);
-	if (ret)
-		return ret;
+	ep->ctx[cmd - ep->cmd].buf = buf;
 
-	key = ep->ops->remote_key(mr);
+	key = ep->ops->remote_key(buf->mr);
 
-	ep->ops->set_sgl(cmd, nvme_mi_receive, len, data, key);
+	ep->ops->set_sgl(cmd, nvme_mi_receive, len, buf->buf, key);
 
 	cmd->mi_cmd.mi_opcode	= nvme_mi_nvmeof_config_get;
 	cmd->mi_cmd.fcid	= fcid;
 
-	*_data = data;
-
-	ret = send_cmd(ep, cmd, bytes);
+	ret = send_cmd(ep, cmd, sizeof(*cmd));
 	if (ret) {
-		free(data);
-		goto out;
+		put_cmd(ep, cmd);
+		goto err;
 	}
 
-	do {
-		usleep(CONFIG_TIMEOUT);
-		ret = process_nvme_rsp(ep, 0, NULL);
-	} while (ret == -EAGAIN && --cnt);
-out:
-	ep->ops->dealloc_key(mr);
+	usleep(CONFIG_TIMEOUT);
+
+	ret = wait_for_rsp(ep, cmd, 0, NULL, CONFIG_RETRY_COUNT * MSG_TIMEOUT);
+	if (ret)
+		goto err;
+
+	memcpy(data, buf->buf, len);
+	put_ep_buf(ep, buf);
+
+	*_data = data;
+
+	return 0;
+err:
+	end_cmd_buf(ep, cmd, buf, ret);
+	free(data);
 
 	return ret;
 }
 
-int send_mi_send(struct endpoint *ep, int fcid, int len, void *data)
+static int prep_mi_send(struct endpoint *ep, struct nvme_command *cmd,
+			int fcid, int len, void *data, struct xp_buf **_buf)
 {
-	struct nvme_command		*cmd = ep->cmd;
-	struct xp_mr			*mr;
-	int				 bytes;
+	struct xp_buf			*buf;
 	int				 key;
-	int				 cnt = CONFIG_RETRY_COUNT;
 	int				 ret;
 
-	if (!cmd)
-		return -EINVAL;
-
-	bytes = sizeof(*cmd);
-
-	ret = ep->ops->alloc_key(ep->ep, data, len, &mr);
+	ret = get_ep_buf(ep, len, &buf);
 	if (ret)
 		return ret;
 
-	key = ep->ops->remote_key(mr);
+	memcpy(buf->buf, data, len);
 
-	ep->ops->set_sgl(cmd, nvme_mi_send, len, data, key);
+	ep->ctx[cmd - ep->cmd].buf = buf;
+
+	key = ep->ops->remote_key(buf->mr);
+
+	ep->ops->set_sgl(cmd, nvme_mi_send, len, buf->buf, key);
 
 	cmd->mi_cmd.mi_opcode	= nvme_mi_nvmeof_config_set;
 	cmd->mi_cmd.fcid	= fcid;
 
-	ret = send_cmd(ep, cmd, bytes);
-	if (ret)
+	*_buf = buf;
+
+	return 0;
+}
+
+int send_mi_send(struct endpoint *ep, int fcid, int len, void *data)
+{
+	struct nvme_command		*cmd;
+	struct xp_buf			*buf;
+	int				 ret;
+
+	cmd = get_cmd(ep);
+	if (!cmd)
+		return -EINVAL;
+
+	ret = prep_mi_send(ep, cmd, fcid, len, data, &buf);
+	if (ret) {
+		put_cmd(ep, cmd);
+		return ret;
+	}
+
+	ret = send_cmd(ep, cmd, sizeof(*cmd));
+	if (ret) {
+		put_cmd(ep, cmd);
 		goto out;
+	}
 
-	do {
-		usleep(CONFIG_TIMEOUT);
-		ret = process_nvme_rsp(ep, 0, NULL);
-	} while (ret == -EAGAIN && --cnt);
+	usleep(CONFIG_TIMEOUT);
+
+	ret = wait_for_rsp(ep, cmd, 0, NULL, CONFIG_RETRY_COUNT * MSG_TIMEOUT);
 out:
+	end_cmd_buf(ep, cmd, buf, ret);
 
 	return ret;
 }
 
-static int send_get_property(struct endpoint *ep, u32 reg)
+int send_mi_send_async(struct endpoint *ep, int fcid, int len, void *data,
+		       int timeout, cmd_done_fn fn, void *arg)
 {
-	struct nvme_command		*cmd = ep->cmd;
-	int				 bytes;
+	struct nvme_command		*cmd;
+	struct xp_buf			*buf;
 	int				 ret;
 
-	bytes = sizeof(*cmd);
+	cmd = get_cmd(ep);
+	if (!cmd)
+		return -EBUSY;
+
+	ret = prep_mi_send(ep, cmd, fcid, len, data, &buf);
+	if (ret) {
+		put_cmd(ep, cmd);
+		return ret;
+	}
+
+	return submit_cmd(ep, cmd, buf, 0, timeout, fn, arg);
+}
+
+static int send_get_property(struct endpoint *ep, u32 reg)
+{
+	struct nvme_command		*cmd;
+
+	cmd = get_cmd(ep);
+	if (!cmd)
+		return -EBUSY;
 
 	ep->ops->set_sgl(cmd, nvme_fabrics_command, 0, NULL, 0);
 
@@ -447,17 +980,12 @@ static int send_get_property(struct endpoint *ep, u32 reg)
 	cmd->prop_get.attrib	= 1;
 	cmd->prop_get.offset	= htole32(reg);
 
-	ret = send_cmd(ep, cmd, bytes);
-	if (ret)
-		return ret;
-
-	return process_nvme_rsp(ep, 0, NULL);
+	return exec_cmd(ep, cmd, 0, NULL, MSG_TIMEOUT);
 }
 
-static void prep_set_property(struct endpoint *ep, u32 reg, u64 val)
+static void prep_set_property(struct endpoint *ep, struct nvme_command *cmd,
+			      u32 reg, u64 val)
 {
-	struct nvme_command		*cmd = ep->cmd;
-
 	ep->ops->set_sgl(cmd, nvme_fabrics_command, 0, NULL, 0);
 
 	cmd->prop_set.fctype	= nvme_fabrics_type_property_set;
@@ -467,126 +995,202 @@ static void prep_set_property(struct endpoint *ep, u32 reg, u64 val)
 
 static int send_set_property(struct endpoint *ep, u32 reg, u64 val)
 {
-	struct nvme_command	*cmd = ep->cmd;
-	int			 ret;
+	struct nvme_command	*cmd;
 
-	prep_set_property(ep, reg, val);
+	cmd = get_cmd(ep);
+	if (!cmd)
+		return -EBUSY;
 
-	ret = send_cmd(ep, cmd, sizeof(*cmd));
-	if (ret)
-		return ret;
+	prep_set_property(ep, cmd, reg, val);
 
-	return process_nvme_rsp(ep, 0, NULL);
+	return exec_cmd(ep, cmd, 0, NULL, MSG_TIMEOUT);
 }
 
+/* fire and forget, only used as the queue is torn down */
 static int post_set_property(struct endpoint *ep, u32 reg, u64 val)
 {
-	struct nvme_command	*cmd = ep->cmd;
+	struct nvme_command	*cmd;
+
+	cmd = get_cmd(ep);
+	if (!cmd)
+		return -EBUSY;
 
-	prep_set_property(ep, reg, val);
+	prep_set_property(ep, cmd, reg, val);
 
 	return post_cmd(ep, cmd, sizeof(*cmd));
 }
 
-int send_get_log_page(struct endpoint *ep, int log_size,
-		      struct nvmf_disc_rsp_page_hdr **log)
+/* the log lands in the endpoint's registered pool, so steady state fetches
+ * never register memory, and the caller gets a copy of its own to free
+ */
+static int prep_get_log_page(struct endpoint *ep, struct nvme_command *cmd,
+			     int log_size, struct xp_buf **_buf)
 {
-	struct nvme_command		*cmd = ep->cmd;
-	struct xp_mr			*mr;
-	u64				*data;
-	int				 bytes;
+	struct xp_buf			*buf;
 	u32				 size;
 	u16				 numdl;
 	u16				 numdu;
 	int				 key;
 	int				 ret;
 
-	bytes = sizeof(*cmd);
-
-	if (posix_memalign((void **) &data, PAGE_SIZE, log_size)) {
-		print_errno("posix_memalign failed", errno);
-		return errno;
-	}
-
-	memset(data, 0, log_size);
-
-	ret = ep->ops->alloc_key(ep->ep, data, log_size, &mr);
+	ret = get_ep_buf(ep, log_size, &buf);
 	if (ret)
 		return ret;
 
-	key = ep->ops->remote_key(mr);
+	memset(buf->buf, 0, log_size);
+
+	ep->ctx[cmd - ep->cmd].buf = buf;
+
+	key = ep->ops->remote_key(buf->mr);
 
 	size	= htole32((log_size / 4) - 1);
 	numdl	= size & 0xffff;
 	numdu	= (size >> 16) & 0xffff;
 
-	ep->ops->set_sgl(cmd, nvme_admin_get_log_page, log_size, data, key);
+	ep->ops->set_sgl(cmd, nvme_admin_get_log_page, log_size, buf->buf,
+			 key);
 
 	cmd->get_log_page.lid	= NVME_LOG_DISC;
 	cmd->get_log_page.numdl = numdl;
 	cmd->get_log_page.numdu = numdu;
 
-	*log = (struct nvmf_disc_rsp_page_hdr *) data;
+	*_buf = buf;
 
-	ret = send_cmd(ep, cmd, bytes);
-	if (ret)
+	return 0;
+}
+
+int send_get_log_page(struct endpoint *ep, int log_size,
+		      struct nvmf_disc_rsp_page_hdr **log)
+{
+	struct nvme_command		*cmd;
+	struct xp_buf			*buf;
+	void				*data;
+	int				 ret;
+
+	cmd = get_cmd(ep);
+	if (!cmd)
+		return -EBUSY;
+
+	data = malloc(log_size);
+	if (!data) {
+		put_cmd(ep, cmd);
+		return -ENOMEM;
+	}
+
+	ret = prep_get_log_page(ep, cmd, log_size, &buf);
+	if (ret) {
+		put_cmd(ep, cmd);
 		free(data);
+		return ret;
+	}
+
+	ret = send_cmd(ep, cmd, sizeof(*cmd));
+	if (ret)
+		put_cmd(ep, cmd);
 	else
-		ret = process_nvme_rsp(ep, 0, NULL);
+		ret = wait_for_rsp(ep, cmd, 0, NULL, MSG_TIMEOUT);
 
-	ep->ops->dealloc_key(mr);
+	if (ret) {
+		end_cmd_buf(ep, cmd, buf, ret);
+		free(data);
+		return ret;
+	}
 
-	return ret;
+	memcpy(data, buf->buf, log_size);
+	put_ep_buf(ep, buf);
+
+	*log = (struct nvmf_disc_rsp_page_hdr *) data;
+
+	return 0;
+}
+
+/* the callback gets the log in ctx->data */
+int send_get_log_page_async(struct endpoint *ep, int log_size, int timeout,
+			    cmd_done_fn fn, void *arg)
+{
+	struct nvme_command		*cmd;
+	struct xp_buf			*buf;
+	int				 ret;
+
+	cmd = get_cmd(ep);
+	if (!cmd)
+		return -EBUSY;
+
+	ret = prep_get_log_page(ep, cmd, log_size, &buf);
+	if (ret) {
+		put_cmd(ep, cmd);
+		return ret;
+	}
+
+	return submit_cmd(ep, cmd, buf, log_size, timeout, fn, arg);
 }
 
 int send_get_features(struct endpoint *ep, u8 fid, u64 *result)
 {
-	struct nvme_command		*cmd = ep->cmd;
-	int				 bytes;
+	struct nvme_command		*cmd;
 	int				 ret;
 
-	bytes = sizeof(*cmd);
+	cmd = get_cmd(ep);
+	if (!cmd)
+		return -EBUSY;
 
 	ep->ops->set_sgl(cmd, nvme_admin_get_features, 0, NULL, 0);
 
 	cmd->features.fid = htole32(fid);
 
-	ret = send_cmd(ep, cmd, bytes);
-	if (ret)
+	ret = send_cmd(ep, cmd, sizeof(*cmd));
+	if (ret) {
+		put_cmd(ep, cmd);
 		goto out;
+	}
 
-	process_nvme_rsp(ep, 0, result);
+	wait_for_rsp(ep, cmd, 0, result, MSG_TIMEOUT);
 out:
 	return ret;
 }
 
 int send_set_features(struct endpoint *ep, u8 fid, u32 dword11)
 {
-	struct nvme_command		*cmd = ep->cmd;
-	int				 bytes;
+	struct nvme_command		*cmd;
 	int				 ret;
 
-	bytes = sizeof(*cmd);
+	cmd = get_cmd(ep);
+	if (!cmd)
+		return -EBUSY;
 
 	ep->ops->set_sgl(cmd, nvme_admin_set_features, 0, NULL, 0);
 
 	cmd->features.fid	= htole32(fid);
 	cmd->features.dword11	= htole32(dword11);
 
-	ret = send_cmd(ep, cmd, bytes);
-	if (ret)
+	ret = send_cmd(ep, cmd, sizeof(*cmd));
+	if (ret) {
+		put_cmd(ep, cmd);
 		goto out;
+	}
 
-	process_nvme_rsp(ep, 0, NULL);
+	wait_for_rsp(ep, cmd, 0, NULL, MSG_TIMEOUT);
 out:
 	return ret;
 }
 
 void disconnect_endpoint(struct endpoint *ep, int shutdown)
 {
+	int			 i;
+
 	if (shutdown && (ep->state == CONNECTED))
 		post_set_property(ep, NVME_REG_CC, NVME_CTRL_DISABLE);
 
+	if (ep->cmd)
+		abort_cmds(ep, -ENOTCONN);
+
+	/* keys must be released before the endpoint they belong to */
+	for (i = 0; i < NVMF_DQ_DEPTH; i++)
+		if (ep->ctx[i].busy && ep->ctx[i].stale)
+			release_cmd(ep, &ep->ctx[i]);
+
+	free_ep_bufs(ep);
+
 	if (ep->mr)
 		ep->ops->dealloc_key(ep->mr);
 
@@ -599,6 +1203,9 @@ void disconnect_endpoint(struct endpoint *ep, int shutdown)
 	if (ep->cmd)
 		free(ep->cmd);
 
+	ep->cmd = NULL;
+	memset(ep->ctx, 0, sizeof(ep->ctx));
+
 	ep->state = DISCONNECTED;
 }
 
@@ -623,6 +1230,10 @@ int connect_ctrl(struct ctrl_queue *ctrl)
 	int			 ret = 0;
 	int			 cnt = CONNECT_RETRY_COUNT;
 
+	ctrl->kato_pending = 0;
+	ctrl->kato_status = 0;
+	ctrl->have_genctr = 0;
+
 	if (strcmp(portid->family, "ipv4") == 0) {
 		dest_in->sin_family = AF_INET;
 		dest_in->sin_port = htons(portid->port_num);
@@ -667,6 +1278,7 @@ int connect_ctrl(struct ctrl_queue *ctrl)
 		goto out;
 
 	ep->cmd = cmd;
+	memset(ep->ctx, 0, sizeof(ep->ctx));
 
 	if (posix_memalign(&data, PAGE_SIZE, PAGE_SIZE)) {
 		ret = -errno;
@@ -32,13 +32,31 @@
  * SOFTWARE.
  */
 
+/* Connections on one device share a protection domain, a shared receive
+ * queue fed from a single registered slab, one receive CQ and a small set
+ * of send CQs, so thousands of discovery hosts cost one set of verbs
+ * resources rather than one per host.  A thread per device drains the
+ * receive CQ, queues each message on its endpoint by QP number and flags
+ * the endpoint's eventfd, keeping the event_fd/poll_for_msg model intact.
+ *
+ * The same thread reaps the send CQs and keeps each endpoint's completion
+ * state, so data writes and responses are posted and left to complete.
+ * An RC queue pair delivers them in order, and poll_for_msg holds back a
+ * host's next command until its earlier sends have left, as the command
+ * reuses their buffers.  Only reads and host side send_msg wait.  A data
+ * write is held until the response is posted and goes out unsignaled in
+ * the same chain, so a command costs one doorbell and one completion.
+ */
+
 #include "common.h"
 
 #include <sys/time.h>
 #include <linux/types.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
 #include <time.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 
 #include <infiniband/verbs.h>
@@ -50,20 +68,80 @@
 #define RESOLVE_TIMEOUT		5000
 #define EVENT_TIMEOUT		200
 #define ABSURD_MAX_WRS		8192
+#define RDMA_SRQ_DEPTH		1024
+#define RDMA_EPS_PER_CQ		64
+#define RDMA_EP_HASH		256
+#define RDMA_WC_BATCH		16
+#define RDMA_MAX_INLINE		64
+
+/* a receive holds one command capsule, discovery has no in-capsule data */
+#define RDMA_ICD_SIZE		0
+#define RDMA_RECV_SIZE		(sizeof(struct nvme_command) + RDMA_ICD_SIZE)
 
 struct rdma_qe {
-	struct ibv_mr		*recv_mr;
+	struct rdma_qe		*next;
 	void			*buf;
-	__u64			 length;
+	u32			 bytes;
 };
-struct rdma_ep {
+
+/* send CQ shared by a group of endpoints, sized in work requests */
+struct rdma_scq {
+	struct rdma_scq		*next;
+	struct ibv_cq		*cq;
+	int			 capacity;
+	int			 used;
+};
+
+struct rdma_dev {
+	struct rdma_dev		*next;
+	struct ibv_context	*verbs;
 	struct ibv_pd		*pd;
+	struct ibv_comp_channel	*comp;
 	struct ibv_cq		*rcq;
-	struct ibv_cq		*scq;
-	struct ibv_comp_channel *comp;
+	struct ibv_srq		*srq;
+	struct ibv_mr		*mr;
+	void			*bufs;
+	struct rdma_qe		*qe;
+	int			 depth;
+	int			 max_cqe;
+	struct rdma_scq		*scqs;
+	struct rdma_ep		*hash[RDMA_EP_HASH];
+	/* source of rdma_ep.gen, under lock */
+	u64			 next_gen;
+	pthread_mutex_t		 lock;
+	pthread_t		 thread;
+	int			 running;
+	int			 stop;
+	int			 refs;
+};
+
+struct rdma_ep {
+	struct rdma_dev		*dev;
+	struct rdma_scq		*scq;
 	struct rdma_event_channel *ec;
 	struct rdma_cm_id	*id;
-	struct rdma_qe		*qe;
+	struct rdma_ep		*hnext;
+	pthread_mutex_t		 lock;
+	pthread_cond_t		 cond;
+	struct rdma_qe		*ready_head;
+	struct rdma_qe		*ready_tail;
+	u32			 qp_num;
+	/* carried in the wr_id of every send so completions left on the
+	 * shared CQ by an earlier QP with the same number are not credited
+	 */
+	u64			 gen;
+	int			 send_wrs;
+	int			 inline_size;
+	int			 efd;
+	int			 err;
+	/* signaled sends posted and their completions, under lock */
+	u32			 posted;
+	u32			 done;
+	int			 send_err;
+	/* rma_write staged to go out ahead of the next send */
+	struct ibv_send_wr	 write_wr;
+	struct ibv_sge		 write_sge;
+	int			 write_pending;
 	bool			 initiator;
 	__u8			 state;
 	__u64			 depth;
@@ -79,6 +157,9 @@ struct rdma_pep {
 	__u8			 state;
 };
 
+static struct rdma_dev		*rdma_devs;
+static pthread_mutex_t		 rdma_devs_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static struct {
 	int			 status;
 	char			*str;
@@ -122,82 +203,469 @@ static inline char *wc_str_status(u16 _status)
 	return str;
 }
 
-static void *alloc_buffer(struct rdma_ep *ep, int size, struct ibv_mr **_mr)
+static void rdma_wake(struct rdma_ep *ep)
 {
-	void			*buf;
-	struct ibv_mr		*mr;
-	int			 flags = IBV_ACCESS_LOCAL_WRITE |
-					 IBV_ACCESS_REMOTE_WRITE;
+	u64			 val = 1;
 
-	if (posix_memalign(&buf, PAGE_SIZE, size)) {
-		print_errno("posix_memalign failed", errno);
-		goto err1;
-	}
-	memset(buf, 0, size);
+	if (write(ep->efd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		print_errno("eventfd write failed", errno);
+}
 
-	mr = ibv_reg_mr(ep->pd, buf, size, flags);
-	if (!mr)
-		goto err2;
+static int rdma_post_srq(struct rdma_dev *dev, struct rdma_qe *qe)
+{
+	struct ibv_recv_wr	 wr, *bad_wr = NULL;
+	struct ibv_sge		 sge;
 
-	*_mr = mr;
+	memset(&wr, 0, sizeof(wr));
 
-	return buf;
-err2:
-	free(buf);
-err1:
-	*_mr = NULL;
+	wr.wr_id	= (uintptr_t) qe;
+	wr.sg_list	= &sge;
+	wr.num_sge	= 1;
+
+	sge.length	= RDMA_RECV_SIZE;
+	sge.addr	= (uintptr_t) qe->buf;
+	sge.lkey	= dev->mr->lkey;
+
+	return ibv_post_srq_recv(dev->srq, &wr, &bad_wr);
+}
+
+/* callers hold dev->lock */
+static struct rdma_ep *rdma_lookup_ep(struct rdma_dev *dev, u32 qp_num)
+{
+	struct rdma_ep		*ep;
+
+	for (ep = dev->hash[qp_num % RDMA_EP_HASH]; ep; ep = ep->hnext)
+		if (ep->qp_num == qp_num)
+			return ep;
 
 	return NULL;
 }
 
-static int rdma_create_queue_recv_pool(struct rdma_ep *ep)
+static void rdma_fail_ep(struct rdma_ep *ep)
 {
-	struct rdma_qe		*qe;
-	struct ibv_recv_wr	 wr, *bad_wr = NULL;
-	struct ibv_sge		 sge;
-	u16			 i;
+	pthread_mutex_lock(&ep->lock);
+	ep->err = -ECONNRESET;
+	pthread_mutex_unlock(&ep->lock);
+
+	rdma_wake(ep);
+}
+
+/* callers hold dev->lock, which keeps the endpoint from being unhashed
+ * and torn down while its message is queued and its eventfd written
+ */
+static void rdma_dev_recv(struct rdma_dev *dev, struct ibv_wc *wc)
+{
+	struct rdma_qe		*qe = (struct rdma_qe *) wc->wr_id;
+	struct rdma_ep		*ep;
+
+	ep = rdma_lookup_ep(dev, wc->qp_num);
+
+	if (!ep || wc->status != IBV_WC_SUCCESS) {
+		if (wc->status != IBV_WC_SUCCESS &&
+		    wc->status != IBV_WC_WR_FLUSH_ERR)
+			print_err("recv wc.status %s (%d)",
+				  wc_str_status(wc->status), wc->status);
+		if (ep)
+			rdma_fail_ep(ep);
+		if (!dev->stop && rdma_post_srq(dev, qe))
+			print_err("failed to repost receive buffer");
+		return;
+	}
+
+	qe->bytes = wc->byte_len;
+	qe->next = NULL;
+
+	pthread_mutex_lock(&ep->lock);
+	if (ep->ready_tail)
+		ep->ready_tail->next = qe;
+	else
+		__atomic_store_n(&ep->ready_head, qe, __ATOMIC_RELEASE);
+	ep->ready_tail = qe;
+	pthread_mutex_unlock(&ep->lock);
+
+	rdma_wake(ep);
+}
+
+static void rdma_dev_drain(struct rdma_dev *dev)
+{
+	struct ibv_wc		 wc[RDMA_WC_BATCH];
+	int			 i, n;
+
+	while ((n = ibv_poll_cq(dev->rcq, RDMA_WC_BATCH, wc)) > 0) {
+		pthread_mutex_lock(&dev->lock);
+		for (i = 0; i < n; i++)
+			rdma_dev_recv(dev, &wc[i]);
+		pthread_mutex_unlock(&dev->lock);
+	}
+}
+
+/* callers hold dev->lock */
+static void rdma_dev_send(struct rdma_dev *dev, struct ibv_wc *wc)
+{
+	struct rdma_ep		*ep;
+	int			 wake;
+
+	ep = rdma_lookup_ep(dev, wc->qp_num);
+	if (!ep || wc->wr_id != ep->gen)
+		return;
+
+	pthread_mutex_lock(&ep->lock);
+
+	if (wc->status != IBV_WC_SUCCESS && !ep->send_err) {
+		if (wc->status != IBV_WC_RETRY_EXC_ERR &&
+		    wc->status != IBV_WC_WR_FLUSH_ERR)
+			print_err("send wc.status %s (%d)",
+				  wc_str_status(wc->status), wc->status);
+		ep->send_err = -ECONNRESET;
+	}
+
+	ep->done++;
+
+	/* a command held back behind these sends can go now */
+	wake = ep->ready_head &&
+	       (ep->send_err || ep->done == ep->posted);
+
+	pthread_cond_broadcast(&ep->cond);
+
+	pthread_mutex_unlock(&ep->lock);
+
+	if (wake)
+		rdma_wake(ep);
+}
+
+static void rdma_dev_reap(struct rdma_dev *dev, struct ibv_cq *cq)
+{
+	struct ibv_wc		 wc[RDMA_WC_BATCH];
+	int			 i, n;
+
+	while ((n = ibv_poll_cq(cq, RDMA_WC_BATCH, wc)) > 0) {
+		pthread_mutex_lock(&dev->lock);
+		for (i = 0; i < n; i++)
+			rdma_dev_send(dev, &wc[i]);
+		pthread_mutex_unlock(&dev->lock);
+	}
+}
+
+/* with a shared receive queue a dead connection no longer flushes its own
+ * receives, so QP errors arrive as async events instead
+ */
+static void rdma_dev_async(struct rdma_dev *dev)
+{
+	struct ibv_async_event	 event;
+	struct rdma_ep		*ep;
+
+	while (!ibv_get_async_event(dev->verbs, &event)) {
+		switch (event.event_type) {
+		case IBV_EVENT_QP_FATAL:
+		case IBV_EVENT_QP_REQ_ERR:
+		case IBV_EVENT_QP_ACCESS_ERR:
+		case IBV_EVENT_QP_LAST_WQE_REACHED:
+			pthread_mutex_lock(&dev->lock);
+			ep = rdma_lookup_ep(dev, event.element.qp->qp_num);
+			if (ep)
+				rdma_fail_ep(ep);
+			pthread_mutex_unlock(&dev->lock);
+			break;
+		default:
+			break;
+		}
+
+		ibv_ack_async_event(&event);
+	}
+}
+
+static void *rdma_dev_thread(void *arg)
+{
+	struct rdma_dev		*dev = arg;
+	struct pollfd		 fds[2];
+	struct ibv_cq		*cq;
+	void			*ctx;
 	int			 ret;
 
-	qe = calloc(sizeof(struct rdma_qe), ep->depth);
-	if (!qe)
-		return -ENOMEM;
+	fds[0].fd = dev->comp->fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = dev->verbs->async_fd;
+	fds[1].events = POLLIN;
+
+	while (!dev->stop) {
+		ret = poll(fds, 2, EVENT_TIMEOUT);
+		if (ret < 0 && errno != EINTR) {
+			print_errno("poll failed", errno);
+			break;
+		}
+		if (ret <= 0)
+			continue;
 
-	for (i = 0; i < ep->depth; i++) {
-		qe[i].buf = alloc_buffer(ep, PAGE_SIZE, &qe[i].recv_mr);
-		if (!qe[i].buf) {
-			errno = ENOMEM;
-			goto err;
+		if (fds[1].revents & POLLIN)
+			rdma_dev_async(dev);
+
+		if (!(fds[0].revents & POLLIN))
+			continue;
+
+		while (!ibv_get_cq_event(dev->comp, &cq, &ctx)) {
+			ibv_ack_cq_events(cq, 1);
+
+			/* re-arm before draining so a completion racing the
+			 * drain still raises an event
+			 */
+			if (ibv_req_notify_cq(cq, 0)) {
+				print_err("ibv_req_notify_cq failed");
+				return NULL;
+			}
+
+			if (cq == dev->rcq)
+				rdma_dev_drain(dev);
+			else
+				rdma_dev_reap(dev, cq);
 		}
 	}
 
-	wr.next = NULL;
-	wr.sg_list = &sge;
-	wr.num_sge = 1;
+	return NULL;
+}
+
+static void rdma_free_dev(struct rdma_dev *dev)
+{
+	struct rdma_scq		*scq;
 
-	sge.length = PAGE_SIZE;
+	if (dev->running) {
+		dev->stop = 1;
+		pthread_join(dev->thread, NULL);
+	}
 
-	for (i = 0; i < ep->depth; i++) {
-		wr.wr_id = (uintptr_t) &qe[i];
-		sge.addr = (uintptr_t) qe[i].buf;
-		sge.lkey = qe[i].recv_mr->lkey;
+	while ((scq = dev->scqs)) {
+		dev->scqs = scq->next;
+		ibv_destroy_cq(scq->cq);
+		free(scq);
+	}
 
-		ret = ibv_post_recv(ep->id->qp, &wr, &bad_wr);
-		if (ret)
-			goto err;
+	if (dev->srq)
+		ibv_destroy_srq(dev->srq);
+	if (dev->rcq)
+		ibv_destroy_cq(dev->rcq);
+	if (dev->comp)
+		ibv_destroy_comp_channel(dev->comp);
+	if (dev->mr)
+		ibv_dereg_mr(dev->mr);
+	if (dev->pd)
+		ibv_dealloc_pd(dev->pd);
+
+	free(dev->bufs);
+	free(dev->qe);
+
+	pthread_mutex_destroy(&dev->lock);
+	free(dev);
+}
+
+/* every receive buffer lives in one slab under a single registration.
+ * Buffers are never cleared, poll_for_msg reports the received length.
+ */
+static int rdma_create_srq(struct rdma_dev *dev)
+{
+	struct ibv_srq_init_attr attr;
+	size_t			 size;
+	int			 i;
+
+	memset(&attr, 0, sizeof(attr));
+
+	attr.attr.max_wr = dev->depth;
+	attr.attr.max_sge = 1;
+
+	dev->srq = ibv_create_srq(dev->pd, &attr);
+	if (!dev->srq)
+		return -errno;
+
+	size = round_up(dev->depth * RDMA_RECV_SIZE, PAGE_SIZE);
+
+	if (posix_memalign(&dev->bufs, PAGE_SIZE, size)) {
+		print_errno("posix_memalign failed", errno);
+		dev->bufs = NULL;
+		return -ENOMEM;
 	}
 
-	ep->qe = qe;
+	dev->mr = ibv_reg_mr(dev->pd, dev->bufs, size, IBV_ACCESS_LOCAL_WRITE);
+	if (!dev->mr)
+		return -errno;
+
+	dev->qe = calloc(sizeof(struct rdma_qe), dev->depth);
+	if (!dev->qe)
+		return -ENOMEM;
+
+	for (i = 0; i < dev->depth; i++) {
+		dev->qe[i].buf = (char *) dev->bufs + i * RDMA_RECV_SIZE;
+		if (rdma_post_srq(dev, &dev->qe[i]))
+			return -errno;
+	}
 
 	return 0;
+}
+
+static struct rdma_dev *rdma_create_dev(struct ibv_context *verbs)
+{
+	struct rdma_dev		*dev;
+	struct ibv_device_attr	 attr;
+	int			 flags;
+	int			 ret;
+
+	if (ibv_query_device(verbs, &attr)) {
+		print_errno("ibv_query_device failed", errno);
+		return NULL;
+	}
+
+	if (!attr.max_srq_wr) {
+		print_err("%s has no shared receive queue support",
+			  ibv_get_device_name(verbs->device));
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		return NULL;
+
+	pthread_mutex_init(&dev->lock, NULL);
+
+	dev->verbs = verbs;
+	dev->depth = min(RDMA_SRQ_DEPTH, attr.max_srq_wr);
+	dev->depth = min(dev->depth, attr.max_cqe);
+	dev->max_cqe = attr.max_cqe;
+
+	dev->pd = ibv_alloc_pd(verbs);
+	if (!dev->pd)
+		goto err;
+
+	dev->comp = ibv_create_comp_channel(verbs);
+	if (!dev->comp)
+		goto err;
+
+	flags = fcntl(dev->comp->fd, F_GETFL);
+	if (fcntl(dev->comp->fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		goto err;
+
+	flags = fcntl(verbs->async_fd, F_GETFL);
+	if (fcntl(verbs->async_fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		goto err;
+
+	dev->rcq = ibv_create_cq(verbs, dev->depth, NULL, dev->comp, 0);
+	if (!dev->rcq)
+		goto err;
+
+	ret = rdma_create_srq(dev);
+	if (ret) {
+		errno = -ret;
+		goto err;
+	}
+
+	if (ibv_req_notify_cq(dev->rcq, 0))
+		goto err;
+
+	ret = pthread_create(&dev->thread, NULL, rdma_dev_thread, dev);
+	if (ret) {
+		errno = ret;
+		goto err;
+	}
+
+	dev->running = 1;
+	dev->refs = 1;
+
+	return dev;
 err:
-	while (i > 0) {
-		free(qe[--i].buf);
-		ibv_dereg_mr(qe[i].recv_mr);
+	ret = errno;
+	print_errno("failed to set up shared device resources", ret);
+	rdma_free_dev(dev);
+	errno = ret;
+
+	return NULL;
+}
+
+static struct rdma_dev *rdma_get_dev(struct ibv_context *verbs)
+{
+	struct rdma_dev		*dev;
+
+	pthread_mutex_lock(&rdma_devs_lock);
+
+	for (dev = rdma_devs; dev; dev = dev->next)
+		if (dev->verbs == verbs) {
+			dev->refs++;
+			goto out;
+		}
+
+	dev = rdma_create_dev(verbs);
+	if (dev) {
+		dev->next = rdma_devs;
+		rdma_devs = dev;
+	}
+out:
+	pthread_mutex_unlock(&rdma_devs_lock);
+
+	return dev;
+}
+
+static void rdma_put_dev(struct rdma_dev *dev)
+{
+	struct rdma_dev		**p;
+
+	pthread_mutex_lock(&rdma_devs_lock);
+
+	if (--dev->refs) {
+		pthread_mutex_unlock(&rdma_devs_lock);
+		return;
+	}
+
+	for (p = &rdma_devs; *p; p = &(*p)->next)
+		if (*p == dev) {
+			*p = dev->next;
+			break;
+		}
+
+	pthread_mutex_unlock(&rdma_devs_lock);
+
+	rdma_free_dev(dev);
+}
+
+/* join a send CQ group with room for this endpoint's work requests */
+static struct rdma_scq *rdma_get_scq(struct rdma_dev *dev, int wrs)
+{
+	struct rdma_scq		*scq;
+
+	pthread_mutex_lock(&dev->lock);
+
+	for (scq = dev->scqs; scq; scq = scq->next)
+		if (scq->used + wrs <= scq->capacity)
+			goto out;
+
+	scq = calloc(1, sizeof(*scq));
+	if (!scq)
+		goto out;
+
+	scq->capacity = min(RDMA_EPS_PER_CQ * wrs, dev->max_cqe);
+	if (scq->capacity < wrs)
+		scq->capacity = wrs;
+
+	scq->cq = ibv_create_cq(dev->verbs, scq->capacity, scq, dev->comp, 0);
+	if (!scq->cq) {
+		print_errno("ibv_create_cq failed", errno);
+		free(scq);
+		scq = NULL;
+		goto out;
 	}
 
-	free(qe);
+	if (ibv_req_notify_cq(scq->cq, 0)) {
+		print_err("ibv_req_notify_cq failed");
+		ibv_destroy_cq(scq->cq);
+		free(scq);
+		scq = NULL;
+		goto out;
+	}
+
+	scq->next = dev->scqs;
+	dev->scqs = scq;
+out:
+	if (scq)
+		scq->used += wrs;
 
-	return -errno;
+	pthread_mutex_unlock(&dev->lock);
+
+	return scq;
 }
 
 static int rdma_init_endpoint(struct xp_ep **_ep, int depth)
@@ -241,128 +709,110 @@ err1:
 	return ret;
 }
 
-static int rdma_create_completion_queues(struct rdma_ep *ep)
+static int rdma_create_queue_pairs(struct rdma_ep *ep)
 {
-	struct ibv_pd		*pd;
-	struct ibv_cq		*rcq;
-	struct ibv_cq		*scq;
-	struct ibv_context	*ctx = ep->id->verbs;
-	struct ibv_comp_channel	*comp;
-	int			 flags;
-	int			 ret;
+	struct rdma_dev		*dev = ep->dev;
+	struct ibv_qp_init_attr	 qp_attr = { NULL };
+	struct ibv_device_attr	 dev_attr;
+	const int		 send_wr_factor = 3; /* MR, SEND, INV */
+	u32			 qp_num;
 
-	pd = ibv_alloc_pd(ctx);
-	if (!pd)
+	if (ibv_query_device(dev->verbs, &dev_attr))
 		return -errno;
 
-	comp = ibv_create_comp_channel(ctx);
-	if (!comp)
-		goto err1;
+	if (dev_attr.max_qp_wr > ABSURD_MAX_WRS)
+		ep->send_wrs = send_wr_factor * ep->depth + 1;
+	else
+		ep->send_wrs = dev_attr.max_qp_wr;
 
-	flags = fcntl(comp->fd, F_GETFL);
-	ret = fcntl(comp->fd, F_SETFL, flags | O_NONBLOCK);
-	if (ret < 0)
-		goto err1;
+	ep->scq = rdma_get_scq(dev, ep->send_wrs);
+	if (!ep->scq)
+		return -ENOMEM;
 
-	rcq = ibv_create_cq(ctx, ep->depth, NULL, ep->comp, 0);
-	if (!rcq)
-		goto err2;
+	qp_attr.send_cq = ep->scq->cq;
+	qp_attr.recv_cq = dev->rcq;
+	qp_attr.srq = dev->srq;
+	qp_attr.qp_type = IBV_QPT_RC;
 
-	scq = ibv_create_cq(ctx, ep->depth, NULL, ep->comp, 0);
-	if (!scq)
-		goto err3;
+	qp_attr.cap.max_send_sge = min(dev_attr.max_sge_rd, dev_attr.max_sge);
+	qp_attr.cap.max_send_wr = ep->send_wrs;
+	qp_attr.cap.max_inline_data = RDMA_MAX_INLINE;
 
-	if (ibv_req_notify_cq(rcq, 0))
-		goto err4;
+	/* responses go out inline where the device allows it */
+	if (rdma_create_qp(ep->id, dev->pd, &qp_attr)) {
+		qp_attr.cap.max_inline_data = 0;
+		if (rdma_create_qp(ep->id, dev->pd, &qp_attr))
+			return -errno;
+	}
 
-	if (ibv_req_notify_cq(scq, 0))
-		goto err4;
+	ep->inline_size = qp_attr.cap.max_inline_data;
 
-	ep->pd = pd;
-	ep->rcq = rcq;
-	ep->scq = scq;
-	ep->comp = comp;
+	qp_num = ep->id->qp->qp_num;
 
-	return 0;
-err4:
-	ibv_destroy_cq(scq);
-err3:
-	ibv_destroy_cq(rcq);
-err2:
-	ibv_destroy_comp_channel(comp);
-err1:
-	ibv_dealloc_pd(pd);
+	pthread_mutex_lock(&dev->lock);
+	ep->gen = ++dev->next_gen;
+	ep->qp_num = qp_num;
+	ep->hnext = dev->hash[qp_num % RDMA_EP_HASH];
+	dev->hash[qp_num % RDMA_EP_HASH] = ep;
+	pthread_mutex_unlock(&dev->lock);
 
-	return -errno;
+	return 0;
 }
 
-static int rdma_create_queue_pairs(struct rdma_ep *ep)
+static void rdma_unhash_ep(struct rdma_ep *ep)
 {
-	struct ibv_qp_init_attr	 qp_attr = { NULL };
-	struct ibv_device_attr	 dev_attr;
-	const int		 send_wr_factor = 3; /* MR, SEND, INV */
+	struct rdma_dev		*dev = ep->dev;
+	struct rdma_ep		**p;
 
-	if (ibv_query_device(ep->id->pd->context, &dev_attr))
-		return -errno;
+	pthread_mutex_lock(&dev->lock);
 
-	qp_attr.send_cq = ep->scq;
-	qp_attr.recv_cq = ep->rcq;
-	qp_attr.qp_type = IBV_QPT_RC;
-
-	qp_attr.cap.max_recv_wr = ep->depth + 1;
-	qp_attr.cap.max_recv_sge = 1;
-
-	qp_attr.cap.max_send_sge = min(dev_attr.max_sge_rd, dev_attr.max_sge);
-	if (dev_attr.max_qp_wr > ABSURD_MAX_WRS)
-		qp_attr.cap.max_send_wr = send_wr_factor * ep->depth + 1;
-	else
-		qp_attr.cap.max_send_wr = dev_attr.max_qp_wr;
-
-	if (rdma_create_qp(ep->id, ep->pd, &qp_attr))
-		return -errno;
+	for (p = &dev->hash[ep->qp_num % RDMA_EP_HASH]; *p; p = &(*p)->hnext)
+		if (*p == ep) {
+			*p = ep->hnext;
+			break;
+		}
 
-	return 0;
+	pthread_mutex_unlock(&dev->lock);
 }
 
 static void _rdma_destroy_ep(struct rdma_ep *ep)
 {
-	int			 i = ep->depth;
-	struct rdma_qe		*qe = ep->qe;
+	struct rdma_dev		*dev = ep->dev;
+	struct rdma_qe		*qe;
 
-	if (qe) {
-		while (i > 0) {
-			if (qe[--i].buf) {
-				free(qe[i].buf);
-				ibv_dereg_mr(qe[i].recv_mr);
-			}
-		}
-		free(qe);
-		ep->qe = NULL;
-	}
-	if (ep->id && ep->id->qp) {
+	if (dev && ep->id && ep->id->qp) {
+		rdma_unhash_ep(ep);
 		rdma_destroy_qp(ep->id);
 		ep->id = NULL;
 	}
-	if (ep->rcq) {
-		ibv_destroy_cq(ep->rcq);
-		ep->rcq = NULL;
-	}
-	if (ep->scq) {
-		ibv_destroy_cq(ep->scq);
-		ep->scq = NULL;
+	if (dev) {
+		/* hand back messages nobody will consume */
+		while ((qe = ep->ready_head)) {
+			ep->ready_head = qe->next;
+			if (rdma_post_srq(dev, qe))
+				print_err("failed to repost receive buffer");
+		}
+		ep->ready_tail = NULL;
+
+		if (ep->scq) {
+			pthread_mutex_lock(&dev->lock);
+			ep->scq->used -= ep->send_wrs;
+			pthread_mutex_unlock(&dev->lock);
+			ep->scq = NULL;
+		}
+		if (ep->efd >= 0)
+			close(ep->efd);
+
+		pthread_cond_destroy(&ep->cond);
+		pthread_mutex_destroy(&ep->lock);
+
+		rdma_put_dev(dev);
+		ep->dev = NULL;
 	}
 	if (ep->ec) {
 		rdma_destroy_event_channel(ep->ec);
 		ep->ec = NULL;
 	}
-	if (ep->comp) {
-		ibv_destroy_comp_channel(ep->comp);
-		ep->comp = NULL;
-	}
-	if (ep->pd) {
-		ibv_dealloc_pd(ep->pd);
-		ep->pd = NULL;
-	}
 }
 
 static void rdma_destroy_endpoint(struct xp_ep *_ep)
@@ -376,20 +826,30 @@ static void rdma_destroy_endpoint(struct xp_ep *_ep)
 
 static int _rdma_create_ep(struct rdma_ep *ep)
 {
-	if (rdma_create_completion_queues(ep))
-		goto err;
+	int			 ret;
 
-	if (rdma_create_queue_pairs(ep))
+	ep->dev = rdma_get_dev(ep->id->verbs);
+	if (!ep->dev)
+		return -errno;
+
+	pthread_mutex_init(&ep->lock, NULL);
+	pthread_cond_init(&ep->cond, NULL);
+
+	ep->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ep->efd < 0) {
+		ret = -errno;
 		goto err;
+	}
 
-	if (rdma_create_queue_recv_pool(ep))
+	ret = rdma_create_queue_pairs(ep);
+	if (ret)
 		goto err;
 
 	return 0;
 err:
 	_rdma_destroy_ep(ep);
 
-	return -errno;
+	return ret;
 }
 
 static int rdma_create_endpoint(struct xp_ep **_ep, void *id, int depth)
@@ -569,6 +1029,12 @@ static int rdma_wait_for_connection(struct xp_pep *_pep, void **_id)
 	return 0;
 }
 
+static void rdma_stop_listener(struct xp_pep *_pep)
+{
+	/* wait_for_connection polls the cm channel and checks stopped */
+	UNUSED(_pep);
+}
+
 static int route_resolved(struct rdma_ep *ep, struct rdma_cm_id *id,
 			   void *data, int bytes)
 {
@@ -683,14 +1149,89 @@ static void rdma_destroy_listener(struct xp_pep *_pep)
 	rdma_destroy_event_channel(pep->ec);
 }
 
+/* post a signaled send, with any staged write chained ahead of it, and
+ * take a ticket for its completion.  Callers hold ep->lock.
+ */
+static int __rdma_post_send(struct rdma_ep *ep, struct ibv_send_wr *wr,
+			    u32 *ticket)
+{
+	struct ibv_send_wr	*bad_wr = NULL;
+	struct ibv_send_wr	*head = wr;
+	int			 ret;
+
+	if (ep->send_err)
+		return ep->send_err;
+
+	if (ep->write_pending) {
+		ep->write_wr.next = wr;
+		ep->write_wr.wr_id = ep->gen;
+		head = &ep->write_wr;
+		ep->write_pending = 0;
+	}
+
+	wr->wr_id = ep->gen;
+
+	ret = ibv_post_send(ep->id->qp, head, &bad_wr);
+	if (!ret)
+		*ticket = ++ep->posted;
+
+	return ret;
+}
+
+static int rdma_post_send(struct rdma_ep *ep, struct ibv_send_wr *wr,
+			  u32 *ticket)
+{
+	int			 ret;
+
+	if (!ep->dev)
+		return -ENOTCONN;
+
+	pthread_mutex_lock(&ep->lock);
+	ret = __rdma_post_send(ep, wr, ticket);
+	pthread_mutex_unlock(&ep->lock);
+
+	return ret;
+}
+
+static int rdma_wait_send(struct rdma_ep *ep, u32 ticket)
+{
+	struct timespec		 ts;
+	int			 ret = 0;
+
+	pthread_mutex_lock(&ep->lock);
+
+	while (!ep->send_err && (int) (ep->done - ticket) < 0) {
+		if (stopped) {
+			ret = -ESHUTDOWN;
+			break;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += EVENT_TIMEOUT * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		pthread_cond_timedwait(&ep->cond, &ep->lock, &ts);
+	}
+
+	if (!ret)
+		ret = ep->send_err;
+
+	pthread_mutex_unlock(&ep->lock);
+
+	return ret;
+}
+
 static int rdma_rma_read(struct xp_ep *_ep, void *buf, u64 addr, u64 len,
 			 u32 rkey, struct xp_mr *_mr)
 {
 	struct rdma_ep		*ep = (struct rdma_ep *) _ep;
 	struct ibv_mr		*mr = (struct ibv_mr *) _mr;
-	struct ibv_send_wr	 wr, *bad_wr = NULL;
+	struct ibv_send_wr	 wr;
 	struct ibv_sge		 sge;
-	struct ibv_wc		 wc;
+	u32			 ticket;
 	int			 ret;
 
 	memset(&wr, 0, sizeof(wr));
@@ -707,94 +1248,80 @@ static int rdma_rma_read(struct xp_ep *_ep, void *buf, u64 addr, u64 len,
 	wr.wr.rdma.rkey		= rkey;
 	wr.send_flags		= IBV_SEND_SIGNALED;
 
-	ret = ibv_post_send(ep->id->qp, &wr, &bad_wr);
+	ret = rdma_post_send(ep, &wr, &ticket);
 	if (ret)
 		return ret;
 
-	while (ibv_poll_cq(ep->scq, 1, &wc) == 0)
-		if (stopped)
-			return -ESHUTDOWN;
-
-	if (wc.status != IBV_WC_SUCCESS) {
-		print_err("rma_read wc.status %s (%d)",
-			  wc_str_status(wc.status), wc.status);
-		return -ECONNRESET;
-	}
-
-	return 0;
+	/* the caller needs the data, wait for it */
+	return rdma_wait_send(ep, ticket);
 }
 
+/* the write is staged and goes out unsignaled ahead of the response that
+ * follows it, the response's completion covers both on an RC QP
+ */
 static int rdma_rma_write(struct xp_ep *_ep, void *buf, u64 addr, u64 len,
 			  u32 rkey, struct xp_mr *_mr, struct nvme_command *cmd)
 {
 	struct rdma_ep		*ep = (struct rdma_ep *) _ep;
 	struct ibv_mr		*mr = (struct ibv_mr *) _mr;
-	struct ibv_send_wr	 wr, *bad_wr = NULL;
-	struct ibv_sge		 sge;
-	struct ibv_wc		 wc;
-	int			 ret;
+	struct ibv_send_wr	*wr = &ep->write_wr;
+	struct ibv_send_wr	 flush;
+	u32			 ticket;
+	int			 ret = 0;
 
 	UNUSED(cmd);
 
-	memset(&wr, 0, sizeof(wr));
+	if (!ep->dev)
+		return -ENOTCONN;
 
-	wr.sg_list	= &sge;
-	wr.num_sge	= 1;
+	pthread_mutex_lock(&ep->lock);
 
-	sge.length	= len;
-	sge.addr	= (uintptr_t) buf;
-	sge.lkey	= mr->lkey;
+	/* a second write with no response between, send the first alone */
+	if (ep->write_pending) {
+		flush = ep->write_wr;
+		flush.send_flags = IBV_SEND_SIGNALED;
+		ep->write_pending = 0;
 
-	wr.opcode		= IBV_WR_RDMA_WRITE;
-	wr.wr.rdma.remote_addr	= (uintptr_t) addr;
-	wr.wr.rdma.rkey		= rkey;
-	wr.send_flags		= IBV_SEND_SIGNALED;
+		ret = __rdma_post_send(ep, &flush, &ticket);
+		if (ret)
+			goto out;
+	}
 
-	ret = ibv_post_send(ep->id->qp, &wr, &bad_wr);
-	if (ret)
-		return ret;
+	memset(wr, 0, sizeof(*wr));
 
-	while (ibv_poll_cq(ep->scq, 1, &wc) == 0)
-		if (stopped)
-			return -ESHUTDOWN;
+	wr->sg_list	= &ep->write_sge;
+	wr->num_sge	= 1;
 
-	if (wc.status != IBV_WC_SUCCESS) {
-		print_err("rma_write wc.status %s (%d)",
-			  wc_str_status(wc.status), wc.status);
-		return -ECONNRESET;
-	}
+	ep->write_sge.length	= len;
+	ep->write_sge.addr	= (uintptr_t) buf;
+	ep->write_sge.lkey	= mr->lkey;
 
-	return 0;
+	wr->opcode		= IBV_WR_RDMA_WRITE;
+	wr->wr.rdma.remote_addr	= (uintptr_t) addr;
+	wr->wr.rdma.rkey	= rkey;
+
+	ep->write_pending = 1;
+out:
+	pthread_mutex_unlock(&ep->lock);
+
+	return ret;
 }
 
 static int rdma_repost_recv(struct xp_ep *_ep, struct xp_qe *_qe)
 {
 	struct rdma_ep		*ep = (struct rdma_ep *) _ep;
 	struct rdma_qe		*qe = (struct rdma_qe *) _qe;
-	struct ibv_recv_wr	 wr, *bad_wr = NULL;
-	struct ibv_sge		 sge;
-
-	memset(&wr, 0, sizeof(wr));
-
-	wr.wr_id	= (uintptr_t) qe;
-	wr.sg_list	= &sge;
-	wr.num_sge	= 1;
 
-	sge.length	= PAGE_SIZE;
-	sge.addr	= (uintptr_t) qe->buf;
-	sge.lkey	= qe->recv_mr->lkey;
-
-	memset(qe->buf, 0, PAGE_SIZE);
+	if (!ep->dev)
+		return -ENOTCONN;
 
-	return ibv_post_recv(ep->id->qp, &wr, &bad_wr);
+	return rdma_post_srq(ep->dev, qe);
 }
 
-static int rdma_post_msg(struct xp_ep *_ep, void *msg, int len,
-			 struct xp_mr *_mr)
+static int _rdma_post_msg(struct rdma_ep *ep, void *msg, int len,
+			  struct ibv_mr *mr, u32 *ticket)
 {
-	struct rdma_ep		*ep = (struct rdma_ep *) _ep;
-	struct ibv_mr		*mr = (struct ibv_mr *) _mr;
-	struct ibv_send_wr	 wr, *bad_wr = NULL;
+	struct ibv_send_wr	 wr;
 	struct ibv_sge		 sge;
 
 	memset(&wr, 0, sizeof(wr));
@@ -808,65 +1335,118 @@ static int rdma_post_msg(struct xp_ep *_ep, void *msg, int len,
 	sge.addr	= (uintptr_t) msg;
 	sge.lkey	= mr->lkey;
 
-	return ibv_post_send(ep->id->qp, &wr, &bad_wr);
+	/* capsules and completions are copied into the WQE */
+	if (len <= ep->inline_size)
+		wr.send_flags |= IBV_SEND_INLINE;
+
+	return rdma_post_send(ep, &wr, ticket);
+}
+
+static int rdma_post_msg(struct xp_ep *_ep, void *msg, int len,
+			 struct xp_mr *_mr)
+{
+	u32			 ticket;
+
+	return _rdma_post_msg((struct rdma_ep *) _ep, msg, len,
+			      (struct ibv_mr *) _mr, &ticket);
 }
 
 static int rdma_send_msg(struct xp_ep *_ep, void *msg, int len,
 			 struct xp_mr *_mr)
 {
 	struct rdma_ep		*ep = (struct rdma_ep *) _ep;
-	struct ibv_wc		 wc;
+	u32			 ticket;
 	int			 ret;
 
-	ret = rdma_post_msg(_ep, msg, len, _mr);
+	ret = _rdma_post_msg(ep, msg, len, (struct ibv_mr *) _mr, &ticket);
 	if (ret)
 		return ret;
 
-	while (ibv_poll_cq(ep->scq, 1, &wc) == 0)
-		if (stopped)
-			return -ESHUTDOWN;
+	return rdma_wait_send(ep, ticket);
+}
 
-	if (wc.status != IBV_WC_SUCCESS) {
-		if (wc.status != IBV_WC_RETRY_EXC_ERR)
-			print_err("send wc.status %s (%d)",
-				  wc_str_status(wc.status), wc.status);
-		return -ECONNRESET;
-	}
+/* an inline response is copied at post time, so its buffer is free at
+ * once and the worker moves on without waiting for the completion
+ */
+static int rdma_send_rsp(struct xp_ep *_ep, void *msg, int len,
+			 struct xp_mr *_mr)
+{
+	struct rdma_ep		*ep = (struct rdma_ep *) _ep;
+	u32			 ticket;
 
-	return 0;
+	if (len > ep->inline_size)
+		return rdma_send_msg(_ep, msg, len, _mr);
+
+	return _rdma_post_msg(ep, msg, len, (struct ibv_mr *) _mr, &ticket);
 }
 
+/* hand up the next message the device thread queued for this endpoint.
+ * The eventfd is only drained once nothing can be handed up, so a caller
+ * that stops early is woken again for what remains.
+ */
 static int rdma_poll_for_msg(struct xp_ep *_ep, struct xp_qe **_qe, void **msg,
 			     int *bytes)
 {
 	struct rdma_ep		*ep = (struct rdma_ep *) _ep;
 	struct rdma_qe		*qe;
-	struct ibv_wc		 wc;
+	u64			 val;
 	int			 ret;
 
-	ret = ibv_poll_cq(ep->rcq, 1, &wc);
-	if (ret < 0)
-		return ret;
-	if (!ret)
-		return -EAGAIN;
+	if (!ep->dev)
+		return -ENOTCONN;
 
-	if (wc.status != IBV_WC_SUCCESS) {
-		if (wc.status != IBV_WC_WR_FLUSH_ERR)
-			print_err("recv wc.status %s (%d)",
-				  wc_str_status(wc.status), wc.status);
-		return -ECONNRESET;
+	if (!__atomic_load_n(&ep->ready_head, __ATOMIC_ACQUIRE) &&
+	    read(ep->efd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		return -errno;
+
+	pthread_mutex_lock(&ep->lock);
+
+	/* the command would reuse buffers the last sends may still be
+	 * reading, the completion that drains them wakes us again
+	 */
+	if (ep->ready_head && ep->done != ep->posted && !ep->send_err) {
+		pthread_mutex_unlock(&ep->lock);
+
+		if (read(ep->efd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+			return -errno;
+
+		pthread_mutex_lock(&ep->lock);
+	}
+
+	qe = ep->ready_head;
+	if (ep->send_err || !qe || ep->done != ep->posted) {
+		ret = ep->send_err ? ep->send_err :
+		      ep->err ? ep->err : -EAGAIN;
+		pthread_mutex_unlock(&ep->lock);
+		return ret;
 	}
 
-	qe = (struct rdma_qe *) wc.wr_id;
+	ep->ready_head = qe->next;
+	if (!ep->ready_head)
+		ep->ready_tail = NULL;
+
+	pthread_mutex_unlock(&ep->lock);
+
+	/* a short message reads as zeroes past its end, not stale bytes */
+	if (qe->bytes < RDMA_RECV_SIZE)
+		memset((char *) qe->buf + qe->bytes, 0,
+		       RDMA_RECV_SIZE - qe->bytes);
 
 	*_qe = (struct xp_qe *) qe;
 
 	*msg = qe->buf;
-	*bytes = wc.byte_len;
+	*bytes = qe->bytes;
 
 	return 0;
 }
 
+static int rdma_event_fd(struct xp_ep *_ep)
+{
+	struct rdma_ep		*ep = (struct rdma_ep *) _ep;
+
+	return ep->dev ? ep->efd : -1;
+}
+
 static int rdma_alloc_key(struct xp_ep *_ep, void *buf, int len,
 			  struct xp_mr **_mr)
 {
@@ -876,12 +1456,12 @@ static int rdma_alloc_key(struct xp_ep *_ep, void *buf, int len,
 					| IBV_ACCESS_REMOTE_READ
 					| IBV_ACCESS_REMOTE_WRITE;
 
-	if (!_ep || !_mr) {
+	if (!_ep || !_mr || !ep->dev) {
 		print_err("invalid arguments");
 		return -EINVAL;
 	}
 
-	mr = ibv_reg_mr(ep->pd, buf, len, flags);
+	mr = ibv_reg_mr(ep->dev->pd, buf, len, flags);
 	if (!mr) {
 		print_errno("ibv_reg_mr failed", errno);
 		return -errno;
@@ -931,7 +1511,7 @@ static int rdma_build_connect_data(void **req, char *hostnqn)
 
 	priv->recfmt = htole16(NVME_RDMA_CM_FMT_1_0);
 	priv->hrqsize = htole16(NVMF_DQ_DEPTH);
-	priv->hsqsize = htole16(NVMF_DQ_DEPTH);
+	priv->hsqsize = htole16(NVMF_DQ_DEPTH - 1);
 
 	data = (void *) &priv[1];
 
@@ -971,6 +1551,7 @@ static struct xp_ops rdma_ops = {
 	.init_listener		= rdma_init_listener,
 	.destroy_listener	= rdma_destroy_listener,
 	.wait_for_connection	= rdma_wait_for_connection,
+	.stop_listener		= rdma_stop_listener,
 	.accept_connection	= rdma_accept_connection,
 	.reject_connection	= rdma_reject_connection,
 	.client_connect		= rdma_client_connect,
@@ -979,8 +1560,9 @@ static struct xp_ops rdma_ops = {
 	.repost_recv		= rdma_repost_recv,
 	.post_msg		= rdma_post_msg,
 	.send_msg		= rdma_send_msg,
-	.send_rsp		= rdma_send_msg,
+	.send_rsp		= rdma_send_rsp,
 	.poll_for_msg		= rdma_poll_for_msg,
+	.event_fd		= rdma_event_fd,
 	.alloc_key		= rdma_alloc_key,
 	.remote_key		= rdma_remote_key,
 	.dealloc_key		= rdma_dealloc_key,
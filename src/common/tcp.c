@@ -32,13 +32,22 @@
  * SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include "common.h"
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <linux/errqueue.h>
 
 #include "tcp.h"
 #include "ops.h"
+#include "crc32c.h"
 
 #define BACKLOG			16
 #define RESOLVE_TIMEOUT		5000
@@ -47,25 +56,101 @@
 #define TCP_SYNCNT		7
 #define TCP_NODELAY		1
 
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY		60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY		0x4000000
+#endif
+
+/* payloads below this are cheaper to copy than to pin and wait on */
+#define ZEROCOPY_THRESHOLD	(32 * 1024)
+
+/* a peer that takes no data for this long is given up on, the send runs
+ * on a worker thread shared with other hosts
+ */
+#define SEND_TIMEOUT		(10 * EVENT_TIMEOUT)
+
+/* the ICReq is read on the interface thread, a client that connects and
+ * says nothing must not hold up the next one
+ */
+#define ICREQ_TIMEOUT		(10 * EVENT_TIMEOUT)
+
+/* digests asked for in ICReq and granted in ICResp */
+#define TCP_DIGESTS		(NVME_TCP_HDR_DIGEST_ENABLE | \
+				 NVME_TCP_DATA_DIGEST_ENABLE)
+
+/* a receive buffer holds one whole PDU apart from C2H data, which is
+ * read straight into the buffer of the command it belongs to
+ */
+#define RX_BUF_SIZE		(PAGE_SIZE + 2 * NVME_TCP_DIGEST_LEN + \
+				 sizeof(struct nvme_tcp_cmd_capsule_pdu))
+
 struct tcp_qe {
+	struct tcp_qe		*next;
 	void			*buf;
-	union nvme_tcp_pdu	 pdu;
+};
+
+enum { RX_HDR = 0, RX_PDU, RX_DATA, RX_DDGST };
+
+/* receive framing state, kept across partial reads */
+struct tcp_rx {
+	struct tcp_qe		*qe;
+	char			*ptr;
+	int			 state;
+	u32			 offset;
+	u32			 len;
+	u32			 crc;
+	u16			 cid;		/* of the C2H data */
+};
+
+/* where C2H data for a command id goes, set as the command is sent */
+struct tcp_rx_data {
+	char			*buf;
+	u32			 len;
 };
 
 struct tcp_ep {
 	struct sockaddr_in	*sock_addr;
 	struct tcp_qe		*qe;
+	struct tcp_qe		*free_qe;
+	struct tcp_rx_data	*rx_data;
+	struct tcp_rx		 rx;
+	char			*icd;
+	u32			 icd_len;
 	int			 sockfd;
 	int			 state;
+	int			 hdgst;
+	int			 ddgst;
+	int			 zerocopy;
+	u32			 zc_sent;
+	u32			 zc_done;
 	__u64			 depth;
 };
 
+/* connections accepted in one wakeup wait here for wait_for_connection */
 struct tcp_pep {
-	struct sockaddr_in	*sock_addr;
 	int			 listenfd;
-	int			 sockfd;
+	int			 epfd;
+	int			 pending[BACKLOG];
+	int			 head;
+	int			 count;
 };
 
+/* written at shutdown and never drained, so every listener blocked in
+ * wait_for_connection wakes and sees it.  It lives for the life of the
+ * process so a late stop_listener cannot race a listener's teardown
+ */
+static int			 shutdown_fd = -1;
+static pthread_once_t		 shutdown_once = PTHREAD_ONCE_INIT;
+
+static void tcp_init_shutdown_fd(void)
+{
+	shutdown_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (shutdown_fd < 0)
+		print_errno("eventfd failed", errno);
+}
+
 static int tcp_create_queue_recv_pool(struct tcp_ep *ep)
 {
 	struct tcp_qe		*qe;
@@ -76,11 +161,20 @@ static int tcp_create_queue_recv_pool(struct tcp_ep *ep)
 		goto err1;
 
 	for (i = 0; i < ep->depth; i++) {
-		qe[i].buf = malloc(PAGE_SIZE);
+		qe[i].buf = malloc(RX_BUF_SIZE);
 		if (!qe[i].buf)
 			goto err2;
 	}
 
+	ep->rx_data = calloc(sizeof(struct tcp_rx_data), ep->depth);
+	if (!ep->rx_data)
+		goto err2;
+
+	for (i = 0; i < ep->depth; i++) {
+		qe[i].next = ep->free_qe;
+		ep->free_qe = &qe[i];
+	}
+
 	ep->qe = qe;
 
 	return 0;
@@ -93,6 +187,250 @@ err1:
 	return -ENOMEM;
 }
 
+static void tcp_destroy_queue_recv_pool(struct tcp_ep *ep)
+{
+	struct tcp_qe		*qe = ep->qe;
+	int			 i = ep->depth;
+
+	if (qe) {
+		while (i > 0)
+			if (qe[--i].buf)
+				free(qe[i].buf);
+		free(qe);
+	}
+
+	if (ep->rx_data)
+		free(ep->rx_data);
+}
+
+/* deadline is in monotonic ms, 0 waits for as long as it takes */
+static int tcp_wait_for_socket(struct tcp_ep *ep, short events, u64 deadline)
+{
+	struct pollfd		 fds = { .fd = ep->sockfd, .events = events };
+	int			 ret;
+
+	do {
+		if (stopped)
+			return -ESHUTDOWN;
+
+		if (deadline && monotonic_ms() >= deadline)
+			return -ETIMEDOUT;
+
+		ret = poll(&fds, 1, EVENT_TIMEOUT);
+	} while (!ret || (ret < 0 && errno == EINTR));
+
+	return (ret < 0) ? -errno : 0;
+}
+
+/* reap zerocopy completions until every send made so far is released */
+static int tcp_wait_for_zerocopy(struct tcp_ep *ep, u64 deadline)
+{
+	struct sock_extended_err *serr;
+	struct cmsghdr		*cm;
+	struct msghdr		 msg;
+	char			 control[128];
+	int			 ret;
+
+	while ((int) (ep->zc_sent - ep->zc_done) > 0) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(ep->sockfd, &msg, MSG_ERRQUEUE) < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				return -errno;
+
+			ret = tcp_wait_for_socket(ep, 0, deadline);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			serr = (struct sock_extended_err *) CMSG_DATA(cm);
+			if (serr->ee_errno != 0 ||
+			    serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			/* ee_info..ee_data is the range of sends released */
+			if ((int) (serr->ee_data + 1 - ep->zc_done) > 0)
+				ep->zc_done = serr->ee_data + 1;
+
+			/* the kernel copied anyway, e.g. over loopback */
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				ep->zerocopy = 0;
+		}
+	}
+
+	return 0;
+}
+
+/* gather send of a whole PDU, resuming after short writes.  With
+ * MSG_ZEROCOPY the buffers are pinned rather than copied, so do not
+ * return until the kernel has released them.  Fails with -ETIMEDOUT if
+ * the peer stops reading, the connection is then of no further use
+ */
+static int tcp_sendv(struct tcp_ep *ep, struct iovec *iov, int cnt, int flags)
+{
+	struct msghdr		 msg;
+	u64			 deadline = monotonic_ms() + SEND_TIMEOUT;
+	ssize_t			 len;
+	int			 ret;
+
+	memset(&msg, 0, sizeof(msg));
+
+	msg.msg_iov = iov;
+	msg.msg_iovlen = cnt;
+
+	while (msg.msg_iovlen) {
+		len = sendmsg(ep->sockfd, &msg, flags | MSG_NOSIGNAL);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN) {
+				ret = tcp_wait_for_socket(ep, POLLOUT, deadline);
+				if (ret)
+					return ret;
+				continue;
+			}
+
+			/* out of locked memory for pinning, fall back to copy */
+			if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+				flags &= ~MSG_ZEROCOPY;
+				continue;
+			}
+
+			print_err("sendmsg returned %d", errno);
+			return -errno;
+		}
+
+		if (flags & MSG_ZEROCOPY)
+			ep->zc_sent++;
+
+		while (msg.msg_iovlen && (size_t) len >= msg.msg_iov->iov_len) {
+			len -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+
+		if (msg.msg_iovlen) {
+			msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base +
+						len;
+			msg.msg_iov->iov_len -= len;
+		}
+	}
+
+	if (ep->zc_sent != ep->zc_done)
+		return tcp_wait_for_zerocopy(ep, deadline);
+
+	return 0;
+}
+
+static inline __le32 tcp_digest(const void *buf, size_t len)
+{
+	return htole32(~crc32c(~0, buf, len));
+}
+
+static int tcp_check_digest(const void *buf, size_t len, const void *dgst)
+{
+	__le32			 val;
+
+	memcpy(&val, dgst, sizeof(val));
+
+	return (val == tcp_digest(buf, len)) ? 0 : -EPROTO;
+}
+
+/* send a PDU header, with its data if any, adding whichever digests were
+ * negotiated.  The header is completed here since the header digest has
+ * to cover the final flags, pdo and plen
+ */
+static int tcp_send_pdu(struct tcp_ep *ep, struct nvme_tcp_common_hdr *hdr,
+			void *data, u32 len, int flags)
+{
+	struct iovec		 iov[4];
+	__le32			 hdgst;
+	__le32			 ddgst;
+	u32			 plen = hdr->hlen;
+	int			 cnt = 0;
+
+	hdr->flags = 0;
+	hdr->pdo = 0;
+
+	if (ep->hdgst) {
+		hdr->flags |= NVME_TCP_F_HDGST;
+		plen += NVME_TCP_DIGEST_LEN;
+	}
+
+	if (len) {
+		hdr->pdo = plen;
+		plen += len;
+
+		if (ep->ddgst) {
+			hdr->flags |= NVME_TCP_F_DDGST;
+			plen += NVME_TCP_DIGEST_LEN;
+		}
+	}
+
+	hdr->plen = htole32(plen);
+
+	iov[cnt].iov_base = hdr;
+	iov[cnt++].iov_len = hdr->hlen;
+
+	if (ep->hdgst) {
+		hdgst = tcp_digest(hdr, hdr->hlen);
+		iov[cnt].iov_base = &hdgst;
+		iov[cnt++].iov_len = sizeof(hdgst);
+	}
+
+	if (len) {
+		iov[cnt].iov_base = data;
+		iov[cnt++].iov_len = len;
+
+		if (ep->ddgst) {
+			ddgst = tcp_digest(data, len);
+			iov[cnt].iov_base = &ddgst;
+			iov[cnt++].iov_len = sizeof(ddgst);
+		}
+	}
+
+	return tcp_sendv(ep, iov, cnt, flags);
+}
+
+/* read all of len bytes within timeout ms, waiting for the socket when it
+ * runs dry
+ */
+static int tcp_read_full(struct tcp_ep *ep, void *buf, int len, int timeout)
+{
+	u64			 deadline = monotonic_ms() + timeout;
+	char			*p = buf;
+	int			 ret;
+
+	while (len) {
+		ret = read(ep->sockfd, p, len);
+		if (ret > 0) {
+			p += ret;
+			len -= ret;
+			continue;
+		}
+
+		if (!ret)
+			return -ECONNRESET;
+
+		if (errno == EINTR)
+			continue;
+
+		if (errno != EAGAIN)
+			return -errno;
+
+		ret = tcp_wait_for_socket(ep, POLLIN, deadline);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
 static int tcp_init_endpoint(struct xp_ep **_ep, int depth)
 {
 	struct tcp_ep		*ep;
@@ -112,26 +450,25 @@ static int tcp_init_endpoint(struct xp_ep **_ep, int depth)
 
 	memset(ep, 0, sizeof(*ep));
 
-	*_ep = (struct xp_ep *) ep;
-
 	ep->sockfd = sockfd;
 	ep->depth = depth;
 
+	if (tcp_create_queue_recv_pool(ep)) {
+		close(sockfd);
+		free(ep);
+		return -ENOMEM;
+	}
+
+	*_ep = (struct xp_ep *) ep;
+
 	return 0;
 }
 
 static void tcp_destroy_endpoint(struct xp_ep *_ep)
 {
 	struct tcp_ep		*ep = (struct tcp_ep *) _ep;
-	struct tcp_qe		*qe = ep->qe;
-	int			 i = ep->depth;
 
-	if (qe) {
-		while (i > 0)
-			if (qe[--i].buf)
-				free(qe[i].buf);
-		free(qe);
-	}
+	tcp_destroy_queue_recv_pool(ep);
 
 	close(ep->sockfd);
 
@@ -143,19 +480,29 @@ static int tcp_create_endpoint(struct xp_ep **_ep, void *id, int depth)
 	struct tcp_ep		*ep;
 	int			 flags;
 
-	UNUSED(depth);
-
 	ep = malloc(sizeof(*ep));
 	if (!ep)
 		return -ENOMEM;
 
 	memset(ep, 0, sizeof(*ep));
 
-	ep->sockfd = *(int *) id;
+	ep->sockfd = (intptr_t) id;
+	ep->depth = depth;
+
+	if (tcp_create_queue_recv_pool(ep)) {
+		free(ep);
+		return -ENOMEM;
+	}
 
 	flags = fcntl(ep->sockfd, F_GETFL);
 	fcntl(ep->sockfd, F_SETFL, flags | O_NONBLOCK);
 
+	/* large log pages go out with MSG_ZEROCOPY where the kernel has it */
+	flags = 1;
+	if (!setsockopt(ep->sockfd, SOL_SOCKET, SO_ZEROCOPY, &flags,
+			sizeof(flags)))
+		ep->zerocopy = 1;
+
 	*_ep = (struct xp_ep *) ep;
 
 	return 0;
@@ -165,16 +512,28 @@ static int tcp_init_listener(struct xp_pep **_pep, char *srvc)
 {
 	struct tcp_pep		*pep;
 	struct sockaddr_in	 addr;
+	struct epoll_event	 event;
+	u64			 val;
 	int			 listenfd;
+	int			 epfd;
 	int			 ret;
 
+	pthread_once(&shutdown_once, tcp_init_shutdown_fd);
+	if (shutdown_fd < 0)
+		return -ENOMEM;
+
+	/* clear a shutdown left over from a previous run */
+	if (!stopped && read(shutdown_fd, &val, sizeof(val)) < 0 &&
+	    errno != EAGAIN)
+		print_errno("eventfd read failed", errno);
+
 	memset(&addr, 0, sizeof(addr));
 
 	addr.sin_family = AF_INET;
 	addr.sin_port = htons(atoi(srvc));
 	addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-	listenfd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK, 0);
+	listenfd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
 	if (listenfd < 0) {
 		print_err("Socket error %d", errno);
 		return -errno;
@@ -183,19 +542,40 @@ static int tcp_init_listener(struct xp_pep **_pep, char *srvc)
 	ret = bind(listenfd, (struct sockaddr *) &addr, sizeof(addr));
 	if (ret < 0) {
 		print_err("Socket bind error %d", errno);
-		goto err;
+		goto err1;
 	}
 
 	ret = listen(listenfd, BACKLOG);
 	if (ret) {
 		print_err("Socket listen error %d", errno);
-		goto err;
+		goto err1;
+	}
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		ret = -errno;
+		goto err1;
+	}
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+
+	event.data.fd = listenfd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &event)) {
+		ret = -errno;
+		goto err2;
+	}
+
+	event.data.fd = shutdown_fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, shutdown_fd, &event)) {
+		ret = -errno;
+		goto err2;
 	}
 
 	pep = malloc(sizeof(*pep));
 	if (!pep) {
 		ret = -ENOMEM;
-		goto err;
+		goto err2;
 	}
 
 	memset(pep, 0, sizeof(*pep));
@@ -203,9 +583,12 @@ static int tcp_init_listener(struct xp_pep **_pep, char *srvc)
 	*_pep = (struct xp_pep *) pep;
 
 	pep->listenfd = listenfd;
+	pep->epfd = epfd;
 
 	return 0;
-err:
+err2:
+	close(epfd);
+err1:
 	close(listenfd);
 	return ret;
 }
@@ -213,75 +596,43 @@ err:
 static int tcp_accept_connection(struct xp_ep *_ep)
 {
 	struct tcp_ep		*ep = (struct tcp_ep *) _ep;
-	struct nvme_tcp_icreq_pdu *init_req = NULL;
-	struct nvme_tcp_icresp_pdu *init_rep;
-	struct nvme_tcp_common_hdr *hdr;
-	unsigned int		 digest = 0;
-	int			 ret, len;
+	struct nvme_tcp_icreq_pdu init_req;
+	struct nvme_tcp_icresp_pdu init_rep;
+	struct iovec		 iov;
+	int			 ret;
 
 	if (!ep)
 		return -EINVAL;
 
-	hdr = malloc(sizeof(*hdr));
-	if (!hdr)
-		return -ENOMEM;
+	ret = tcp_read_full(ep, &init_req, sizeof(init_req), ICREQ_TIMEOUT);
+	if (ret)
+		return ret;
 
-	memset(hdr, 0, sizeof(*hdr));
+	if (init_req.c_hdr.pdu_type != NVME_TCP_ICREQ ||
+	    le32toh(init_req.c_hdr.plen) != sizeof(init_req))
+		return -EPROTO;
 
-	len = sizeof(*hdr);
-	ret = read(ep->sockfd, hdr, len);
-	if (ret != sizeof(*hdr)) {
-		ret = (ret < 0) ? -EAGAIN : -ENODATA;
-		goto err1;
-	}
+	if (init_req.hpda != 0)
+		return -EPROTO;
 
-	if (hdr->pdu_type == 0) {
-		if (posix_memalign((void **) &init_req, PAGE_SIZE,
-					sizeof(*init_req))) {
-			ret = -ENOMEM;
-			goto err1;
-		}
-		len = sizeof(*init_req)-sizeof(*hdr);
-		ret = read(ep->sockfd, init_req, len);
-		if (ret != len) {
-			ret = -ENODATA;
-			goto err2;
-		}
-		if (init_req->hpda != 0) {
-			ret = -EPROTO;
-			goto err2;
-		}
-	}
+	memset(&init_rep, 0, sizeof(init_rep));
 
-	if (posix_memalign((void **) &init_rep, PAGE_SIZE,
-				sizeof(*init_rep))) {
-		ret = -ENOMEM;
-		goto err2;
-	}
+	init_rep.c_hdr.pdu_type = NVME_TCP_ICRESP;
+	init_rep.c_hdr.hlen = sizeof(init_rep);
+	init_rep.c_hdr.pdo = 0;
+	init_rep.c_hdr.plen = htole32(sizeof(init_rep));
+	init_rep.pfv = htole16(NVME_TCP_PDU_FORMAT_VER);
+	init_rep.maxh2c = 0xffff;
+	init_rep.cpda = 0;
+	init_rep.dgst = init_req.dgst & TCP_DIGESTS;
 
-	init_rep->c_hdr.pdu_type = NVME_TCP_ICRESP;
-	init_rep->c_hdr.hlen = sizeof(*init_rep);
-	init_rep->c_hdr.pdo = 0;
-	init_rep->c_hdr.plen = htole32(sizeof(*init_rep));
-	init_rep->pfv = htole16(NVME_TCP_PDU_FORMAT_VER);
-	init_rep->maxh2c = 0xffff;
-	init_rep->cpda = 0;
-	digest = 0;
-	init_rep->dgst = htole16(digest);
+	ep->hdgst = !!(init_rep.dgst & NVME_TCP_HDR_DIGEST_ENABLE);
+	ep->ddgst = !!(init_rep.dgst & NVME_TCP_DATA_DIGEST_ENABLE);
 
-	ret = write(ep->sockfd, init_rep, sizeof(*init_rep));
-	if (ret < 0)
-		goto err3;
+	iov.iov_base = &init_rep;
+	iov.iov_len = sizeof(init_rep);
 
-	return 0;
-err3:
-	free(init_rep);
-err2:
-	if (init_req)
-		free(init_req);
-err1:
-	free(hdr);
-	return ret;
+	return tcp_sendv(ep, &iov, 1, 0);
 }
 
 static int tcp_reject_connection(struct xp_ep *_ep, void *data, int len)
@@ -294,45 +645,77 @@ static int tcp_reject_connection(struct xp_ep *_ep, void *data, int len)
 	return 0;
 }
 
+/* take every connection that is ready, up to the free pending slots */
+static void tcp_accept_batch(struct tcp_pep *pep)
+{
+	int			 sockfd;
+
+	while (pep->count < BACKLOG) {
+		sockfd = accept4(pep->listenfd, NULL, NULL,
+				 SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sockfd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN)
+				print_err("failed to accept err=%d", errno);
+			break;
+		}
+
+		pep->pending[(pep->head + pep->count) % BACKLOG] = sockfd;
+		pep->count++;
+	}
+}
+
+/* sleeps until a host connects or stop_listener is called.  The id
+ * handed back is the socket itself
+ */
 static int tcp_wait_for_connection(struct xp_pep *_pep, void **_id)
 {
 	struct tcp_pep		*pep = (struct tcp_pep *) _pep;
+	struct epoll_event	 events[2];
 	int			 sockfd;
-	int			*id;
-	int			 ret;
+	int			 i, n;
 
-	id = malloc(sizeof(int));
-	if (!id)
-		return -ENOMEM;
+	while (!pep->count) {
+		if (stopped)
+			return -ESHUTDOWN;
 
-	while (true) {
-		usleep(100); //TBD
-		if (stopped) {
-			ret = -ESHUTDOWN;
-			goto err;
+		n = epoll_wait(pep->epfd, events, 2, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
 		}
 
-		sockfd = accept(pep->listenfd, (struct sockaddr *) NULL,
-				NULL);
-		if (sockfd < 0) {
-			if (errno != EAGAIN)
-				print_err("failed to accept err=%d\n",
-						sockfd);
-			ret = -EAGAIN;
-			goto err;
-		}
+		for (i = 0; i < n; i++)
+			if (events[i].data.fd == shutdown_fd)
+				return -ESHUTDOWN;
 
-		pep->sockfd = sockfd;
-		*id = sockfd;
-		*_id = id;
-		return 0;
+		tcp_accept_batch(pep);
 	}
-err:
-	free(id);
-	return ret;
+
+	sockfd = pep->pending[pep->head];
+
+	pep->head = (pep->head + 1) % BACKLOG;
+	pep->count--;
+
+	*_id = (void *) (intptr_t) sockfd;
+
+	return 0;
+}
+
+static void tcp_stop_listener(struct xp_pep *_pep)
+{
+	u64			 val = 1;
+
+	UNUSED(_pep);
+
+	if (shutdown_fd >= 0 && write(shutdown_fd, &val, sizeof(val)) < 0)
+		print_errno("eventfd write failed", errno);
 }
 
-static int validate_reply(struct nvme_tcp_icresp_pdu *reply, int len)
+static int validate_reply(struct nvme_tcp_icresp_pdu *reply, int len,
+			  u8 dgst)
 {
 
 	if (reply->c_hdr.pdu_type != NVME_TCP_ICRESP) {
@@ -360,7 +743,8 @@ static int validate_reply(struct nvme_tcp_icresp_pdu *reply, int len)
 		return -EINVAL;
 	}
 
-	if (reply->dgst != 0) {
+	/* the controller may grant fewer digests than asked for, not more */
+	if (reply->dgst & ~dgst) {
 		print_err("unsupported digest %d", reply->dgst);
 		return -EINVAL;
 	}
@@ -377,7 +761,7 @@ static int tcp_client_connect(struct xp_ep *_ep, struct sockaddr *dst,
 			       void *data, int _len)
 {
 	struct tcp_ep		*ep = (struct tcp_ep *) _ep;
-	struct nvme_tcp_icresp_pdu *reply;
+	struct nvme_tcp_icresp_pdu reply;
 	struct nvme_tcp_icreq_pdu *conn;
 	int			 len, ret;
 	int			 opt = 1;
@@ -408,50 +792,63 @@ static int tcp_client_connect(struct xp_ep *_ep, struct sockaddr *dst,
 		return -errno;
 	}
 
-	if (posix_memalign((void **) &reply, PAGE_SIZE, sizeof(*reply)))
-		return -ENOMEM;
+	/* responses are polled for from here on, the ICResp included so a
+	 * target that never answers is given up on
+	 */
+	opt = fcntl(ep->sockfd, F_GETFL);
+	fcntl(ep->sockfd, F_SETFL, opt | O_NONBLOCK);
 
-	len = read(ep->sockfd, reply, sizeof(*reply));
-	if (len < 0) {
-		print_err("read returned %d", errno);
-		ret = -errno;
-		goto out;
+	ret = tcp_read_full(ep, &reply, sizeof(reply), ICREQ_TIMEOUT);
+	if (ret) {
+		print_err("read returned %d", ret);
+		return ret;
 	}
 
-	ret = validate_reply(reply, len);
-	if (ret != -EINVAL) {
-		ep->state = CONNECTED;
-		ret = 0;
-	}
-out:
-	free(reply);
-	return ret;
+	ret = validate_reply(&reply, sizeof(reply), conn->dgst);
+	if (ret == -EINVAL)
+		return ret;
+
+	ep->hdgst = !!(reply.dgst & NVME_TCP_HDR_DIGEST_ENABLE);
+	ep->ddgst = !!(reply.dgst & NVME_TCP_DATA_DIGEST_ENABLE);
+
+	ep->state = CONNECTED;
+
+	return 0;
 }
 
 static void tcp_destroy_listener(struct xp_pep *_pep)
 {
 	struct tcp_pep		*pep = (struct tcp_pep *) _pep;
 
+	while (pep->count) {
+		close(pep->pending[pep->head]);
+		pep->head = (pep->head + 1) % BACKLOG;
+		pep->count--;
+	}
+
+	close(pep->epfd);
 	close(pep->listenfd);
-	free(pep->sock_addr);
+	free(pep);
 }
 
 static int tcp_rma_read(struct xp_ep *_ep, void *buf, u64 addr, u64 _len,
 			 u32 rkey, struct xp_mr *_mr)
 {
 	struct tcp_ep		*ep = (struct tcp_ep *) _ep;
-	int			 len;
 
 	UNUSED(addr);
 	UNUSED(rkey);
 	UNUSED(_mr);
 
-	len = read(ep->sockfd, buf, _len);
-	if (len < 0) {
-		print_err("read returned %d", errno);
-		return -errno;
+	/* host to controller data arrives in capsule with the command */
+	if (_len > ep->icd_len) {
+		print_err("expected %llu bytes in capsule, have %u",
+			  (unsigned long long) _len, ep->icd_len);
+		return -EINVAL;
 	}
 
+	memcpy(buf, ep->icd, _len);
+
 	return 0;
 }
 
@@ -460,110 +857,52 @@ static int tcp_rma_write(struct xp_ep *_ep, void *buf, u64 addr, u64 _len,
 {
 	struct tcp_ep		*ep = (struct tcp_ep *) _ep;
 	struct nvme_tcp_data_pdu pdu;
-	int			 len;
+	int			 flags = 0;
 
 	UNUSED(_mr);
 	UNUSED(addr);
 	UNUSED(rkey);
 
+	memset(&pdu, 0, sizeof(pdu));
+
 	pdu.c_hdr.pdu_type = NVME_TCP_C2HDATA;
-	pdu.c_hdr.flags = 0;
-	pdu.c_hdr.pdo = 0;
 	pdu.c_hdr.hlen = sizeof(struct nvme_tcp_data_pdu);
-	pdu.c_hdr.plen = sizeof(struct nvme_tcp_data_pdu) + _len;
 	pdu.data_offset = 0;
-	pdu.data_length = _len;
+	pdu.data_length = htole32(_len);
 	pdu.cccid = cmd->common.command_id;
 
-	len = write(ep->sockfd, &pdu, sizeof(pdu));
-	if (len < 0) {
-		print_err("header write returned %d", errno);
-		return -errno;
-	}
+	if (ep->zerocopy && _len >= ZEROCOPY_THRESHOLD)
+		flags = MSG_ZEROCOPY;
 
-	len = write(ep->sockfd, buf, _len);
-	if (len < 0) {
-		print_err("data write returned %d", errno);
-		return -errno;
-	}
-
-	return 0;
+	return tcp_send_pdu(ep, &pdu.c_hdr, buf, _len, flags);
 }
 
 static int tcp_repost_recv(struct xp_ep *_ep, struct xp_qe *_qe)
 {
-	UNUSED(_ep);
-	UNUSED(_qe);
-
-	return 0;
-}
-
-static int tcp_inline_write(size_t sockfd, void *data, size_t _len)
-{
-	int			 len;
-
-	len = write(sockfd, (const void *) data, _len);
-	if (len < 0) {
-		print_err("data write returned %d", errno);
-		return -errno;
-	}
-
-	return 0;
-}
-
-static int tcp_inline_read(size_t sockfd, void *data, size_t _len)
-{
-	struct nvme_tcp_data_pdu d_pdu;
-	int			 len;
+	struct tcp_ep		*ep = (struct tcp_ep *) _ep;
+	struct tcp_qe		*qe = (struct tcp_qe *) _qe;
 
-	UNUSED(_len);
+	if (!qe)
+		return 0;
 
-	len = read(sockfd, &d_pdu, sizeof(d_pdu));
-	if (len != sizeof(d_pdu)) {
-		print_err("header read returned %d", errno);
-		return (len < 0) ? -errno : -ENODATA;
+	if (ep->icd && ep->icd >= (char *) qe->buf &&
+	    ep->icd < (char *) qe->buf + RX_BUF_SIZE) {
+		ep->icd = NULL;
+		ep->icd_len = 0;
 	}
 
-	while (d_pdu.data_length > 0) {
-		len = read(sockfd, (char *) data + d_pdu.data_offset,
-			   d_pdu.data_length);
-		if (len < 0) {
-			if (errno == EAGAIN)
-				continue;
-
-			print_err("data read returned %d", errno);
-			return -errno;
-		}
-
-		d_pdu.data_length -= len;
-		d_pdu.data_offset += len;
-	}
+	qe->next = ep->free_qe;
+	ep->free_qe = qe;
 
 	return 0;
 }
 
-static inline int tcp_handle_inline_data(struct tcp_ep *ep,
-					struct nvme_command *cmd)
+static inline int tcp_data_direction(struct nvme_command *cmd)
 {
-	struct nvme_sgl_desc	*sg = &cmd->common.dptr.sgl;
-	char			*data = (char *)sg->addr;
-	int			 length = sg->length;
-	int			 direction;
-	int			 ret;
-
 	if (cmd->common.opcode == nvme_fabrics_command)
-		direction = cmd->fabrics.fctype & NVME_OPCODE_MASK;
-	else
-		direction = cmd->common.opcode & NVME_OPCODE_MASK;
+		return cmd->fabrics.fctype & NVME_OPCODE_MASK;
 
-	if (direction == NVME_OPCODE_H2C)
-		ret = tcp_inline_write(ep->sockfd, data, length);
-	else if (direction == NVME_OPCODE_C2H)
-		ret = tcp_inline_read(ep->sockfd, data, length);
-	else
-		ret = 0;
-
-	return ret;
+	return cmd->common.opcode & NVME_OPCODE_MASK;
 }
 
 static int tcp_send_msg(struct xp_ep *_ep, void *msg, int _len,
@@ -571,28 +910,36 @@ static int tcp_send_msg(struct xp_ep *_ep, void *msg, int _len,
 {
 	struct nvme_command	*cmd = (struct nvme_command *)msg;
 	struct tcp_ep		*ep = (struct tcp_ep *)_ep;
+	struct nvme_sgl_desc	*sg = &cmd->common.dptr.sgl;
 	struct nvme_tcp_cmd_capsule_pdu	 pdu;
-	int			 len;
+	u16			 cid = cmd->common.command_id;
+	void			*data = NULL;
+	u32			 len = 0;
+	int			 direction;
 
 	UNUSED(_len);
 	UNUSED(_mr);
 
 	pdu.c_hdr.pdu_type = NVME_TCP_CAPSULECMD;
-	pdu.c_hdr.flags = 0;
-	pdu.c_hdr.pdo = 0;
 	pdu.c_hdr.hlen = sizeof(struct nvme_tcp_cmd_capsule_pdu);
-	pdu.c_hdr.plen = sizeof(struct nvme_command) +
-			 sizeof(struct nvme_tcp_common_hdr);
 
 	memcpy(&(pdu.cmd), cmd, sizeof(struct nvme_command));
 
-	len = write(ep->sockfd, &pdu, sizeof(pdu));
-	if (len != sizeof(pdu)) {
-		print_err("write command returned %d", errno);
-		return -errno;
+	direction = tcp_data_direction(cmd);
+	if (direction == NVME_OPCODE_H2C && sg->length) {
+		if (sg->length > PAGE_SIZE)
+			return -EINVAL;
+
+		/* in-capsule data goes out with the capsule in one send */
+		data = (void *) sg->addr;
+		len = sg->length;
+	} else if (direction == NVME_OPCODE_C2H && cid < ep->depth) {
+		/* poll_for_msg lands the data here as it arrives */
+		ep->rx_data[cid].buf = (char *) sg->addr;
+		ep->rx_data[cid].len = sg->length;
 	}
 
-	return tcp_handle_inline_data(ep, cmd);
+	return tcp_send_pdu(ep, &pdu.c_hdr, data, len, 0);
 }
 
 static int tcp_send_rsp(struct xp_ep *_ep, void *msg, int _len,
@@ -601,63 +948,270 @@ static int tcp_send_rsp(struct xp_ep *_ep, void *msg, int _len,
 	struct nvme_completion  *comp = (struct nvme_completion *)msg;
 	struct tcp_ep		*ep = (struct tcp_ep *) _ep;
 	struct nvme_tcp_resp_capsule_pdu pdu;
-	int			 len;
 
 	UNUSED(_mr);
-	UNUSED(msg);
 	UNUSED(_len);
 
 	pdu.c_hdr.pdu_type = NVME_TCP_CAPSULERESP;
-	pdu.c_hdr.flags = 0;
-	pdu.c_hdr.pdo = 0;
 	pdu.c_hdr.hlen = sizeof(struct nvme_tcp_resp_capsule_pdu);
-	pdu.c_hdr.plen = sizeof(struct nvme_tcp_resp_capsule_pdu);
 
 	memcpy(&(pdu.cqe), comp, sizeof(struct nvme_completion));
 
-	len = write(ep->sockfd, &pdu, sizeof(pdu));
-	if (len != sizeof(pdu)) {
-		print_err("write completion returned %d", errno);
-		return -errno;
+	return tcp_send_pdu(ep, &pdu.c_hdr, NULL, 0, 0);
+}
+
+/* size the rest of the PDU from its common header.  Digests must be
+ * present exactly as negotiated at connect time
+ */
+static int tcp_rx_hdr(struct tcp_ep *ep, struct nvme_tcp_common_hdr *hdr)
+{
+	struct tcp_rx		*rx = &ep->rx;
+	u32			 hlen = hdr->hlen;
+
+	if (hlen < sizeof(*hdr))
+		return -EPROTO;
+
+	if (!(hdr->flags & NVME_TCP_F_HDGST) != !ep->hdgst ||
+	    ((hdr->flags & NVME_TCP_F_DDGST) && !ep->ddgst)) {
+		print_err("pdu digest flags %#x not as negotiated",
+			  hdr->flags);
+		return -EPROTO;
 	}
 
+	if (ep->hdgst)
+		hlen += NVME_TCP_DIGEST_LEN;
+
+	if (le32toh(hdr->plen) < hlen)
+		return -EPROTO;
+
+	rx->state = RX_PDU;
+	if (hdr->pdu_type == NVME_TCP_C2HDATA)
+		rx->len = hlen;
+	else
+		rx->len = le32toh(hdr->plen);
+
+	if (rx->len > RX_BUF_SIZE)
+		return -EPROTO;
+
 	return 0;
 }
 
-static int tcp_poll_for_msg(struct xp_ep *_ep, struct xp_qe **_qe,
-			    void **_msg, int *bytes)
+/* C2H data lands directly in the buffer its command was sent with */
+static int tcp_rx_data(struct tcp_ep *ep, struct nvme_tcp_data_pdu *pdu)
+{
+	struct tcp_rx		*rx = &ep->rx;
+	struct tcp_rx_data	*dest;
+	u32			 offset = le32toh(pdu->data_offset);
+	u32			 len = le32toh(pdu->data_length);
+	u32			 plen = le32toh(pdu->c_hdr.plen) - pdu->c_hdr.hlen;
+
+	if (ep->hdgst)
+		plen -= NVME_TCP_DIGEST_LEN;
+	if (pdu->c_hdr.flags & NVME_TCP_F_DDGST)
+		plen -= NVME_TCP_DIGEST_LEN;
+
+	if (len != plen)
+		return -EPROTO;
+
+	if (pdu->cccid >= ep->depth)
+		return -EPROTO;
+
+	dest = &ep->rx_data[pdu->cccid];
+	if (!dest->buf || offset > dest->len || len > dest->len - offset) {
+		print_err("unexpected data for command id %u", pdu->cccid);
+		return -EPROTO;
+	}
+
+	rx->state = RX_DATA;
+	rx->ptr = dest->buf + offset;
+	rx->offset = 0;
+	rx->len = len;
+	rx->cid = pdu->cccid;
+
+	return 0;
+}
+
+/* the host is done with the command id, its buffer may be freed, so any
+ * more data for it is a protocol error
+ */
+static void tcp_release_cid(struct xp_ep *_ep, u16 cid)
 {
 	struct tcp_ep		*ep = (struct tcp_ep *) _ep;
-	struct nvme_tcp_common_hdr hdr;
-	void			*msg;
-	int			 msg_len;
-	int			 len;
+	struct tcp_rx		*rx = &ep->rx;
 
-	UNUSED(_qe);
+	if (cid >= ep->depth)
+		return;
+
+	ep->rx_data[cid].buf = NULL;
+	ep->rx_data[cid].len = 0;
+
+	if (rx->qe && rx->state == RX_DATA && rx->cid == cid)
+		rx->ptr = NULL;
+}
 
-	len = read(ep->sockfd, &hdr, sizeof(hdr));
-	if (len != sizeof(hdr)) {
-		return (len < 0) ? -errno : -ENODATA;
+static int tcp_rx_msg(struct tcp_ep *ep, struct xp_qe **_qe, void **_msg,
+		      int *bytes)
+{
+	struct tcp_rx		*rx = &ep->rx;
+	struct nvme_tcp_common_hdr *hdr = rx->qe->buf;
+	u32			 plen = le32toh(hdr->plen);
+	u32			 hlen = hdr->hlen;
+	u32			 pdo;
+
+	switch (hdr->pdu_type) {
+	case NVME_TCP_CAPSULECMD:
+	case NVME_TCP_CAPSULERESP:
+		break;
+	case NVME_TCP_H2CTERMREQ:
+	case NVME_TCP_C2HTERMREQ:
+		return -ECONNRESET;
+	default:
+		print_err("unexpected pdu type %d", hdr->pdu_type);
+		return -EPROTO;
 	}
 
-	msg_len = hdr.hlen - sizeof(hdr);
-	if (msg_len <= 0)
-		return msg_len;
+	ep->icd = NULL;
+	ep->icd_len = 0;
 
-	if (posix_memalign(&msg, PAGE_SIZE, msg_len))
-		return -ENOMEM;
+	if (ep->hdgst)
+		hlen += NVME_TCP_DIGEST_LEN;
 
-	len = read(ep->sockfd, msg, msg_len);
-	if (len == 0)
-		return -EAGAIN;
-	if (len < 0)
-		return -errno;
-	*_msg = msg;
-	*bytes = msg_len;
+	if (plen > hlen) {
+		pdo = hdr->pdo ? hdr->pdo : hlen;
+		if (hdr->flags & NVME_TCP_F_DDGST)
+			plen -= NVME_TCP_DIGEST_LEN;
+
+		if (pdo < hlen || pdo > plen)
+			return -EPROTO;
+
+		if ((hdr->flags & NVME_TCP_F_DDGST) &&
+		    tcp_check_digest((char *) hdr + pdo, plen - pdo,
+				     (char *) hdr + plen)) {
+			print_err("data digest error, pdu type %d",
+				  hdr->pdu_type);
+			return -EPROTO;
+		}
+
+		ep->icd = (char *) rx->qe->buf + pdo;
+		ep->icd_len = plen - pdo;
+	}
+
+	*_qe = (struct xp_qe *) rx->qe;
+	*_msg = (char *) rx->qe->buf + sizeof(*hdr);
+	*bytes = hdr->hlen - sizeof(*hdr);
+
+	rx->qe = NULL;
 
 	return 0;
 }
 
+/* run the receive state machine on whatever the socket has.  A PDU is
+ * only handed up once all of it is in, a partial read leaves the state
+ * to be picked up on the next call.  The buffer goes back to the pool
+ * through repost_recv
+ */
+static int tcp_poll_for_msg(struct xp_ep *_ep, struct xp_qe **_qe,
+			    void **_msg, int *bytes)
+{
+	struct tcp_ep		*ep = (struct tcp_ep *) _ep;
+	struct tcp_rx		*rx = &ep->rx;
+	struct nvme_tcp_common_hdr *hdr;
+	__le32			 dgst;
+	int			 ret;
+
+	while (1) {
+		if (!rx->qe) {
+			rx->qe = ep->free_qe;
+			if (!rx->qe)
+				return -EAGAIN;
+
+			ep->free_qe = rx->qe->next;
+
+			rx->state = RX_HDR;
+			rx->ptr = rx->qe->buf;
+			rx->offset = 0;
+			rx->len = sizeof(*hdr);
+		}
+
+		/* the command this data was for has been released */
+		if (!rx->ptr)
+			return -ECONNABORTED;
+
+		while (rx->offset < rx->len) {
+			ret = read(ep->sockfd, rx->ptr + rx->offset,
+				   rx->len - rx->offset);
+			if (ret > 0) {
+				rx->offset += ret;
+				continue;
+			}
+
+			if (!ret)
+				return -ECONNRESET;
+
+			if (errno != EINTR)
+				return -errno;
+		}
+
+		hdr = rx->qe->buf;
+
+		switch (rx->state) {
+		case RX_HDR:
+			ret = tcp_rx_hdr(ep, hdr);
+			if (ret)
+				return ret;
+			break;
+		case RX_PDU:
+			if (ep->hdgst &&
+			    tcp_check_digest(hdr, hdr->hlen,
+					     (char *) hdr + hdr->hlen)) {
+				print_err("header digest error, pdu type %d",
+					  hdr->pdu_type);
+				return -EPROTO;
+			}
+
+			if (hdr->pdu_type != NVME_TCP_C2HDATA)
+				return tcp_rx_msg(ep, _qe, _msg, bytes);
+
+			ret = tcp_rx_data(ep, (struct nvme_tcp_data_pdu *) hdr);
+			if (ret)
+				return ret;
+			break;
+		case RX_DATA:
+			if (hdr->flags & NVME_TCP_F_DDGST) {
+				/* the digest lands behind the header */
+				rx->crc = crc32c(~0, rx->ptr, rx->len);
+				rx->state = RX_DDGST;
+				rx->ptr = (char *) hdr + hdr->hlen +
+					  NVME_TCP_DIGEST_LEN;
+				rx->offset = 0;
+				rx->len = NVME_TCP_DIGEST_LEN;
+				break;
+			}
+
+			tcp_repost_recv(_ep, (struct xp_qe *) rx->qe);
+			rx->qe = NULL;
+			break;
+		case RX_DDGST:
+			memcpy(&dgst, rx->ptr, sizeof(dgst));
+			if (dgst != htole32(~rx->crc)) {
+				print_err("data digest error on C2H data");
+				return -EPROTO;
+			}
+
+			tcp_repost_recv(_ep, (struct xp_qe *) rx->qe);
+			rx->qe = NULL;
+			break;
+		}
+	}
+}
+
+static int tcp_event_fd(struct xp_ep *_ep)
+{
+	struct tcp_ep		*ep = (struct tcp_ep *) _ep;
+
+	return ep->sockfd;
+}
+
 static int tcp_alloc_key(struct xp_ep *_ep, void *buf, int len,
 			 struct xp_mr **_mr)
 {
@@ -700,7 +1254,7 @@ static int tcp_build_connect_data(void **req, char *hostnqn)
 
 	connect->pfv = htole16(NVME_TCP_CONNECT_FMT_1_0);
 	connect->maxr2t = 0;
-	connect->dgst = 0;
+	connect->dgst = TCP_DIGESTS;
 	connect->hpda = 0;
 
 	*req = connect;
@@ -740,6 +1294,7 @@ static struct xp_ops tcp_ops = {
 	.init_listener		= tcp_init_listener,
 	.destroy_listener	= tcp_destroy_listener,
 	.wait_for_connection	= tcp_wait_for_connection,
+	.stop_listener		= tcp_stop_listener,
 	.accept_connection	= tcp_accept_connection,
 	.reject_connection	= tcp_reject_connection,
 	.client_connect		= tcp_client_connect,
@@ -750,11 +1305,13 @@ static struct xp_ops tcp_ops = {
 	.send_msg		= tcp_send_msg,
 	.send_rsp		= tcp_send_rsp,
 	.poll_for_msg		= tcp_poll_for_msg,
+	.event_fd		= tcp_event_fd,
 	.alloc_key		= tcp_alloc_key,
 	.remote_key		= tcp_remote_key,
 	.dealloc_key		= tcp_dealloc_key,
 	.build_connect_data	= tcp_build_connect_data,
 	.set_sgl		= tcp_set_sgl,
+	.release_cid		= tcp_release_cid,
 };
 
 struct xp_ops *tcp_register_ops(void)
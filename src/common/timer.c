@@ -0,0 +1,203 @@
+// SPDX-License-Identifier: DUAL GPL-2.0/BSD
+/*
+ * NVMe over Fabrics Distributed Endpoint Management (NVMe-oF DEM).
+ * Copyright (c) 2017-2019 Intel Corporation, Inc. All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *	- Redistributions of source code must retain the above
+ *	  copyright notice, this list of conditions and the following
+ *	  disclaimer.
+ *
+ *	- Redistributions in binary form must reproduce the above
+ *	  copyright notice, this list of conditions and the following
+ *	  disclaimer in the documentation and/or other materials
+ *	  provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <time.h>
+
+#include "common.h"
+
+static inline u64 current_tick(struct timer_wheel *wheel)
+{
+	return (monotonic_ms() - wheel->start) / wheel->tick;
+}
+
+static inline int slot_index(u64 tick, int level)
+{
+	return (tick >> (level * TIMER_BITS)) & TIMER_MASK;
+}
+
+static void queue_timer(struct timer_wheel *wheel, struct timer *timer)
+{
+	u64			 expires = timer->expires;
+	u64			 delta;
+	int			 level;
+
+	/* already due timers run on the next pass */
+	if (expires < wheel->now)
+		expires = wheel->now;
+
+	delta = expires - wheel->now;
+
+	for (level = 0; level < TIMER_LEVELS - 1; level++)
+		if (delta < (1ULL << ((level + 1) * TIMER_BITS)))
+			break;
+
+	/* clamp anything beyond the top level to its far edge */
+	if (delta >= (1ULL << (TIMER_LEVELS * TIMER_BITS))) {
+		expires = wheel->now +
+			  (1ULL << (TIMER_LEVELS * TIMER_BITS)) - 1;
+		timer->expires = expires;
+	}
+
+	list_add_tail(&timer->node,
+		      &wheel->slots[level][slot_index(expires, level)]);
+}
+
+/* move one slot of a higher level down into the levels below it; every
+ * timer in the slot is due within the span of the lower levels
+ */
+static int cascade(struct timer_wheel *wheel, int level)
+{
+	struct timer		*timer, *next;
+	int			 index = slot_index(wheel->now, level);
+
+	list_for_each_entry_safe(timer, next, &wheel->slots[level][index],
+				 node) {
+		list_del(&timer->node);
+		queue_timer(wheel, timer);
+	}
+
+	return index;
+}
+
+void init_timer_wheel(struct timer_wheel *wheel, int tick)
+{
+	int			 i, j;
+
+	for (i = 0; i < TIMER_LEVELS; i++)
+		for (j = 0; j < TIMER_SLOTS; j++)
+			INIT_LINKED_LIST(&wheel->slots[i][j]);
+
+	wheel->tick = tick;
+	wheel->start = monotonic_ms();
+	wheel->now = 0;
+	wheel->count = 0;
+}
+
+/* arm timer to fire no sooner than ms from now */
+void add_timer(struct timer_wheel *wheel, struct timer *timer, int ms)
+{
+	if (timer->pending)
+		return;
+
+	timer->expires = current_tick(wheel) +
+			 (ms + wheel->tick - 1) / wheel->tick;
+	timer->pending = 1;
+
+	queue_timer(wheel, timer);
+
+	wheel->count++;
+}
+
+void del_timer(struct timer_wheel *wheel, struct timer *timer)
+{
+	if (!timer->pending)
+		return;
+
+	list_del(&timer->node);
+	timer->pending = 0;
+
+	wheel->count--;
+}
+
+void mod_timer(struct timer_wheel *wheel, struct timer *timer, int ms)
+{
+	del_timer(wheel, timer);
+	add_timer(wheel, timer, ms);
+}
+
+/* fire every timer that has expired, returns the number fired */
+int run_timers(struct timer_wheel *wheel)
+{
+	struct linked_list	*slot;
+	struct timer		*timer;
+	u64			 tick = current_tick(wheel);
+	int			 level;
+	int			 fired = 0;
+
+	while (wheel->now <= tick) {
+		if (!wheel->count) {
+			wheel->now = tick + 1;
+			break;
+		}
+
+		if (!slot_index(wheel->now, 0))
+			for (level = 1; level < TIMER_LEVELS; level++)
+				if (cascade(wheel, level))
+					break;
+
+		slot = &wheel->slots[0][slot_index(wheel->now, 0)];
+
+		wheel->now++;
+
+		/* callbacks may re-arm, so always take from the head */
+		while (!list_empty(slot)) {
+			timer = list_first_entry(slot, struct timer, node);
+
+			list_del(&timer->node);
+			timer->pending = 0;
+			wheel->count--;
+
+			timer->fn(timer);
+			fired++;
+		}
+	}
+
+	return fired;
+}
+
+/* ms until the wheel next needs to run, or -1 when no timers are armed */
+int next_timer(struct timer_wheel *wheel)
+{
+	u64			 tick;
+	u64			 ms;
+	u64			 now = monotonic_ms();
+	int			 i;
+
+	if (!wheel->count)
+		return -1;
+
+	/* the nearest armed slot in this turn of the lowest level, else
+	 * the start of the next turn where the levels above cascade down
+	 */
+	tick = wheel->now;
+	i = slot_index(tick, 0);
+	if (i)
+		for (; i < TIMER_SLOTS; i++, tick++)
+			if (!list_empty(&wheel->slots[0][i]))
+				break;
+
+	ms = wheel->start + tick * wheel->tick;
+
+	return (ms > now) ? (int) (ms - now) : 0;
+}
@@ -0,0 +1,1998 @@
+// SPDX-License-Identifier: DUAL GPL-2.0/BSD
+/*
+ * NVMe over Fabrics Distributed Endpoint Management (NVMe-oF DEM).
+ * Copyright (c) 2017-2019 Intel Corporation, Inc. All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *	- Redistributions of source code must retain the above
+ *	  copyright notice, this list of conditions and the following
+ *	  disclaimer.
+ *
+ *	- Redistributions in binary form must reproduce the above
+ *	  copyright notice, this list of conditions and the following
+ *	  disclaimer in the documentation and/or other materials
+ *	  provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* NVMe/TCP over io_uring.  Every connection in the process shares one
+ * ring, serviced by a single thread: listeners use multishot accept,
+ * connections use multishot recv into a provided buffer ring and PDUs go
+ * out as linked sends.  The ring thread frames received bytes into PDUs
+ * and flags each endpoint's eventfd, so callers keep the same
+ * event_fd/poll_for_msg model as the socket transport.
+ *
+ * Only the ring thread enters the kernel.  io_uring runs completion work
+ * on the submitting task and cancels its requests when it exits, so other
+ * threads queue entries and kick the ring thread through an eventfd, which
+ * then submits and waits in one io_uring_enter.
+ *
+ * Header and data digests are negotiated and checked as in the socket
+ * transport.  Capsule data digests are checked by the caller's thread in
+ * poll_for_msg, only C2H data is summed on the ring thread.
+ */
+
+#include "common.h"
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+
+#include "tcp.h"
+#include "ops.h"
+#include "crc32c.h"
+
+#define BACKLOG			16
+#define EVENT_TIMEOUT		200
+
+/* a PDU the peer takes no data of for this long fails the endpoint, the
+ * ring holds the caller's buffers until the sends are pulled back
+ */
+#define SEND_TIMEOUT		(10 * EVENT_TIMEOUT)
+
+/* a client that connects and says nothing must not hold up the next one */
+#define ICREQ_TIMEOUT		(10 * EVENT_TIMEOUT)
+
+#ifndef TCP_SYNCNT
+#define TCP_SYNCNT		7
+#endif
+#ifndef TCP_NODELAY
+#define TCP_NODELAY		1
+#endif
+
+#define URING_ENTRIES		1024
+#define URING_BGID		0
+
+/* receive buffers shared by every connection, must be a power of 2 */
+#define URING_BUFS		512
+#define URING_BUF_SIZE		PAGE_SIZE
+
+#define RX_BUF_SIZE		(PAGE_SIZE + 2 * NVME_TCP_DIGEST_LEN + \
+				 sizeof(struct nvme_tcp_cmd_capsule_pdu))
+
+/* digests asked for in ICReq and granted in ICResp */
+#define TCP_DIGESTS		(NVME_TCP_HDR_DIGEST_ENABLE | \
+				 NVME_TCP_DATA_DIGEST_ENABLE)
+
+/* receive buffers beyond the queue depth that a host may run us into */
+#define RX_EXTRA_BUFS(depth)	(3 * (depth))
+
+/* header with its digest, data, data digest */
+#define MAX_SEND_IOV		3
+
+/* the low bits of user_data say what completed, endpoints and listeners
+ * are allocated UD_ALIGN aligned to leave room for the type and send iov
+ */
+enum { UD_RECV = 0, UD_ACCEPT, UD_SEND, UD_CANCEL, UD_WAKE };
+#define UD_ALIGN		32
+#define UD_TYPE_MASK		7
+#define UD_IOV_SHIFT		3
+#define UD_IOV_MASK		3
+#define UD_PTR_MASK		(~(u64) (UD_ALIGN - 1))
+
+enum { RX_HDR = 0, RX_PDU, RX_DATA, RX_DDGST };
+
+struct uring {
+	int			 fd;
+	int			 wake_fd;
+	pthread_mutex_t		 lock;		/* submission queue */
+	pthread_cond_t		 space;
+	int			 space_waiters;
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_mask;
+	unsigned int		 sq_entries;
+	unsigned int		 sqe_tail;
+	struct io_uring_sqe	*sqes;
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		*cq_mask;
+	struct io_uring_cqe	*cqes;
+	struct io_uring_buf_ring *br;
+	unsigned short		 br_tail;
+	char			*bufs;
+	int			 no_mshot_recv;
+	int			 no_mshot_accept;
+};
+
+struct uring_qe {
+	struct uring_qe		*next;
+	char			*buf;
+	int			 extra;
+};
+
+struct uring_rx {
+	struct uring_qe		*qe;
+	char			*ptr;
+	int			 state;
+	u32			 offset;
+	u32			 len;
+	u32			 crc;		/* of the C2H data */
+	u16			 cid;		/* of the C2H data */
+};
+
+struct uring_rx_data {
+	char			*buf;
+	u32			 len;
+};
+
+struct uring_ep {
+	pthread_mutex_t		 lock;
+	pthread_cond_t		 cond;
+	pthread_mutex_t		 tx_lock;
+	struct uring_qe		*qe;
+	struct uring_qe		*free_qe;
+	struct uring_qe		*ready_head;
+	struct uring_qe		*ready_tail;
+	struct uring_rx_data	*rx_data;
+	struct uring_rx		 rx;
+	char			*icd;
+	u32			 icd_len;
+	int			 extra;
+	int			 sockfd;
+	int			 efd;
+	int			 err;
+	int			 armed;
+	int			 closing;
+	int			 state;
+	int			 hdgst;
+	int			 ddgst;
+	int			 send_left;
+	int			 send_res[MAX_SEND_IOV];
+	char			 tx_hdr[sizeof(union nvme_tcp_pdu) +
+					NVME_TCP_DIGEST_LEN];
+	__le32			 tx_ddgst;
+	__u64			 depth;
+};
+
+struct uring_pep {
+	int			 listenfd;
+	int			 pending[BACKLOG];
+	int			 head;
+	int			 count;
+	int			 armed;
+	int			 closing;
+};
+
+static struct uring		 ring = { .fd = -1, .wake_fd = -1 };
+static pthread_once_t		 ring_once = PTHREAD_ONCE_INIT;
+static __thread int		 in_ring_thread;
+
+/* accepted connections wait here for wait_for_connection.  stop_listener
+ * only touches this process wide state so that it cannot race a
+ * listener's teardown
+ */
+static pthread_mutex_t		 accept_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		 accept_cond = PTHREAD_COND_INITIALIZER;
+static int			 accept_stopped;
+
+static inline int sys_io_uring_setup(unsigned int entries,
+				     struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int sys_io_uring_enter(int fd, unsigned int to_submit,
+				     unsigned int min_complete,
+				     unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static inline int sys_io_uring_register(int fd, unsigned int opcode,
+					void *arg, unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static inline void *ud_ptr(u64 user_data)
+{
+	return (void *) (uintptr_t) (user_data & UD_PTR_MASK);
+}
+
+static inline u64 ud_make(void *ptr, int type, int iov)
+{
+	return (u64) (uintptr_t) ptr | type | (iov << UD_IOV_SHIFT);
+}
+
+/* make everything queued visible to the kernel, returns how many
+ * entries it has yet to consume. ring.lock must be held
+ */
+static unsigned int uring_publish(void)
+{
+	__atomic_store_n(ring.sq_tail, ring.sqe_tail, __ATOMIC_RELEASE);
+
+	return ring.sqe_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* queued entries go in on the ring thread's next io_uring_enter.
+ * ring.lock must be held
+ */
+static int uring_submit(void)
+{
+	u64			 val = 1;
+
+	uring_publish();
+
+	if (in_ring_thread)
+		return 0;
+
+	if (write(ring.wake_fd, &val, sizeof(val)) < 0 && errno != EAGAIN) {
+		print_errno("io_uring wakeup failed", errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+/* make room for n entries. The ring thread flushes the queue itself,
+ * anyone else waits for it to. ring.lock must be held
+ */
+static int uring_reserve(unsigned int n)
+{
+	unsigned int		 head;
+	int			 ret;
+
+	while (1) {
+		head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+		if (ring.sqe_tail - head + n <= ring.sq_entries)
+			return 0;
+
+		if (in_ring_thread) {
+			ret = sys_io_uring_enter(ring.fd, uring_publish(), 0, 0);
+			if (ret < 0 && errno != EINTR && errno != EAGAIN &&
+			    errno != EBUSY)
+				return -errno;
+			continue;
+		}
+
+		ret = uring_submit();
+		if (ret)
+			return ret;
+
+		ring.space_waiters++;
+		pthread_cond_wait(&ring.space, &ring.lock);
+		ring.space_waiters--;
+	}
+}
+
+/* next free submission entry, ring.lock must be held */
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+	struct io_uring_sqe	*sqe;
+
+	if (uring_reserve(1))
+		return NULL;
+
+	sqe = &ring.sqes[ring.sqe_tail++ & *ring.sq_mask];
+
+	memset(sqe, 0, sizeof(*sqe));
+
+	return sqe;
+}
+
+/* ring.lock must be held */
+static int uring_prep_cancel(u64 user_data)
+{
+	struct io_uring_sqe	*sqe;
+
+	sqe = uring_get_sqe();
+	if (!sqe)
+		return -ENOSPC;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = user_data;
+	sqe->user_data = ud_make(NULL, UD_CANCEL, 0);
+
+	return 0;
+}
+
+/* ring.lock must be held */
+static int uring_prep_wake(void)
+{
+	struct io_uring_sqe	*sqe;
+
+	sqe = uring_get_sqe();
+	if (!sqe)
+		return -ENOSPC;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = ring.wake_fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = ud_make(NULL, UD_WAKE, 0);
+
+	return 0;
+}
+
+/* ring.lock must be held */
+static int uring_prep_recv(struct uring_ep *ep)
+{
+	struct io_uring_sqe	*sqe;
+
+	sqe = uring_get_sqe();
+	if (!sqe)
+		return -ENOSPC;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = ep->sockfd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	if (!ring.no_mshot_recv)
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->user_data = ud_make(ep, UD_RECV, 0);
+
+	return 0;
+}
+
+/* ring.lock must be held */
+static int uring_prep_accept(struct uring_pep *pep)
+{
+	struct io_uring_sqe	*sqe;
+
+	sqe = uring_get_sqe();
+	if (!sqe)
+		return -ENOSPC;
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = pep->listenfd;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	if (!ring.no_mshot_accept)
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = ud_make(pep, UD_ACCEPT, 0);
+
+	return 0;
+}
+
+/* give a receive buffer back to the kernel, completion thread only */
+static void uring_recycle_buf(unsigned short bid)
+{
+	struct io_uring_buf	*buf;
+
+	buf = &ring.br->bufs[ring.br_tail & (URING_BUFS - 1)];
+
+	buf->addr = (u64) (uintptr_t) (ring.bufs + bid * URING_BUF_SIZE);
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+
+	__atomic_store_n(&ring.br->tail, ++ring.br_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_wake(struct uring_ep *ep)
+{
+	u64			 val = 1;
+
+	if (write(ep->efd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		print_errno("eventfd write failed", errno);
+}
+
+static int uring_create_queue_recv_pool(struct uring_ep *ep)
+{
+	struct uring_qe		*qe;
+	u16			 i;
+
+	qe = calloc(sizeof(struct uring_qe), ep->depth);
+	if (!qe)
+		goto err1;
+
+	for (i = 0; i < ep->depth; i++) {
+		qe[i].buf = malloc(RX_BUF_SIZE);
+		if (!qe[i].buf)
+			goto err2;
+	}
+
+	ep->rx_data = calloc(sizeof(struct uring_rx_data), ep->depth);
+	if (!ep->rx_data)
+		goto err2;
+
+	for (i = 0; i < ep->depth; i++) {
+		qe[i].next = ep->free_qe;
+		ep->free_qe = &qe[i];
+	}
+
+	ep->qe = qe;
+
+	return 0;
+err2:
+	while (i > 0)
+		free(qe[--i].buf);
+
+	free(qe);
+err1:
+	return -ENOMEM;
+}
+
+static void uring_free_qe(struct uring_qe *qe)
+{
+	free(qe->buf);
+	free(qe);
+}
+
+/* ep->lock must be held */
+static struct uring_qe *uring_get_qe(struct uring_ep *ep)
+{
+	struct uring_qe		*qe = ep->free_qe;
+
+	if (qe) {
+		ep->free_qe = qe->next;
+		return qe;
+	}
+
+	/* the host has more outstanding than it negotiated, ride it out
+	 * for a while rather than stall the completion thread
+	 */
+	if (ep->extra >= RX_EXTRA_BUFS((int) ep->depth))
+		return NULL;
+
+	qe = malloc(sizeof(*qe));
+	if (!qe)
+		return NULL;
+
+	qe->buf = malloc(RX_BUF_SIZE);
+	if (!qe->buf) {
+		free(qe);
+		return NULL;
+	}
+
+	qe->extra = 1;
+	ep->extra++;
+
+	return qe;
+}
+
+/* ep->lock must be held */
+static void uring_put_qe(struct uring_ep *ep, struct uring_qe *qe)
+{
+	if (qe->extra) {
+		ep->extra--;
+		uring_free_qe(qe);
+		return;
+	}
+
+	qe->next = ep->free_qe;
+	ep->free_qe = qe;
+}
+
+static void uring_free_ep(struct uring_ep *ep)
+{
+	struct uring_qe		*qe;
+	int			 i = ep->depth;
+
+	if (ep->rx.qe)
+		uring_put_qe(ep, ep->rx.qe);
+
+	while ((qe = ep->ready_head)) {
+		ep->ready_head = qe->next;
+		uring_put_qe(ep, qe);
+	}
+
+	if (ep->qe) {
+		while (i > 0)
+			if (ep->qe[--i].buf)
+				free(ep->qe[i].buf);
+		free(ep->qe);
+	}
+
+	if (ep->rx_data)
+		free(ep->rx_data);
+
+	if (ep->efd >= 0)
+		close(ep->efd);
+	if (ep->sockfd >= 0)
+		close(ep->sockfd);
+
+	pthread_cond_destroy(&ep->cond);
+	pthread_mutex_destroy(&ep->lock);
+	pthread_mutex_destroy(&ep->tx_lock);
+
+	free(ep);
+}
+
+static inline __le32 uring_digest(const void *buf, size_t len)
+{
+	return htole32(~crc32c(~0, buf, len));
+}
+
+static int uring_check_digest(const void *buf, size_t len, const void *dgst)
+{
+	__le32			 val;
+
+	memcpy(&val, dgst, sizeof(val));
+
+	return (val == uring_digest(buf, len)) ? 0 : -EPROTO;
+}
+
+/* the rx state machine, as in the socket transport but fed from the
+ * provided buffers. ep->lock must be held
+ */
+static int uring_rx_hdr(struct uring_ep *ep, struct nvme_tcp_common_hdr *hdr)
+{
+	struct uring_rx		*rx = &ep->rx;
+	u32			 hlen = hdr->hlen;
+
+	if (hlen < sizeof(*hdr))
+		return -EPROTO;
+
+	if (!(hdr->flags & NVME_TCP_F_HDGST) != !ep->hdgst ||
+	    ((hdr->flags & NVME_TCP_F_DDGST) && !ep->ddgst)) {
+		print_err("pdu digest flags %#x not as negotiated",
+			  hdr->flags);
+		return -EPROTO;
+	}
+
+	if (ep->hdgst)
+		hlen += NVME_TCP_DIGEST_LEN;
+
+	if (le32toh(hdr->plen) < hlen)
+		return -EPROTO;
+
+	switch (hdr->pdu_type) {
+	case NVME_TCP_CAPSULECMD:
+	case NVME_TCP_CAPSULERESP:
+		rx->len = le32toh(hdr->plen);
+		break;
+	case NVME_TCP_C2HDATA:
+		rx->len = hlen;
+		break;
+	case NVME_TCP_H2CTERMREQ:
+	case NVME_TCP_C2HTERMREQ:
+		return -ECONNRESET;
+	default:
+		print_err("unexpected pdu type %d", hdr->pdu_type);
+		return -EPROTO;
+	}
+
+	if (rx->len > RX_BUF_SIZE)
+		return -EPROTO;
+
+	rx->state = RX_PDU;
+
+	return 0;
+}
+
+static int uring_rx_data(struct uring_ep *ep, struct nvme_tcp_data_pdu *pdu)
+{
+	struct uring_rx		*rx = &ep->rx;
+	struct uring_rx_data	*dest;
+	u32			 offset = le32toh(pdu->data_offset);
+	u32			 len = le32toh(pdu->data_length);
+	u32			 plen = le32toh(pdu->c_hdr.plen) - pdu->c_hdr.hlen;
+
+	if (ep->hdgst)
+		plen -= NVME_TCP_DIGEST_LEN;
+	if (pdu->c_hdr.flags & NVME_TCP_F_DDGST)
+		plen -= NVME_TCP_DIGEST_LEN;
+
+	if (len != plen)
+		return -EPROTO;
+
+	if (pdu->cccid >= ep->depth)
+		return -EPROTO;
+
+	dest = &ep->rx_data[pdu->cccid];
+	if (!dest->buf || offset > dest->len || len > dest->len - offset) {
+		print_err("unexpected data for command id %u", pdu->cccid);
+		return -EPROTO;
+	}
+
+	rx->state = RX_DATA;
+	rx->ptr = dest->buf + offset;
+	rx->offset = 0;
+	rx->len = len;
+	rx->cid = pdu->cccid;
+
+	return 0;
+}
+
+/* once this returns the completion thread writes nothing more into the
+ * command's buffer, data still arriving for it fails the connection
+ */
+static void uring_release_cid(struct xp_ep *_ep, u16 cid)
+{
+	struct uring_ep		*ep = (struct uring_ep *) _ep;
+	struct uring_rx		*rx = &ep->rx;
+
+	if (cid >= ep->depth)
+		return;
+
+	pthread_mutex_lock(&ep->lock);
+
+	ep->rx_data[cid].buf = NULL;
+	ep->rx_data[cid].len = 0;
+
+	if (rx->qe && rx->state == RX_DATA && rx->cid == cid)
+		rx->ptr = NULL;
+
+	pthread_mutex_unlock(&ep->lock);
+}
+
+static int uring_rx_feed(struct uring_ep *ep, char *data, u32 bytes,
+			 int *ready)
+{
+	struct uring_rx		*rx = &ep->rx;
+	struct nvme_tcp_common_hdr *hdr;
+	struct uring_qe		*qe;
+	__le32			 dgst;
+	u32			 len;
+	int			 ret;
+
+	while (bytes) {
+		if (!rx->qe) {
+			rx->qe = uring_get_qe(ep);
+			if (!rx->qe) {
+				print_err("out of receive buffers");
+				return -ENOBUFS;
+			}
+
+			rx->state = RX_HDR;
+			rx->ptr = rx->qe->buf;
+			rx->offset = 0;
+			rx->len = sizeof(struct nvme_tcp_common_hdr);
+		}
+
+		len = min(bytes, rx->len - rx->offset);
+
+		/* the command this data was for has been released */
+		if (!rx->ptr)
+			return -ECONNABORTED;
+
+		memcpy(rx->ptr + rx->offset, data, len);
+
+		rx->offset += len;
+		data += len;
+		bytes -= len;
+
+		if (rx->offset < rx->len)
+			break;
+
+		qe = rx->qe;
+		hdr = (struct nvme_tcp_common_hdr *) qe->buf;
+
+		switch (rx->state) {
+		case RX_HDR:
+			ret = uring_rx_hdr(ep, hdr);
+			if (ret)
+				return ret;
+			break;
+		case RX_PDU:
+			if (ep->hdgst &&
+			    uring_check_digest(hdr, hdr->hlen,
+					       qe->buf + hdr->hlen)) {
+				print_err("header digest error, pdu type %d",
+					  hdr->pdu_type);
+				return -EPROTO;
+			}
+
+			if (hdr->pdu_type == NVME_TCP_C2HDATA) {
+				ret = uring_rx_data(ep, (void *) hdr);
+				if (ret)
+					return ret;
+				continue;
+			}
+
+			qe->next = NULL;
+			if (ep->ready_tail)
+				ep->ready_tail->next = qe;
+			else
+				__atomic_store_n(&ep->ready_head, qe,
+						 __ATOMIC_RELEASE);
+			ep->ready_tail = qe;
+
+			rx->qe = NULL;
+			*ready = 1;
+			continue;
+		case RX_DATA:
+			if (hdr->flags & NVME_TCP_F_DDGST) {
+				/* the digest lands behind the header */
+				rx->crc = crc32c(~0, rx->ptr, rx->len);
+				rx->state = RX_DDGST;
+				rx->ptr = qe->buf + hdr->hlen +
+					  NVME_TCP_DIGEST_LEN;
+				rx->offset = 0;
+				rx->len = NVME_TCP_DIGEST_LEN;
+				continue;
+			}
+
+			uring_put_qe(ep, qe);
+			rx->qe = NULL;
+			continue;
+		case RX_DDGST:
+			memcpy(&dgst, rx->ptr, sizeof(dgst));
+			if (dgst != htole32(~rx->crc)) {
+				print_err("data digest error on C2H data");
+				return -EPROTO;
+			}
+
+			uring_put_qe(ep, qe);
+			rx->qe = NULL;
+			continue;
+		}
+	}
+
+	return 0;
+}
+
+static void uring_handle_recv(struct uring_ep *ep, struct io_uring_cqe *cqe)
+{
+	unsigned short		 bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	int			 more = cqe->flags & IORING_CQE_F_MORE;
+	int			 res = cqe->res;
+	int			 wake = 0;
+	int			 ret;
+
+	pthread_mutex_lock(&ep->lock);
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		if (res > 0 && !ep->closing && !ep->err) {
+			ret = uring_rx_feed(ep, ring.bufs + bid * URING_BUF_SIZE,
+					    res, &wake);
+			if (ret) {
+				ep->err = ret;
+				shutdown(ep->sockfd, SHUT_RDWR);
+				wake = 1;
+			}
+		}
+		uring_recycle_buf(bid);
+	}
+
+	if (more)
+		goto out;
+
+	ep->armed = 0;
+
+	if (ep->closing) {
+		pthread_mutex_unlock(&ep->lock);
+		uring_free_ep(ep);
+		return;
+	}
+
+	if (res == -EINVAL && !ring.no_mshot_recv) {
+		print_err("multishot recv unsupported, using single shot");
+		ring.no_mshot_recv = 1;
+		res = 0;
+		goto rearm;
+	}
+
+	/* a terminated multishot or a single shot that got data, or the
+	 * buffer ring ran dry for a moment
+	 */
+	if (!ep->err && (res > 0 || res == -ENOBUFS))
+		goto rearm;
+
+	if (!ep->err)
+		ep->err = res ? res : -ECONNRESET;
+	wake = 1;
+	goto out;
+rearm:
+	pthread_mutex_lock(&ring.lock);
+	if (!uring_prep_recv(ep))
+		ep->armed = 1;
+	else {
+		ep->err = -ENOSPC;
+		wake = 1;
+	}
+	pthread_mutex_unlock(&ring.lock);
+out:
+	pthread_mutex_unlock(&ep->lock);
+
+	if (wake)
+		uring_wake(ep);
+}
+
+static void uring_handle_send(struct uring_ep *ep, int iov, int res)
+{
+	pthread_mutex_lock(&ep->lock);
+
+	ep->send_res[iov] = res;
+	if (!--ep->send_left)
+		pthread_cond_signal(&ep->cond);
+
+	pthread_mutex_unlock(&ep->lock);
+}
+
+static void uring_handle_accept(struct uring_pep *pep,
+				struct io_uring_cqe *cqe)
+{
+	int			 more = cqe->flags & IORING_CQE_F_MORE;
+	int			 res = cqe->res;
+
+	pthread_mutex_lock(&accept_lock);
+
+	if (res >= 0) {
+		if (pep->closing || pep->count == BACKLOG) {
+			if (!pep->closing)
+				print_err("accept backlog full, dropping");
+			close(res);
+		} else {
+			pep->pending[(pep->head + pep->count) % BACKLOG] = res;
+			pep->count++;
+			pthread_cond_broadcast(&accept_cond);
+		}
+	}
+
+	if (more)
+		goto out;
+
+	pep->armed = 0;
+
+	if (pep->closing) {
+		pthread_mutex_unlock(&accept_lock);
+		close(pep->listenfd);
+		free(pep);
+		return;
+	}
+
+	if (res == -EINVAL) {
+		if (ring.no_mshot_accept) {
+			print_err("accept failed %d", res);
+			goto out;
+		}
+		print_err("multishot accept unsupported, using single shot");
+		ring.no_mshot_accept = 1;
+	}
+
+	pthread_mutex_lock(&ring.lock);
+	if (!uring_prep_accept(pep))
+		pep->armed = 1;
+	pthread_mutex_unlock(&ring.lock);
+out:
+	pthread_mutex_unlock(&accept_lock);
+}
+
+/* a kick from another thread that queued entries */
+static void uring_handle_wake(struct io_uring_cqe *cqe)
+{
+	u64			 val;
+
+	if (read(ring.wake_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		print_errno("io_uring wakeup read failed", errno);
+
+	if (cqe->flags & IORING_CQE_F_MORE)
+		return;
+
+	pthread_mutex_lock(&ring.lock);
+	uring_prep_wake();
+	pthread_mutex_unlock(&ring.lock);
+}
+
+/* submit whatever has been queued and reap completions for every
+ * connection in the process, all in one io_uring_enter per pass
+ */
+static void *uring_thread(void *arg)
+{
+	struct io_uring_cqe	*cqe;
+	unsigned int		 head, tail;
+	unsigned int		 n;
+
+	UNUSED(arg);
+
+	in_ring_thread = 1;
+
+	pthread_mutex_lock(&ring.lock);
+	uring_prep_wake();
+	pthread_mutex_unlock(&ring.lock);
+
+	while (1) {
+		pthread_mutex_lock(&ring.lock);
+		n = uring_publish();
+		pthread_mutex_unlock(&ring.lock);
+
+		if (sys_io_uring_enter(ring.fd, n, 1,
+				       IORING_ENTER_GETEVENTS) < 0 &&
+		    errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			print_errno("io_uring_enter failed", errno);
+			break;
+		}
+
+		pthread_mutex_lock(&ring.lock);
+		if (ring.space_waiters)
+			pthread_cond_broadcast(&ring.space);
+		pthread_mutex_unlock(&ring.lock);
+
+		head = *ring.cq_head;
+		tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; head++) {
+			cqe = &ring.cqes[head & *ring.cq_mask];
+
+			switch (cqe->user_data & UD_TYPE_MASK) {
+			case UD_RECV:
+				uring_handle_recv(ud_ptr(cqe->user_data), cqe);
+				break;
+			case UD_SEND:
+				uring_handle_send(ud_ptr(cqe->user_data),
+						  (cqe->user_data >>
+						   UD_IOV_SHIFT) & UD_IOV_MASK,
+						  cqe->res);
+				break;
+			case UD_ACCEPT:
+				uring_handle_accept(ud_ptr(cqe->user_data),
+						    cqe);
+				break;
+			case UD_WAKE:
+				uring_handle_wake(cqe);
+				break;
+			}
+		}
+
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+static int uring_setup_buffers(void)
+{
+	struct io_uring_buf_reg	 reg;
+	size_t			 len;
+	int			 i;
+
+	len = URING_BUFS * sizeof(struct io_uring_buf);
+
+	ring.br = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring.br == MAP_FAILED) {
+		ring.br = NULL;
+		return -ENOMEM;
+	}
+
+	if (posix_memalign((void **) &ring.bufs, PAGE_SIZE,
+			   URING_BUFS * URING_BUF_SIZE))
+		return -ENOMEM;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (u64) (uintptr_t) ring.br;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_BGID;
+
+	if (sys_io_uring_register(ring.fd, IORING_REGISTER_PBUF_RING,
+				  &reg, 1) < 0)
+		return -errno;
+
+	for (i = 0; i < URING_BUFS; i++)
+		uring_recycle_buf(i);
+
+	return 0;
+}
+
+static int uring_setup(void)
+{
+	struct io_uring_params	 p;
+	size_t			 sq_len, cq_len;
+	char			*sq_ptr, *cq_ptr;
+	unsigned int		 i;
+	int			 fd;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = 4 * URING_ENTRIES;
+
+	fd = sys_io_uring_setup(URING_ENTRIES, &p);
+	if (fd < 0)
+		return -errno;
+
+	ring.fd = fd;
+
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cq_len > sq_len)
+			sq_len = cq_len;
+		cq_len = sq_len;
+	}
+
+	sq_ptr = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq_ptr == MAP_FAILED)
+		return -errno;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cq_ptr = sq_ptr;
+	else {
+		cq_ptr = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_POPULATE, fd,
+			      IORING_OFF_CQ_RING);
+		if (cq_ptr == MAP_FAILED)
+			return -errno;
+	}
+
+	ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			 fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+		return -errno;
+
+	ring.sq_head = (unsigned int *) (sq_ptr + p.sq_off.head);
+	ring.sq_tail = (unsigned int *) (sq_ptr + p.sq_off.tail);
+	ring.sq_mask = (unsigned int *) (sq_ptr + p.sq_off.ring_mask);
+	ring.sq_entries = p.sq_entries;
+	ring.sqe_tail = *ring.sq_tail;
+
+	for (i = 0; i < p.sq_entries; i++)
+		((unsigned int *) (sq_ptr + p.sq_off.array))[i] = i;
+
+	ring.cq_head = (unsigned int *) (cq_ptr + p.cq_off.head);
+	ring.cq_tail = (unsigned int *) (cq_ptr + p.cq_off.tail);
+	ring.cq_mask = (unsigned int *) (cq_ptr + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *) (cq_ptr + p.cq_off.cqes);
+
+	return uring_setup_buffers();
+}
+
+static void uring_init(void)
+{
+	pthread_attr_t		 attr;
+	pthread_t		 thread;
+	int			 ret;
+
+	pthread_mutex_init(&ring.lock, NULL);
+	pthread_cond_init(&ring.space, NULL);
+
+	ring.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ring.wake_fd < 0) {
+		ret = -errno;
+		goto err;
+	}
+
+	ret = uring_setup();
+	if (ret)
+		goto err;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	ret = pthread_create(&thread, &attr, uring_thread, NULL);
+
+	pthread_attr_destroy(&attr);
+
+	if (ret) {
+		ret = -ret;
+		goto err;
+	}
+
+	return;
+err:
+	print_err("io_uring unavailable (%d), using plain sockets", ret);
+
+	/* the mappings go with the process, the fd tells register_ops */
+	if (ring.fd >= 0)
+		close(ring.fd);
+	ring.fd = -1;
+}
+
+/* blocking exchange of the ICReq/ICResp before the ring takes over,
+ * all of len bytes have to arrive within timeout ms
+ */
+static int uring_read_full(struct uring_ep *ep, void *buf, int len,
+			   int timeout)
+{
+	struct pollfd		 fds = { .fd = ep->sockfd, .events = POLLIN };
+	u64			 deadline = monotonic_ms() + timeout;
+	char			*p = buf;
+	int			 ret;
+
+	while (len) {
+		if (stopped)
+			return -ESHUTDOWN;
+
+		if (monotonic_ms() >= deadline)
+			return -ETIMEDOUT;
+
+		ret = poll(&fds, 1, EVENT_TIMEOUT);
+		if (ret < 0 && errno != EINTR)
+			return -errno;
+		if (ret <= 0)
+			continue;
+
+		ret = read(ep->sockfd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -errno;
+		if (!ret)
+			return -ECONNRESET;
+
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int uring_send_full(int sockfd, void *buf, u32 len)
+{
+	char			*p = buf;
+	int			 ret;
+
+	while (len) {
+		ret = send(sockfd, p, len, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			print_err("send returned %d", errno);
+			return -errno;
+		}
+
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int uring_arm_recv(struct uring_ep *ep)
+{
+	int			 ret;
+
+	pthread_mutex_lock(&ep->lock);
+	pthread_mutex_lock(&ring.lock);
+
+	ret = uring_prep_recv(ep);
+	if (!ret)
+		ret = uring_submit();
+	if (!ret)
+		ep->armed = 1;
+
+	pthread_mutex_unlock(&ring.lock);
+	pthread_mutex_unlock(&ep->lock);
+
+	return ret;
+}
+
+/* send one PDU as linked sends of the header, the data and its digest,
+ * waiting for all to complete since the data belongs to the caller.
+ * Anything the ring did not get out, a short send or a send cancelled by
+ * its broken link, is finished with plain send.  The header is completed
+ * here since the header digest has to cover the final flags, pdo and plen
+ */
+static int uring_send_pdu(struct uring_ep *ep,
+			  struct nvme_tcp_common_hdr *hdr, void *data, u32 len)
+{
+	struct io_uring_sqe	*sqe;
+	struct timespec		 ts;
+	u64			 deadline = monotonic_ms() + SEND_TIMEOUT;
+	void			*buf[MAX_SEND_IOV] = { ep->tx_hdr, data,
+						       &ep->tx_ddgst };
+	u32			 size[MAX_SEND_IOV];
+	u32			 plen = hdr->hlen;
+	__le32			 hdgst;
+	int			 cnt = len ? 2 : 1;
+	int			 cancelled = 0;
+	int			 i, res, ret;
+
+	hdr->flags = 0;
+	hdr->pdo = 0;
+
+	if (ep->hdgst) {
+		hdr->flags |= NVME_TCP_F_HDGST;
+		plen += NVME_TCP_DIGEST_LEN;
+	}
+
+	size[0] = plen;
+
+	if (len) {
+		hdr->pdo = plen;
+		plen += len;
+
+		if (ep->ddgst) {
+			hdr->flags |= NVME_TCP_F_DDGST;
+			plen += NVME_TCP_DIGEST_LEN;
+			cnt = 3;
+		}
+	}
+
+	hdr->plen = htole32(plen);
+
+	size[1] = len;
+	size[2] = NVME_TCP_DIGEST_LEN;
+
+	pthread_mutex_lock(&ep->tx_lock);
+
+	memcpy(ep->tx_hdr, hdr, hdr->hlen);
+
+	if (ep->hdgst) {
+		hdgst = uring_digest(hdr, hdr->hlen);
+		memcpy(ep->tx_hdr + hdr->hlen, &hdgst, sizeof(hdgst));
+	}
+
+	if (cnt == 3)
+		ep->tx_ddgst = uring_digest(data, len);
+
+	pthread_mutex_lock(&ep->lock);
+	ep->send_left = cnt;
+	pthread_mutex_unlock(&ep->lock);
+
+	pthread_mutex_lock(&ring.lock);
+
+	/* the whole chain has to go in one submission */
+	ret = uring_reserve(cnt);
+	if (ret) {
+		pthread_mutex_unlock(&ring.lock);
+		goto out;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		sqe = uring_get_sqe();
+
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = ep->sockfd;
+		sqe->addr = (u64) (uintptr_t) buf[i];
+		sqe->len = size[i];
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		if (i < cnt - 1)
+			sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = ud_make(ep, UD_SEND, i);
+	}
+
+	ret = uring_submit();
+
+	pthread_mutex_unlock(&ring.lock);
+
+	if (ret)
+		goto out;
+
+	pthread_mutex_lock(&ep->lock);
+
+	while (ep->send_left) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += EVENT_TIMEOUT * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		pthread_cond_timedwait(&ep->cond, &ep->lock, &ts);
+
+		if (!ep->send_left || cancelled)
+			continue;
+
+		/* shutting down, or the peer stopped reading; the ring still
+		 * has our buffers so pull the sends back before returning
+		 */
+		if (stopped)
+			cancelled = -ESHUTDOWN;
+		else if (monotonic_ms() >= deadline)
+			cancelled = -ETIMEDOUT;
+		else
+			continue;
+
+		pthread_mutex_lock(&ring.lock);
+		for (i = 0; i < cnt; i++)
+			uring_prep_cancel(ud_make(ep, UD_SEND, i));
+		uring_submit();
+		pthread_mutex_unlock(&ring.lock);
+	}
+
+	/* part of the PDU may be on the wire, the stream cannot be resumed */
+	if (cancelled == -ETIMEDOUT) {
+		print_err("peer took no data for %d ms", SEND_TIMEOUT);
+		if (!ep->err)
+			ep->err = -ETIMEDOUT;
+		shutdown(ep->sockfd, SHUT_RDWR);
+	}
+
+	pthread_mutex_unlock(&ep->lock);
+
+	if (cancelled) {
+		ret = cancelled;
+		goto out;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		res = ep->send_res[i];
+		if (res == -ECANCELED || res == -EINTR || res == -EAGAIN)
+			res = 0;
+
+		if (res < 0) {
+			print_err("send returned %d", -res);
+			ret = res;
+			goto out;
+		}
+
+		if ((u32) res < size[i]) {
+			ret = uring_send_full(ep->sockfd, (char *) buf[i] + res,
+					      size[i] - res);
+			if (ret)
+				goto out;
+		}
+	}
+out:
+	pthread_mutex_unlock(&ep->tx_lock);
+
+	return ret;
+}
+
+static struct uring_ep *uring_alloc_ep(int sockfd, int depth)
+{
+	struct uring_ep		*ep;
+
+	if (posix_memalign((void **) &ep, UD_ALIGN, sizeof(*ep)))
+		return NULL;
+
+	memset(ep, 0, sizeof(*ep));
+
+	ep->sockfd = sockfd;
+	ep->depth = depth;
+
+	ep->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ep->efd < 0)
+		goto err1;
+
+	if (uring_create_queue_recv_pool(ep))
+		goto err2;
+
+	pthread_mutex_init(&ep->lock, NULL);
+	pthread_mutex_init(&ep->tx_lock, NULL);
+	pthread_cond_init(&ep->cond, NULL);
+
+	return ep;
+err2:
+	close(ep->efd);
+err1:
+	free(ep);
+	return NULL;
+}
+
+static int uring_init_endpoint(struct xp_ep **_ep, int depth)
+{
+	struct uring_ep		*ep;
+	int			 sockfd;
+
+	sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sockfd < 0) {
+		print_err("Error: Cannot create the socket");
+		return -errno;
+	}
+
+	ep = uring_alloc_ep(sockfd, depth);
+	if (!ep) {
+		close(sockfd);
+		return -ENOMEM;
+	}
+
+	*_ep = (struct xp_ep *) ep;
+
+	return 0;
+}
+
+static int uring_create_endpoint(struct xp_ep **_ep, void *id, int depth)
+{
+	struct uring_ep		*ep;
+
+	ep = uring_alloc_ep((intptr_t) id, depth);
+	if (!ep)
+		return -ENOMEM;
+
+	*_ep = (struct xp_ep *) ep;
+
+	return 0;
+}
+
+/* with a receive armed the completion thread frees the endpoint once
+ * the ring lets go of it
+ */
+static void uring_destroy_endpoint(struct xp_ep *_ep)
+{
+	struct uring_ep		*ep = (struct uring_ep *) _ep;
+	int			 armed;
+
+	pthread_mutex_lock(&ep->lock);
+
+	ep->closing = 1;
+	armed = ep->armed;
+
+	if (armed) {
+		pthread_mutex_lock(&ring.lock);
+		uring_prep_cancel(ud_make(ep, UD_RECV, 0));
+		uring_submit();
+		pthread_mutex_unlock(&ring.lock);
+
+		shutdown(ep->sockfd, SHUT_RDWR);
+	}
+
+	pthread_mutex_unlock(&ep->lock);
+
+	if (!armed)
+		uring_free_ep(ep);
+}
+
+static int uring_init_listener(struct xp_pep **_pep, char *srvc)
+{
+	struct uring_pep	*pep;
+	struct sockaddr_in	 addr;
+	int			 listenfd;
+	int			 ret;
+
+	pthread_once(&ring_once, uring_init);
+	if (ring.fd < 0)
+		return -ENODEV;
+
+	/* clear a shutdown left over from a previous run */
+	if (!stopped) {
+		pthread_mutex_lock(&accept_lock);
+		accept_stopped = 0;
+		pthread_mutex_unlock(&accept_lock);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(atoi(srvc));
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listenfd < 0) {
+		print_err("Socket error %d", errno);
+		return -errno;
+	}
+
+	ret = bind(listenfd, (struct sockaddr *) &addr, sizeof(addr));
+	if (ret < 0) {
+		print_err("Socket bind error %d", errno);
+		ret = -errno;
+		goto err1;
+	}
+
+	ret = listen(listenfd, BACKLOG);
+	if (ret) {
+		print_err("Socket listen error %d", errno);
+		ret = -errno;
+		goto err1;
+	}
+
+	if (posix_memalign((void **) &pep, UD_ALIGN, sizeof(*pep))) {
+		ret = -ENOMEM;
+		goto err1;
+	}
+
+	memset(pep, 0, sizeof(*pep));
+
+	pep->listenfd = listenfd;
+
+	pthread_mutex_lock(&accept_lock);
+	pthread_mutex_lock(&ring.lock);
+
+	ret = uring_prep_accept(pep);
+	if (!ret)
+		ret = uring_submit();
+	if (!ret)
+		pep->armed = 1;
+
+	pthread_mutex_unlock(&ring.lock);
+	pthread_mutex_unlock(&accept_lock);
+
+	if (ret)
+		goto err2;
+
+	*_pep = (struct xp_pep *) pep;
+
+	return 0;
+err2:
+	free(pep);
+err1:
+	close(listenfd);
+	return ret;
+}
+
+static void uring_destroy_listener(struct xp_pep *_pep)
+{
+	struct uring_pep	*pep = (struct uring_pep *) _pep;
+	int			 armed;
+
+	pthread_mutex_lock(&accept_lock);
+
+	pep->closing = 1;
+	armed = pep->armed;
+
+	while (pep->count) {
+		close(pep->pending[pep->head]);
+		pep->head = (pep->head + 1) % BACKLOG;
+		pep->count--;
+	}
+
+	if (armed) {
+		pthread_mutex_lock(&ring.lock);
+		uring_prep_cancel(ud_make(pep, UD_ACCEPT, 0));
+		uring_submit();
+		pthread_mutex_unlock(&ring.lock);
+
+		shutdown(pep->listenfd, SHUT_RDWR);
+	}
+
+	pthread_mutex_unlock(&accept_lock);
+
+	if (!armed) {
+		close(pep->listenfd);
+		free(pep);
+	}
+}
+
+static int uring_wait_for_connection(struct xp_pep *_pep, void **_id)
+{
+	struct uring_pep	*pep = (struct uring_pep *) _pep;
+	struct timespec		 ts;
+	int			 ret = 0;
+
+	pthread_mutex_lock(&accept_lock);
+
+	while (!pep->count && !accept_stopped && !stopped) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec++;
+
+		pthread_cond_timedwait(&accept_cond, &accept_lock, &ts);
+	}
+
+	if (pep->count) {
+		*_id = (void *) (intptr_t) pep->pending[pep->head];
+
+		pep->head = (pep->head + 1) % BACKLOG;
+		pep->count--;
+	} else
+		ret = -ESHUTDOWN;
+
+	pthread_mutex_unlock(&accept_lock);
+
+	return ret;
+}
+
+static void uring_stop_listener(struct xp_pep *_pep)
+{
+	UNUSED(_pep);
+
+	pthread_mutex_lock(&accept_lock);
+
+	accept_stopped = 1;
+	pthread_cond_broadcast(&accept_cond);
+
+	pthread_mutex_unlock(&accept_lock);
+}
+
+static int uring_accept_connection(struct xp_ep *_ep)
+{
+	struct uring_ep		*ep = (struct uring_ep *) _ep;
+	struct nvme_tcp_icreq_pdu init_req;
+	struct nvme_tcp_icresp_pdu init_rep;
+	int			 ret;
+
+	if (!ep)
+		return -EINVAL;
+
+	ret = uring_read_full(ep, &init_req, sizeof(init_req),
+			      ICREQ_TIMEOUT);
+	if (ret)
+		return ret;
+
+	if (init_req.c_hdr.pdu_type != NVME_TCP_ICREQ ||
+	    le32toh(init_req.c_hdr.plen) != sizeof(init_req))
+		return -EPROTO;
+
+	if (init_req.hpda != 0)
+		return -EPROTO;
+
+	memset(&init_rep, 0, sizeof(init_rep));
+
+	init_rep.c_hdr.pdu_type = NVME_TCP_ICRESP;
+	init_rep.c_hdr.hlen = sizeof(init_rep);
+	init_rep.c_hdr.pdo = 0;
+	init_rep.c_hdr.plen = htole32(sizeof(init_rep));
+	init_rep.pfv = htole16(NVME_TCP_PDU_FORMAT_VER);
+	init_rep.maxh2c = 0xffff;
+	init_rep.cpda = 0;
+	init_rep.dgst = init_req.dgst & TCP_DIGESTS;
+
+	ep->hdgst = !!(init_rep.dgst & NVME_TCP_HDR_DIGEST_ENABLE);
+	ep->ddgst = !!(init_rep.dgst & NVME_TCP_DATA_DIGEST_ENABLE);
+
+	ret = uring_send_full(ep->sockfd, &init_rep, sizeof(init_rep));
+	if (ret)
+		return ret;
+
+	return uring_arm_recv(ep);
+}
+
+static int uring_reject_connection(struct xp_ep *_ep, void *data, int len)
+{
+	UNUSED(_ep);
+	UNUSED(data);
+	UNUSED(len);
+
+	return 0;
+}
+
+static int uring_client_connect(struct xp_ep *_ep, struct sockaddr *dst,
+				void *data, int len)
+{
+	struct uring_ep		*ep = (struct uring_ep *) _ep;
+	struct nvme_tcp_icreq_pdu *req = data;
+	struct nvme_tcp_icresp_pdu reply;
+	int			 opt = 1;
+	int			 ret;
+
+	pthread_once(&ring_once, uring_init);
+	if (ring.fd < 0)
+		return -ENODEV;
+
+	ret = setsockopt(ep->sockfd, IPPROTO_TCP, TCP_SYNCNT,
+			 (char *) &opt, sizeof(opt));
+	if (ret != 0) {
+		print_err("setsockopt TCP_SYNCNT returned %d", errno);
+		return -errno;
+	}
+
+	ret = setsockopt(ep->sockfd, IPPROTO_TCP,
+			TCP_NODELAY, (char *) &opt, sizeof(opt));
+	if (ret != 0) {
+		print_err("setsockopt TCP_NODELAY returned %d", errno);
+		return -errno;
+	}
+
+	ret = connect(ep->sockfd, (struct sockaddr *) dst, sizeof(*dst));
+	if (ret != 0)
+		return -errno;
+
+	ret = uring_send_full(ep->sockfd, data, len);
+	if (ret)
+		return ret;
+
+	ret = uring_read_full(ep, &reply, sizeof(reply), ICREQ_TIMEOUT);
+	if (ret) {
+		print_err("read returned %d", ret);
+		return ret;
+	}
+
+	if (reply.c_hdr.pdu_type != NVME_TCP_ICRESP ||
+	    le32toh(reply.c_hdr.plen) != sizeof(reply) ||
+	    reply.c_hdr.hlen != sizeof(reply)) {
+		print_err("bad connect reply type %d", reply.c_hdr.pdu_type);
+		return -EINVAL;
+	}
+
+	/* the controller may grant fewer digests than asked for, not more */
+	if ((reply.dgst & ~req->dgst) || reply.cpda != 0) {
+		print_err("unsupported digest %d cpda %d", reply.dgst,
+			  reply.cpda);
+		return -EINVAL;
+	}
+
+	ep->hdgst = !!(reply.dgst & NVME_TCP_HDR_DIGEST_ENABLE);
+	ep->ddgst = !!(reply.dgst & NVME_TCP_DATA_DIGEST_ENABLE);
+
+	ret = uring_arm_recv(ep);
+	if (ret)
+		return ret;
+
+	ep->state = CONNECTED;
+
+	return 0;
+}
+
+static int uring_rma_read(struct xp_ep *_ep, void *buf, u64 addr, u64 _len,
+			  u32 rkey, struct xp_mr *_mr)
+{
+	struct uring_ep		*ep = (struct uring_ep *) _ep;
+
+	UNUSED(addr);
+	UNUSED(rkey);
+	UNUSED(_mr);
+
+	if (_len > ep->icd_len) {
+		print_err("expected %llu bytes in capsule, have %u",
+			  (unsigned long long) _len, ep->icd_len);
+		return -EINVAL;
+	}
+
+	memcpy(buf, ep->icd, _len);
+
+	return 0;
+}
+
+static int uring_rma_write(struct xp_ep *_ep, void *buf, u64 addr, u64 _len,
+			   u32 rkey, struct xp_mr *_mr,
+			   struct nvme_command *cmd)
+{
+	struct uring_ep		*ep = (struct uring_ep *) _ep;
+	struct nvme_tcp_data_pdu pdu;
+
+	UNUSED(_mr);
+	UNUSED(addr);
+	UNUSED(rkey);
+
+	memset(&pdu, 0, sizeof(pdu));
+
+	pdu.c_hdr.pdu_type = NVME_TCP_C2HDATA;
+	pdu.c_hdr.hlen = sizeof(pdu);
+	pdu.data_length = htole32(_len);
+	pdu.cccid = cmd->common.command_id;
+
+	return uring_send_pdu(ep, &pdu.c_hdr, buf, _len);
+}
+
+static int uring_repost_recv(struct xp_ep *_ep, struct xp_qe *_qe)
+{
+	struct uring_ep		*ep = (struct uring_ep *) _ep;
+	struct uring_qe		*qe = (struct uring_qe *) _qe;
+
+	if (!qe)
+		return 0;
+
+	pthread_mutex_lock(&ep->lock);
+
+	if (ep->icd && ep->icd >= qe->buf && ep->icd < qe->buf + RX_BUF_SIZE) {
+		ep->icd = NULL;
+		ep->icd_len = 0;
+	}
+
+	uring_put_qe(ep, qe);
+
+	pthread_mutex_unlock(&ep->lock);
+
+	return 0;
+}
+
+static inline int uring_data_direction(struct nvme_command *cmd)
+{
+	if (cmd->common.opcode == nvme_fabrics_command)
+		return cmd->fabrics.fctype & NVME_OPCODE_MASK;
+
+	return cmd->common.opcode & NVME_OPCODE_MASK;
+}
+
+static int uring_send_msg(struct xp_ep *_ep, void *msg, int _len,
+			  struct xp_mr *_mr)
+{
+	struct nvme_command	*cmd = (struct nvme_command *) msg;
+	struct uring_ep		*ep = (struct uring_ep *) _ep;
+	struct nvme_sgl_desc	*sg = &cmd->common.dptr.sgl;
+	struct nvme_tcp_cmd_capsule_pdu pdu;
+	u16			 cid = cmd->common.command_id;
+	void			*data = NULL;
+	u32			 len = 0;
+	int			 direction;
+
+	UNUSED(_len);
+	UNUSED(_mr);
+
+	memset(&pdu.c_hdr, 0, sizeof(pdu.c_hdr));
+
+	pdu.c_hdr.pdu_type = NVME_TCP_CAPSULECMD;
+	pdu.c_hdr.hlen = sizeof(pdu);
+
+	memcpy(&pdu.cmd, cmd, sizeof(struct nvme_command));
+
+	direction = uring_data_direction(cmd);
+	if (direction == NVME_OPCODE_H2C && sg->length) {
+		if (sg->length > PAGE_SIZE)
+			return -EINVAL;
+
+		data = (void *) sg->addr;
+		len = sg->length;
+	} else if (direction == NVME_OPCODE_C2H && cid < ep->depth) {
+		/* set before the command goes out, the completion thread
+		 * lands the data here
+		 */
+		pthread_mutex_lock(&ep->lock);
+		ep->rx_data[cid].buf = (char *) sg->addr;
+		ep->rx_data[cid].len = sg->length;
+		pthread_mutex_unlock(&ep->lock);
+	}
+
+	return uring_send_pdu(ep, &pdu.c_hdr, data, len);
+}
+
+static int uring_send_rsp(struct xp_ep *_ep, void *msg, int _len,
+			  struct xp_mr *_mr)
+{
+	struct uring_ep		*ep = (struct uring_ep *) _ep;
+	struct nvme_tcp_resp_capsule_pdu pdu;
+
+	UNUSED(_mr);
+	UNUSED(_len);
+
+	memset(&pdu.c_hdr, 0, sizeof(pdu.c_hdr));
+
+	pdu.c_hdr.pdu_type = NVME_TCP_CAPSULERESP;
+	pdu.c_hdr.hlen = sizeof(pdu);
+
+	memcpy(&pdu.cqe, msg, sizeof(struct nvme_completion));
+
+	return uring_send_pdu(ep, &pdu.c_hdr, NULL, 0);
+}
+
+/* hand up the next PDU framed by the completion thread.  The eventfd is
+ * drained before looking so a PDU queued meanwhile leaves it signalled
+ */
+static int uring_poll_for_msg(struct xp_ep *_ep, struct xp_qe **_qe,
+			      void **_msg, int *bytes)
+{
+	struct uring_ep		*ep = (struct uring_ep *) _ep;
+	struct nvme_tcp_common_hdr *hdr;
+	struct uring_qe		*qe;
+	u32			 plen, hlen, pdo;
+	u64			 val;
+	int			 ret;
+
+	if (!__atomic_load_n(&ep->ready_head, __ATOMIC_ACQUIRE) &&
+	    read(ep->efd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		return -errno;
+
+	pthread_mutex_lock(&ep->lock);
+
+	qe = ep->ready_head;
+	if (!qe) {
+		ret = ep->err ? ep->err : -EAGAIN;
+		pthread_mutex_unlock(&ep->lock);
+		return ret;
+	}
+
+	ep->ready_head = qe->next;
+	if (!ep->ready_head)
+		ep->ready_tail = NULL;
+
+	hdr = (struct nvme_tcp_common_hdr *) qe->buf;
+	plen = le32toh(hdr->plen);
+	hlen = hdr->hlen;
+
+	ep->icd = NULL;
+	ep->icd_len = 0;
+
+	ret = 0;
+
+	if (ep->hdgst)
+		hlen += NVME_TCP_DIGEST_LEN;
+
+	if (plen > hlen) {
+		pdo = hdr->pdo ? hdr->pdo : hlen;
+		if (hdr->flags & NVME_TCP_F_DDGST)
+			plen -= NVME_TCP_DIGEST_LEN;
+
+		if (pdo < hlen || pdo > plen) {
+			uring_put_qe(ep, qe);
+			ret = -EPROTO;
+			goto out;
+		}
+
+		if ((hdr->flags & NVME_TCP_F_DDGST) &&
+		    uring_check_digest(qe->buf + pdo, plen - pdo,
+				       qe->buf + plen)) {
+			print_err("data digest error, pdu type %d",
+				  hdr->pdu_type);
+			uring_put_qe(ep, qe);
+			ret = -EPROTO;
+			goto out;
+		}
+
+		ep->icd = qe->buf + pdo;
+		ep->icd_len = plen - pdo;
+	}
+
+	*_qe = (struct xp_qe *) qe;
+	*_msg = qe->buf + sizeof(*hdr);
+	*bytes = hdr->hlen - sizeof(*hdr);
+out:
+	pthread_mutex_unlock(&ep->lock);
+
+	return ret;
+}
+
+static int uring_event_fd(struct xp_ep *_ep)
+{
+	struct uring_ep		*ep = (struct uring_ep *) _ep;
+
+	return ep->efd;
+}
+
+static int uring_build_connect_data(void **req, char *hostnqn)
+{
+	struct nvme_tcp_icreq_pdu *connect;
+	int			 bytes = sizeof(*connect);
+
+	UNUSED(hostnqn);
+
+	if (posix_memalign((void **) &connect, PAGE_SIZE, bytes))
+		return -errno;
+
+	memset(connect, 0, bytes);
+
+	connect->c_hdr.pdu_type = NVME_TCP_ICREQ;
+	connect->c_hdr.hlen = sizeof(*connect);
+	connect->c_hdr.pdo = 0;
+	connect->c_hdr.plen = htole32(sizeof(*connect));
+
+	connect->pfv = htole16(NVME_TCP_CONNECT_FMT_1_0);
+	connect->maxr2t = 0;
+	connect->dgst = TCP_DIGESTS;
+	connect->hpda = 0;
+
+	*req = connect;
+
+	return bytes;
+}
+
+static struct xp_ops uring_ops = {
+	.init_endpoint		= uring_init_endpoint,
+	.create_endpoint	= uring_create_endpoint,
+	.destroy_endpoint	= uring_destroy_endpoint,
+	.init_listener		= uring_init_listener,
+	.destroy_listener	= uring_destroy_listener,
+	.wait_for_connection	= uring_wait_for_connection,
+	.stop_listener		= uring_stop_listener,
+	.accept_connection	= uring_accept_connection,
+	.reject_connection	= uring_reject_connection,
+	.client_connect		= uring_client_connect,
+	.rma_read		= uring_rma_read,
+	.rma_write		= uring_rma_write,
+	.repost_recv		= uring_repost_recv,
+	.post_msg		= uring_send_msg,
+	.send_msg		= uring_send_msg,
+	.send_rsp		= uring_send_rsp,
+	.poll_for_msg		= uring_poll_for_msg,
+	.event_fd		= uring_event_fd,
+	.build_connect_data	= uring_build_connect_data,
+	.release_cid		= uring_release_cid,
+};
+
+/* NULL when the kernel cannot run the ring, register_ops then falls back
+ * to the socket transport.  Keys and SGLs are the same as TCP's
+ */
+struct xp_ops *uring_register_ops(void)
+{
+	struct xp_ops		*tcp;
+
+	pthread_once(&ring_once, uring_init);
+	if (ring.fd < 0)
+		return NULL;
+
+	tcp = tcp_register_ops();
+
+	uring_ops.alloc_key = tcp->alloc_key;
+	uring_ops.remote_key = tcp->remote_key;
+	uring_ops.dealloc_key = tcp->dealloc_key;
+	uring_ops.set_sgl = tcp->set_sgl;
+
+	return &uring_ops;
+}
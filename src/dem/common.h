@@ -52,6 +52,7 @@
 
 #include "nvme.h"
 #include "utils.h"
+#include "timer.h"
 #include "ops.h"
 #include "json.h"
 #include "tags.h"
@@ -68,7 +69,6 @@ extern int			 debug;
 extern int			 curl_show_results;
 extern int			 num_interfaces;
 extern struct host_iface	*interfaces;
-extern struct linked_list	*aen_req_list;
 extern struct linked_list	*target_list;
 extern struct linked_list	*group_list;
 extern struct linked_list	*host_list;
@@ -85,9 +85,14 @@ extern struct linked_list	*host_list;
 #define LARGEST_VAL		40
 #define ADDR_LEN		16 /* IPV6 is current longest address */
 #define DISCOVERY_CTRL_NQN	"DEM_Discovery_Controller"
+#define DEFAULT_HOST_WORKERS	1
+#define MAX_HOST_WORKERS	64
+#define HOST_HASH_SIZE		64	/* power of 2 */
+#define DEFAULT_AEN_DELAY	500	/* ms */
 
 enum {RESTRICTED = 0, ALLOW_ANY = 1, UNDEFINED_ACCESS = -1};
 enum {GROUP_EVENT = 0, PORT_EVENT, SUBSYS_EVENT, ACL_EVENT};
+enum {TARGET_HEALTHY = 0, TARGET_RECONNECTING, TARGET_UNREACHABLE};
 
 #define is_restricted(subsys) (subsys->access == RESTRICTED)
 
@@ -115,6 +120,7 @@ struct host_iface {
 	char			 address[CONFIG_ADDRESS_SIZE + 1];
 	int			 addr[ADDR_LEN];
 	char			 port[CONFIG_PORT_SIZE + 1];
+	int			 workers;
 	struct xp_pep		*listener;
 	struct xp_ops		*ops;
 };
@@ -126,6 +132,7 @@ struct oob_iface {
 
 struct host {
 	struct linked_list	 node;
+	struct linked_list	 hash_node;
 	struct subsystem	*subsystem;
 	char			 alias[MAX_ALIAS_SIZE + 1];
 	char			 nqn[MAX_NQN_SIZE + 1];
@@ -151,6 +158,7 @@ struct subsystem {
 	struct linked_list	 host_list;
 	struct linked_list	 ns_list;
 	struct linked_list	 logpage_list;
+	struct linked_list	 host_hash[HOST_HASH_SIZE];
 	struct target		*target;
 	char			 nqn[MAX_NQN_SIZE + 1];
 	int			 access;
@@ -191,10 +199,21 @@ struct target {
 	char			 alias[MAX_ALIAS_SIZE + 1];
 	int			 mgmt_mode;
 	int			 refresh;
-	int			 log_page_retry_count;
-	int			 refresh_countdown;
-	int			 kato_countdown;
+	struct timer		 kato_timer;
+	struct timer		 refresh_timer;
+	struct timer		 reconnect_timer;
+	u64			 next_attempt;	/* monotonic ms */
+	u64			 recovered_at;	/* monotonic ms */
+	int			 health;
+	int			 failures;
 	bool			 group_member;
+	bool			 kato_sent;
+	bool			 reconnect;
+	bool			 probing;
+	/* set config commands streamed by config_target_inb */
+	bool			 inb_stream;
+	int			 inb_pending;
+	int			 inb_status;
 };
 
 struct group {
@@ -215,14 +234,6 @@ struct group_host_link {
 	char			 nqn[MAX_NQN_SIZE + 1];
 };
 
-struct event_notification {
-	struct linked_list	 node;
-	struct endpoint		*ep;
-	struct event_notification *req;
-	char			 nqn[MAX_NQN_SIZE + 1];
-	int			 valid;
-};
-
 struct mg_connection;
 struct mg_str;
 
@@ -244,6 +255,8 @@ void *interface_thread(void *arg);
 
 int start_pseudo_target(struct host_iface *iface);
 int run_pseudo_target(struct endpoint *ep, void *id);
+void send_notifications(void);
+void notify_hosts(void);
 
 void build_lists(void);
 struct group *init_group(char *name);
@@ -255,15 +268,33 @@ struct target *find_target(char *alias);
 
 struct subsystem *new_subsys(struct target *target, char *nqn);
 
+void add_subsys_host(struct subsystem *subsys, struct host *host);
+void del_subsys_host(struct host *host);
+void rehash_subsys_host(struct host *host, char *nqn);
+struct host *find_subsys_host(struct subsystem *subsys, char *nqn);
+
+void init_target_timers(struct target *target);
+void arm_target_timers(struct target *target);
+void disarm_target_timers(struct target *target);
+void target_unreachable(struct target *target);
+void connect_target_queues(struct target *target);
+
 void refresh_log_pages(struct target *target);
+void poll_log_pages(struct target *target);
 void fetch_log_pages(struct ctrl_queue *dq);
+void free_dq(struct ctrl_queue *dq);
 void del_unattached_logpage_list(struct target *target);
+void invalidate_discovery_logs(void);
+int get_discovery_log(char *nqn, u64 offset, void *buf, int len);
+u64 get_discovery_genctr(char *nqn);
+void free_discovery_logs(void);
 
 void create_discovery_queue(struct target *target, struct subsystem *subsys,
 			    struct portid *portid);
 int target_reconfig(char *alias);
 int target_refresh(char *alias);
 int target_usage(char *alias, char **results);
+int target_health(char *alias, char **results);
 int target_logpage(char *alias, char **results);
 int host_logpage(char *alias, char **results);
 
@@ -139,217 +139,47 @@ static inline struct group_host_link *find_group_host(struct group *group,
 	return NULL;
 }
 
-/* notification functions */
-
-static inline int send_notifications(struct linked_list *list)
-{
-	struct event_notification *entry, *next;
-	struct endpoint		*ep;
-	struct nvme_completion	*resp;
-
-	list_for_each_entry_safe(entry, next, list, node) {
-		ep = entry->ep;
-		resp = (void *) ep->cmd;
-		if (!resp)
-			goto cleanup;
-
-		memset(resp, 0, sizeof(*resp));
-
-		resp->result.U32 = NVME_AER_NOTICE_LOG_PAGE_CHANGE;
-
-		if (ep->state == CONNECTED)
-			ep->ops->send_rsp(ep->ep, resp, sizeof(*resp), ep->mr);
-		else
-			print_err("cannot send AER_NOTICE to %p state %d", ep,
-				  ep->state);
-cleanup:
-		list_del(&entry->req->node);
-		free(entry->req);
-		list_del(&entry->node);
-		free(entry);
-	}
-
-	return 0;
-}
+/* subsystem ACL: hosts are kept on subsys->host_list for ordered walks and
+ * in subsys->host_hash by NQN so access checks do not scan the list
+ */
 
-static inline int in_notification_list(struct linked_list *list, char *nqn)
+static inline struct linked_list *host_bucket(struct subsystem *subsys,
+					      char *nqn)
 {
-	struct event_notification *entry;
-
-	list_for_each_entry(entry, list, node)
-		if (!strcmp(nqn, entry->nqn))
-			return 1;
-
-	return 0;
+	return &subsys->host_hash[hash_str(nqn) & (HOST_HASH_SIZE - 1)];
 }
 
-static inline void create_notification_entry(struct linked_list *list,
-					     struct event_notification *req)
+void add_subsys_host(struct subsystem *subsys, struct host *host)
 {
-	struct event_notification *entry;
-
-	entry = malloc(sizeof(*entry));
-	if (!entry)
-		return;
-
-	memset(entry, 0, sizeof(*entry));
-
-	strncpy(entry->nqn, req->nqn, MAX_NQN_SIZE);
-	entry->ep = req->ep;
-	entry->req = req;
+	host->subsystem = subsys;
 
-	list_add_tail(&entry->node, list);
+	list_add_tail(&host->node, &subsys->host_list);
+	list_add_tail(&host->hash_node, host_bucket(subsys, host->nqn));
 }
 
-static inline void create_notification_list(struct linked_list *list)
+void del_subsys_host(struct host *host)
 {
-	struct event_notification *req;
-
-	INIT_LINKED_LIST(list);
-
-	list_for_each_entry(req, aen_req_list, node)
-		if (!in_notification_list(list, req->nqn))
-			create_notification_entry(list, req);
+	list_del(&host->node);
+	list_del(&host->hash_node);
 }
 
-static inline int any_subsys_unrestricted(struct target *target)
+void rehash_subsys_host(struct host *host, char *nqn)
 {
-	struct subsystem	*subsys;
-
-	list_for_each_entry(subsys, &target->subsys_list, node)
-		if (!is_restricted(subsys))
-			return 1;
-	return 0;
-}
+	list_del(&host->hash_node);
 
-static inline void flag_by_group_hosts(struct group *group,
-				       struct linked_list *list)
-{
-	struct event_notification *entry;
-	struct group_host_link	*host;
+	strcpy(host->nqn, nqn);
 
-	list_for_each_entry(entry, list, node)
-		list_for_each_entry(host, host_list, node) {
-			if ((host->group == group) &&
-			    (strcmp(host->nqn, entry->nqn))) {
-				entry->valid = 1;
-				break;
-			}
-		}
+	list_add_tail(&host->hash_node, host_bucket(host->subsystem, nqn));
 }
 
-static inline void flag_by_access_list(struct subsystem *subsys,
-				       struct linked_list *list)
+struct host *find_subsys_host(struct subsystem *subsys, char *nqn)
 {
-	struct event_notification *entry;
 	struct host		*host;
 
-	list_for_each_entry(entry, list, node)
-		list_for_each_entry(host, &subsys->host_list, node) {
-			if (strcmp(host->nqn, entry->nqn)) {
-				entry->valid = 1;
-				break;
-			}
-		}
-}
-
-static inline void prune_notification_list(struct linked_list *list)
-{
-	struct event_notification *entry, *next;
-
-	list_for_each_entry_safe(entry, next, list, node)
-		if (!entry->valid)
-			list_del(&entry->node);
-}
-
-static inline void enable_entire_list(struct linked_list *list)
-{
-	struct event_notification *entry;
-
-	list_for_each_entry(entry, list, node)
-		entry->valid = 1;
-}
-
-static inline void create_event_host_list_for_subsys(struct linked_list *list,
-						     struct subsystem *subsys)
-{
-	create_notification_list(list);
-
-	if (list_empty(list))
-		return;
-
-	if (!is_restricted(subsys)) {
-		enable_entire_list(list);
-		return;
-	}
-
-	flag_by_access_list(subsys, list);
-
-	prune_notification_list(list);
-}
-
-static inline void create_event_host_list_for_group(struct linked_list *list,
-						    struct group *group,
-						    struct target *target)
-{
-	struct subsystem	*subsys;
-
-	create_notification_list(list);
-
-	if (list_empty(list))
-		return;
-
-	flag_by_group_hosts(group, list);
-
-	prune_notification_list(list);
-
-	if (list_empty(list))
-		return;
-
-	if (any_subsys_unrestricted(target)) {
-		enable_entire_list(list);
-		return;
-	}
-
-	list_for_each_entry(subsys, &target->subsys_list, node)
-		flag_by_access_list(subsys, list);
-
-	prune_notification_list(list);
-}
-
-static inline void create_event_host_list_for_target(struct linked_list *list,
-						     struct target *target)
-{
-	struct subsystem	*subsys;
-
-	create_notification_list(list);
-
-	if (list_empty(list))
-		return;
-
-	if (any_subsys_unrestricted(target)) {
-		enable_entire_list(list);
-		return;
-	}
-
-	list_for_each_entry(subsys, &target->subsys_list, node)
-		flag_by_access_list(subsys, list);
-
-	prune_notification_list(list);
-}
-
-static inline void create_event_host_list_for_host(struct linked_list *list,
-						   char *nqn)
-{
-	struct event_notification *req;
-
-	INIT_LINKED_LIST(list);
-
-	list_for_each_entry(req, aen_req_list, node)
-		if (!strcmp(nqn, req->nqn)) {
-			create_notification_entry(list, req);
-			break;
-		}
+	list_for_each_entry(host, host_bucket(subsys, nqn), hash_node)
+		if (!strcmp(host->nqn, nqn))
+			return host;
+	return NULL;
 }
 
 static void _del_subsys_dq(struct subsystem *subsys)
@@ -361,8 +191,7 @@ static void _del_subsys_dq(struct subsystem *subsys)
 		if (dq->subsys != subsys)
 			continue;
 
-		list_del(&dq->node);
-		free(dq);
+		free_dq(dq);
 
 		target_refresh(target->alias);
 
@@ -433,7 +262,7 @@ static inline void _reset_subsys_dq_nqn(struct subsystem *subsys, char *nqn)
 			disconnect_ctrl(dq, 0);
 
 		if (list_empty(&subsys->host_list))
-			list_del(&dq->node);
+			free_dq(dq);
 		else {
 			host = list_first_entry(&subsys->host_list,
 						struct host, node);
@@ -523,13 +352,14 @@ void add_host_to_group(struct group *group, char *alias)
 	strcpy(link->nqn, nqn);
 
 	list_add_tail(&link->node, host_list);
+
+	notify_hosts();
 }
 
 void add_target_to_group(struct group *group, char *alias)
 {
 	struct target		*target;
 	struct group_target_link *link;
-	struct linked_list	 list;
 
 	target = find_target(alias);
 	if (!target)
@@ -544,8 +374,7 @@ void add_target_to_group(struct group *group, char *alias)
 
 	list_add_tail(&link->node, &group->target_list);
 
-	create_event_host_list_for_group(&list, group, target);
-	send_notifications(&list);
+	notify_hosts();
 }
 
 int set_group_member(char *name, char *data, char *alias, char *tag,
@@ -580,13 +409,14 @@ static inline void del_host_from_group(struct group *group, char *alias)
 
 	list_del(&link->node);
 	free(link);
+
+	notify_hosts();
 }
 
 static inline void del_target_from_group(struct group *group, char *alias)
 {
 	struct target		*target;
 	struct group_target_link *link;
-	struct linked_list	 list;
 
 	target = find_target(alias);
 	if (!target)
@@ -606,8 +436,7 @@ static inline void del_target_from_group(struct group *group, char *alias)
 
 	target->group_member = false;
 
-	create_event_host_list_for_group(&list, group, target);
-	send_notifications(&list);
+	notify_hosts();
 }
 
 int del_group_member(char *name, char *alias, char *tag, char *parent_tag,
@@ -651,6 +480,8 @@ int del_group(char *name, char *resp)
 	list_del(&group->node);
 	free(group);
 
+	notify_hosts();
+
 	return 0;
 }
 
@@ -974,6 +805,11 @@ static int send_update_subsys_oob(struct target *target, char *subsys,
 	return exec_post(uri, buf, strlen(buf));
 }
 
+/* startup threads fetch the configs of several targets at once and
+ * record them in the one json tree
+ */
+static pthread_mutex_t		 json_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* in band get config messages */
 
 static inline int get_inb_nsdevs(struct target *target)
@@ -1024,7 +860,9 @@ static inline int get_inb_nsdevs(struct target *target)
 		nsdev->nsdev = devid;
 		nsdev->nsid = entry->nsid;
 
+		pthread_mutex_lock(&json_lock);
 		set_json_inb_nsdev(target, nsdev);
+		pthread_mutex_unlock(&json_lock);
 
 		list_add_tail(&nsdev->node, &target->device_list);
 
@@ -1076,7 +914,9 @@ static inline int get_inb_xports(struct target *target)
 	list_for_each_entry(iface, &target->fabric_iface_list, node)
 		iface->valid = 0;
 
+	pthread_mutex_lock(&json_lock);
 	init_json_inb_fabric_iface(target);
+	pthread_mutex_unlock(&json_lock);
 
 	for (i = hdr->num_entries; i > 0; i--, entry++) {
 		memset(addr, 0, sizeof(addr));
@@ -1102,7 +942,9 @@ static inline int get_inb_xports(struct target *target)
 		strcpy(iface->fam, fam);
 		strncpy(iface->addr, addr, CONFIG_ADDRESS_SIZE);
 
+		pthread_mutex_lock(&json_lock);
 		set_json_inb_fabric_iface(target, iface);
+		pthread_mutex_unlock(&json_lock);
 
 		list_add_tail(&iface->node, &target->fabric_iface_list);
 
@@ -1160,16 +1002,90 @@ static int get_inb_config(struct target *target)
 
 /* set config (INB) command handlers */
 
+#define SET_CONFIG_TIMEOUT	2000 /* ms */
+
+static void set_config_done(struct endpoint *ep, struct cmd_ctx *ctx,
+			    int status)
+{
+	struct target		*target = ctx->arg;
+
+	UNUSED(ep);
+
+	target->inb_pending--;
+
+	if (status && !target->inb_status)
+		target->inb_status = status;
+}
+
+/* queued without waiting for the response, the endpoint applies them in
+ * order.  A full queue is drained until a command id frees up.
+ */
+static int stream_set_config(struct target *target, int id, int len,
+			     void *p)
+{
+	struct endpoint		*ep = &target->sc_iface.inb.ep;
+	u64			 deadline = monotonic_ms() + SET_CONFIG_TIMEOUT;
+	int			 ret;
+
+	while (!target->inb_status) {
+		ret = send_mi_send_async(ep, id, len, p, SET_CONFIG_TIMEOUT,
+					 set_config_done, target);
+		if (!ret)
+			target->inb_pending++;
+		if (ret != -EBUSY)
+			return ret;
+
+		if (monotonic_ms() >= deadline)
+			return -ETIMEDOUT;
+
+		ret = wait_cmds(ep, SET_CONFIG_TIMEOUT);
+		if (ret < 0)
+			return ret;
+	}
+
+	return target->inb_status;
+}
+
+static void start_set_config_stream(struct target *target)
+{
+	target->inb_stream = true;
+	target->inb_pending = 0;
+	target->inb_status = 0;
+}
+
+/* waits out the streamed commands, returns the first that failed */
+static int end_set_config_stream(struct target *target)
+{
+	struct endpoint		*ep = &target->sc_iface.inb.ep;
+
+	/* a queue that fails completes its commands with the error */
+	while (target->inb_pending)
+		if (wait_cmds(ep, SET_CONFIG_TIMEOUT) < 0)
+			break;
+
+	if (target->inb_pending && !target->inb_status)
+		target->inb_status = -ENOTCONN;
+
+	target->inb_stream = false;
+
+	return target->inb_status;
+}
+
 static int _send_set_config(struct ctrl_queue *ctrl, int id, int len, void *p)
 {
+	struct target		*target;
 	int			 ret;
 
+	target = container_of(ctrl, struct target, sc_iface.inb);
+	if (target->inb_stream)
+		return stream_set_config(target, id, len, p);
+
 	if (ctrl->connected) {
 		ret = send_mi_send(&ctrl->ep, id, len, p);
 		if (!ret)
 			return 0;
 
-		ctrl->connected = 0;
+		disconnect_ctrl(ctrl, 0);
 	}
 
 	ret = connect_ctrl(ctrl);
@@ -1419,7 +1335,7 @@ static inline int _update_host(struct subsystem *subsys, struct host *host,
 	_unlink_host(subsys, host);
 
 	strcpy(oldnqn, host->nqn);
-	strcpy(host->nqn, hostnqn);
+	rehash_subsys_host(host, hostnqn);
 
 	ret = _link_host(subsys, host);
 	if (ret)
@@ -1427,6 +1343,8 @@ static inline int _update_host(struct subsystem *subsys, struct host *host,
 
 	_update_subsys_dq(subsys, oldnqn, hostnqn);
 
+	notify_hosts();
+
 	return ret;
 }
 
@@ -1492,7 +1410,7 @@ int del_host(char *alias, char *resp)
 			list_for_each_entry(host, &subsys->host_list, node)
 				if (!strcmp(host->alias, alias)) {
 					_unlink_host(subsys, host);
-					list_del(&host->node);
+					del_subsys_host(host);
 					_reset_subsys_dq_nqn(subsys, host->nqn);
 					del_json_acl(target->alias, subsys->nqn,
 						     host->alias, dummy);
@@ -1509,6 +1427,8 @@ int del_host(char *alias, char *resp)
 			ret = 0;
 	}
 
+	notify_hosts();
+
 	return ret;
 }
 
@@ -1520,7 +1440,6 @@ int link_host(char *tgt, char *subnqn, char *alias, char *data, char *resp)
 	struct subsystem	*subsys;
 	struct portid		*portid;
 	struct host		*host;
-	struct linked_list	 list;
 	char			 newalias[MAX_ALIAS_SIZE + 1];
 	char			 hostnqn[MAX_NQN_SIZE + 1];
 	int			 ret;
@@ -1557,6 +1476,7 @@ found:
 
 	_reset_subsys_dq_nqn(subsys, host->nqn);
 
+	del_subsys_host(host);
 skip_unlink:
 	strcpy(host->alias, alias);
 	strcpy(host->nqn, hostnqn);
@@ -1569,14 +1489,13 @@ skip_unlink:
 		list_for_each_entry(portid, &target->portid_list, node)
 			_link_portid(subsys, portid);
 
-		list_add(&host->node, &subsys->host_list);
+		add_subsys_host(subsys, host);
 
 		_reset_subsys_dq(subsys, hostnqn);
 	} else
-		list_add_tail(&host->node, &subsys->host_list);
+		add_subsys_host(subsys, host);
 
-	create_event_host_list_for_host(&list, hostnqn);
-	send_notifications(&list);
+	notify_hosts();
 out:
 	return ret;
 }
@@ -1586,7 +1505,6 @@ int unlink_host(char *tgt, char *subnqn, char *alias, char *resp)
 	struct target		*target;
 	struct subsystem	*subsys;
 	struct host		*host;
-	struct linked_list	 list;
 	char			 hostnqn[MAX_NQN_SIZE + 1];
 	int			 ret;
 
@@ -1611,7 +1529,7 @@ found:
 	strcpy(hostnqn, host->nqn);
 
 	_unlink_host(subsys, host);
-	list_del(&host->node);
+	del_subsys_host(host);
 
 	_reset_subsys_dq_nqn(subsys, host->nqn);
 
@@ -1624,8 +1542,7 @@ found:
 	if (ret)
 		sprintf(resp, CONFIG_ALERT, target->alias);
 send_aen:
-	create_event_host_list_for_host(&list, hostnqn);
-	send_notifications(&list);
+	notify_hosts();
 out:
 	return 0;
 }
@@ -1797,7 +1714,6 @@ int del_subsys(char *alias, char *nqn, char *resp)
 {
 	struct subsystem	*subsys;
 	struct target		*target;
-	struct linked_list	 list;
 	int			 ret;
 
 	ret = del_json_subsys(alias, nqn, resp);
@@ -1816,8 +1732,7 @@ int del_subsys(char *alias, char *nqn, char *resp)
 	if (ret)
 		sprintf(resp, CONFIG_ALERT, target->alias);
 
-	create_event_host_list_for_subsys(&list, subsys);
-	send_notifications(&list);
+	notify_hosts();
 
 	_del_subsys_dq(subsys);
 
@@ -1901,7 +1816,7 @@ static inline int _config_subsys(struct target *target,
 
 	list_for_each_entry_safe(host, next_host, &subsys->host_list, node) {
 		_unlink_host(subsys, host);
-		list_del(&host->node);
+		del_subsys_host(host);
 	}
 
 	return ret;
@@ -1914,7 +1829,6 @@ int set_subsys(char *alias, char *nqn, char *data, char *resp)
 	struct subsystem	 new_ss;
 	struct portid		*portid;
 	struct host		*host;
-	struct linked_list	 list;
 	int			 len;
 	int			 ret;
 
@@ -1977,8 +1891,7 @@ int set_subsys(char *alias, char *nqn, char *data, char *resp)
 
 	target_refresh(alias);
 send_aen:
-	create_event_host_list_for_subsys(&list, subsys);
-	send_notifications(&list);
+	notify_hosts();
 out:
 	return ret;
 }
@@ -2039,7 +1952,6 @@ int del_portid(char *alias, int id, char *resp)
 	struct portid		*portid;
 	struct ctrl_queue	*dq, *next_dq;
 	struct logpage		*logpage, *next_log;
-	struct linked_list	 list;
 	int			 ret;
 
 	ret = del_json_portid(alias, id, resp);
@@ -2058,10 +1970,7 @@ int del_portid(char *alias, int id, char *resp)
 				 &target->discovery_queue_list, node) {
 		if (dq->portid != portid)
 			continue;
-		if (dq->connected)
-			disconnect_ctrl(dq, 0);
-		list_del(&dq->node);
-		free(dq);
+		free_dq(dq);
 	}
 
 	list_for_each_entry(subsys, &target->subsys_list, node)
@@ -2080,8 +1989,7 @@ int del_portid(char *alias, int id, char *resp)
 	list_del(&portid->node);
 	free(portid);
 
-	create_event_host_list_for_target(&list, target);
-	send_notifications(&list);
+	notify_hosts();
 out:
 	return ret;
 }
@@ -2119,8 +2027,7 @@ static void _del_portid_dq(struct target *target, struct portid *portid)
 		if (dq->portid != portid)
 			continue;
 
-		list_del(&dq->node);
-		free(dq);
+		free_dq(dq);
 
 		break;
 	}
@@ -2133,7 +2040,6 @@ int set_portid(char *alias, int id, char *data, char *resp)
 	struct portid		 _portid;
 	struct target		*target;
 	struct subsystem	*subsys;
-	struct linked_list	 list;
 
 	ret = set_json_portid(alias, id, data, resp, &_portid);
 	if (ret)
@@ -2197,8 +2103,7 @@ int set_portid(char *alias, int id, char *data, char *resp)
 
 	target_refresh(target->alias);
 send_aen:
-	create_event_host_list_for_target(&list, target);
-	send_notifications(&list);
+	notify_hosts();
 out:
 	return ret;
 }
@@ -2409,7 +2314,9 @@ static int get_oob_nsdevs(struct target *target)
 		goto out1;
 	}
 
+	pthread_mutex_lock(&json_lock);
 	ret = set_json_oob_nsdevs(target, data);
+	pthread_mutex_unlock(&json_lock);
 	if (ret)
 		print_err("send get nsdevs OOB failed for %s", alias);
 
@@ -2427,7 +2334,9 @@ static int get_oob_xports(struct target *target)
 	if (ret)
 		return ret;
 
+	pthread_mutex_lock(&json_lock);
 	ret = set_json_oob_interfaces(target, data);
+	pthread_mutex_unlock(&json_lock);
 
 	free(data);
 
@@ -2452,43 +2361,51 @@ static int config_target_inb(struct target *target)
 	struct subsystem	*subsys;
 	struct ns		*ns;
 	struct host		*host;
-	int			 ret;
+	int			 err;
+	int			 ret = 0;
 
 	if (!ctrl->connected) {
 		ret = connect_ctrl(ctrl);
 		if (ret) {
 			print_err("failed to connect to %s", target->alias);
 			print_errno("connect_ctrl failed",  ret);
-			goto out1;
+			return ret;
 		}
+
+		ctrl->connected = 1;
 	}
 
+	/* the whole config goes down the queue and is checked at the end
+	 * rather than waiting out a round trip per command
+	 */
+	start_set_config_stream(target);
+
 	list_for_each_entry(portid, &target->portid_list, node) {
 		ret = config_portid_inb(target, portid);
 		if (ret)
-			goto out2;
+			goto out;
 	}
 
 	list_for_each_entry(subsys, &target->subsys_list, node) {
 		ret = config_subsys_inb(target, subsys);
 		if (ret)
-			goto out2;
+			goto out;
 
 		if (is_restricted(subsys))
 			list_for_each_entry(host, &subsys->host_list, node) {
 				ret = send_host_config_inb(target, host);
 				if (ret)
-					goto out2;
+					goto out;
 
 				ret = send_link_host_inb(subsys, host);
 				if (ret)
-					goto out2;
+					goto out;
 			}
 
 		list_for_each_entry(ns, &subsys->ns_list, node) {
 			ret = send_set_ns_inb(subsys, ns);
 			if (ret)
-				goto out2;
+				goto out;
 		}
 
 		if (is_restricted(subsys) && list_empty(&subsys->host_list))
@@ -2497,18 +2414,24 @@ static int config_target_inb(struct target *target)
 		list_for_each_entry(portid, &target->portid_list, node) {
 			ret = send_link_portid_inb(subsys, portid);
 			if (ret)
-				goto out2;
+				goto out;
 		}
 	}
+out:
+	err = end_set_config_stream(target);
+	if (!ret)
+		ret = err;
+
+	if (ret) {
+		print_err("set config INB failed for %s", target->alias);
+		if (ctrl->failed_kato)
+			disconnect_ctrl(ctrl, 0);
+		return ret;
+	}
 
 	target_refresh(target->alias);
 
 	return 0;
-out2:
-	if (ctrl->failed_kato)
-		disconnect_ctrl(ctrl, 0);
-out1:
-	return ret;
 }
 
 static int config_target_oob(struct target *target)
@@ -2565,7 +2488,7 @@ static int _send_reset_config(struct ctrl_queue *ctrl)
 		if (!ret)
 			return 0;
 
-		ctrl->connected = 0;
+		disconnect_ctrl(ctrl, 0);
 	}
 
 	ret = connect_ctrl(ctrl);
@@ -2621,7 +2544,6 @@ int del_target(char *alias, char *resp)
 	struct subsystem	*subsys;
 	struct portid		*portid;
 	struct host		*host;
-	struct linked_list	 list;
 
 	int			 ret;
 
@@ -2645,8 +2567,9 @@ int del_target(char *alias, char *resp)
 
 	list_del(&target->node);
 
-	create_event_host_list_for_target(&list, target);
-	send_notifications(&list);
+	notify_hosts();
+
+	disarm_target_timers(target);
 
 	free(target);
 out:
@@ -2746,7 +2669,6 @@ int update_target(char *alias, char *data, char *resp)
 	struct target		 result;
 	struct target		*target;
 	struct portid		 portid;
-	struct linked_list	 list;
 	int			 ret;
 
 	memset(&result, 0, sizeof(result));
@@ -2774,6 +2696,8 @@ int update_target(char *alias, char *data, char *resp)
 	target->mgmt_mode = result.mgmt_mode;
 	target->refresh	  = result.refresh;
 
+	arm_target_timers(target);
+
 	if (target->mgmt_mode == OUT_OF_BAND_MGMT) {
 		set_oob_interface(&target->sc_iface, &result.sc_iface);
 		ret = get_oob_config(target);
@@ -2788,8 +2712,7 @@ int update_target(char *alias, char *data, char *resp)
 	else
 		sprintf(resp, CONFIG_ALERT, target->alias);
 
-	create_event_host_list_for_target(&list, target);
-	send_notifications(&list);
+	notify_hosts();
 
 	return ret;
 }
@@ -48,11 +48,20 @@
 
 /* needs to be < NVMF_DISC_KATO in connect AND < 2 MIN for upstream target */
 #define KEEP_ALIVE_TIMER	120000 /* ms */
+#define KEEP_ALIVE_WAIT		100 /* ms */
+
+#define DEFAULT_STARTUP_WORKERS	16
+#define MAX_STARTUP_WORKERS	256
+
+#define RECONNECT_WORKERS	4
+#define RECONNECT_MIN_DELAY	1000 /* ms */
+#define RECONNECT_MAX_DELAY	300000 /* ms */
+#define CIRCUIT_BREAK_FAILURES	5
+#define RECOVERY_WINDOW		RECONNECT_MAX_DELAY /* ms */
 
 static LINKED_LIST(target_linked_list);
 static LINKED_LIST(group_linked_list);
 static LINKED_LIST(host_linked_list);
-static LINKED_LIST(aen_linked_list);
 
 static struct mg_serve_http_opts	 s_http_server_opts;
 static char				*s_http_port = DEFAULT_HTTP_PORT;
@@ -64,9 +73,13 @@ int					 num_interfaces;
 struct linked_list			*target_list = &target_linked_list;
 struct linked_list			*group_list = &group_linked_list;
 struct linked_list			*host_list = &host_linked_list;
-struct linked_list			*aen_req_list = &aen_linked_list;
 static pthread_t			*listen_threads;
 static int				 signalled;
+static struct timer_wheel		 target_timers;
+static struct timer			 aen_timer;
+static int				 aen_delay = DEFAULT_AEN_DELAY;
+static int				 startup_workers = DEFAULT_STARTUP_WORKERS;
+static bool				 starting;
 
 char shared_nqn[MAX_NQN_SIZE + 1];
 
@@ -100,80 +113,669 @@ static void ev_handler(struct mg_connection *c, int ev, void *ev_data)
 	}
 }
 
-static int keep_alive_work(struct target *target)
+/* per target keep alive and log page refresh run off a timer wheel so
+ * the poll loop only does work for the targets whose timers fire
+ */
+
+/* a target that stops answering is probed again from a few threads so the
+ * poll loop never waits on a connect that will not complete.  The delay
+ * between probes doubles on every failure, with jitter so targets that
+ * dropped together do not come back in lock step, and after
+ * CIRCUIT_BREAK_FAILURES failures the target is marked unreachable and
+ * its log pages are withdrawn until a probe succeeds.  A probe connects
+ * every queue of the target that is down, and the poll loop only takes
+ * over the queues that came up.  Failures keep counting across a
+ * recovery shorter than RECOVERY_WINDOW so a flapping target still trips.
+ */
+
+enum { PROBE_QUEUED = 0, PROBE_RUNNING, PROBE_DONE };
+
+struct probe_queue {
+	struct ctrl_queue	*dq;		/* the target's, loop only */
+	struct portid		 portid;
+	struct ctrl_queue	 ctrl;
+};
+
+struct reconnect_probe {
+	struct linked_list	 node;
+	struct target		*target;	/* NULL once the target is gone */
+	int			 state;
+	int			 status;
+	int			 cnt;
+	struct probe_queue	 queue[];
+};
+
+static LINKED_LIST(probe_list);
+static pthread_mutex_t		 probe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		 probe_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t		 probe_threads[RECONNECT_WORKERS];
+static int			 probe_workers;
+static bool			 probe_exit;
+
+/* stops at the first queue that fails, the rest are on the same target */
+static void run_probe(struct reconnect_probe *probe)
+{
+	struct probe_queue	*q;
+	int			 i;
+
+	for (i = 0; i < probe->cnt; i++) {
+		q = &probe->queue[i];
+
+		probe->status = connect_ctrl(&q->ctrl);
+		if (probe->status)
+			break;
+
+		q->ctrl.connected = 1;
+	}
+}
+
+static struct ctrl_queue *probed_queue(struct target *target,
+				       struct probe_queue *q)
 {
 	struct ctrl_queue	*dq;
-	struct ctrl_queue	*ctrl;
-	int			 ret;
 
-	if (--target->kato_countdown > 0)
-		return 0;
+	if (q->dq == &target->sc_iface.inb) {
+		if (target->mgmt_mode != IN_BAND_MGMT)
+			return NULL;
+		dq = q->dq;
+		goto found;
+	}
 
-	list_for_each_entry(dq, &target->discovery_queue_list, node) {
-		if (!dq->connected || dq->failed_kato)
+	list_for_each_entry(dq, &target->discovery_queue_list, node)
+		if (dq == q->dq)
+			goto found;
+
+	return NULL;
+found:
+	/* the queue may have been reconfigured while it was probed */
+	if (dq->connected || !dq->portid ||
+	    strcmp(dq->portid->type, q->portid.type) ||
+	    strcmp(dq->portid->family, q->portid.family) ||
+	    strcmp(dq->portid->address, q->portid.address) ||
+	    dq->portid->port_num != q->portid.port_num ||
+	    strcmp(dq->hostnqn, q->ctrl.hostnqn))
+		return NULL;
+
+	return dq;
+}
+
+/* hands the queues a probe connected to the target, or closes them if
+ * the target or the queue is gone
+ */
+static void adopt_queues(struct reconnect_probe *probe)
+{
+	struct probe_queue	*q;
+	struct ctrl_queue	*dq;
+	int			 i;
+
+	for (i = 0; i < probe->cnt; i++) {
+		q = &probe->queue[i];
+		if (!q->ctrl.connected)
+			continue;
+
+		dq = probe->target ? probed_queue(probe->target, q) : NULL;
+		if (!dq) {
+			disconnect_ctrl(&q->ctrl, 0);
 			continue;
+		}
 
-		ret = send_keep_alive(&dq->ep);
-		if (ret) {
-			print_err("keep alive failed %s", target->alias);
-			disconnect_ctrl(dq, 0);
-			target->log_page_retry_count = LOG_PAGE_RETRY;
+		/* nothing is in flight on a queue just connected */
+		dq->ep = q->ctrl.ep;
+		dq->kato_pending = 0;
+		dq->kato_status = 0;
+		dq->failed_kato = q->ctrl.failed_kato;
+		dq->have_genctr = 0;
+		dq->connected = 1;
+	}
+}
 
-			return ret;
+static struct reconnect_probe *next_probe(void)
+{
+	struct reconnect_probe	*probe;
+
+	list_for_each_entry(probe, &probe_list, node)
+		if (probe->state == PROBE_QUEUED)
+			return probe;
+
+	return NULL;
+}
+
+static void *probe_thread(void *arg)
+{
+	struct reconnect_probe	*probe;
+
+	UNUSED(arg);
+
+	pthread_mutex_lock(&probe_lock);
+
+	while (!probe_exit) {
+		probe = next_probe();
+		if (!probe) {
+			pthread_cond_wait(&probe_cond, &probe_lock);
+			continue;
 		}
+
+		probe->state = PROBE_RUNNING;
+		pthread_mutex_unlock(&probe_lock);
+
+		run_probe(probe);
+
+		pthread_mutex_lock(&probe_lock);
+		probe->state = PROBE_DONE;
+	}
+
+	pthread_mutex_unlock(&probe_lock);
+
+	return NULL;
+}
+
+static void start_probe_threads(void)
+{
+	int			 i;
+
+	for (i = 0; i < RECONNECT_WORKERS; i++)
+		if (!pthread_create(&probe_threads[probe_workers], NULL,
+				    probe_thread, NULL))
+			probe_workers++;
+}
+
+static void stop_probe_threads(void)
+{
+	struct reconnect_probe	*probe, *next;
+	int			 i;
+
+	pthread_mutex_lock(&probe_lock);
+	probe_exit = true;
+	pthread_cond_broadcast(&probe_cond);
+	pthread_mutex_unlock(&probe_lock);
+
+	for (i = 0; i < probe_workers; i++)
+		pthread_join(probe_threads[i], NULL);
+
+	list_for_each_entry_safe(probe, next, &probe_list, node) {
+		list_del(&probe->node);
+		probe->target = NULL;
+		adopt_queues(probe);
+		free(probe);
 	}
+}
+
+static void schedule_reconnect(struct target *target)
+{
+	int			 delay = RECONNECT_MAX_DELAY;
+	int			 shift = target->failures - 1;
+
+	/* an open circuit is only probed at the slowest rate */
+	if (target->health != TARGET_UNREACHABLE && shift < 16)
+		delay = min(RECONNECT_MIN_DELAY << shift, RECONNECT_MAX_DELAY);
+
+	delay = delay / 2 + rand() % (delay / 2 + 1);
+
+	target->next_attempt = monotonic_ms() + delay;
+
+	mod_timer(&target_timers, &target->reconnect_timer, delay);
+}
+
+static void count_failure(struct target *target)
+{
+	target->failures++;
+
+	if (target->failures < CIRCUIT_BREAK_FAILURES ||
+	    target->health == TARGET_UNREACHABLE)
+		return;
+
+	print_err("%s unreachable", target->alias);
+
+	target->health = TARGET_UNREACHABLE;
+
+	/* withdraw the records of the queues that are down */
+	mod_timer(&target_timers, &target->refresh_timer, IDLE_TIMEOUT);
+}
 
-	if (target->mgmt_mode == IN_BAND_MGMT) {
-		ctrl = &target->sc_iface.inb;
-		if (!ctrl->connected) {
-			ret = connect_ctrl(ctrl);
-			if (!ret)
-				ctrl->connected = 1;
-		} else {
-			ret = send_keep_alive(&ctrl->ep);
-			if (ret)
-				ctrl->connected = 0;
+void target_unreachable(struct target *target)
+{
+	/* timers are only touched from the poll loop, see init_targets */
+	if (starting) {
+		target->reconnect = true;
+		return;
+	}
+
+	if (target->health != TARGET_HEALTHY)
+		return;
+
+	print_err("lost connection to %s", target->alias);
+
+	target->health = TARGET_RECONNECTING;
+
+	if (monotonic_ms() - target->recovered_at > RECOVERY_WINDOW)
+		target->failures = 0;
+
+	count_failure(target);
+
+	schedule_reconnect(target);
+}
+
+static void reconnect_done(struct target *target, int status)
+{
+	if (!status) {
+		print_info("reconnected to %s", target->alias);
+
+		target->health = TARGET_HEALTHY;
+		target->next_attempt = 0;
+		target->recovered_at = monotonic_ms();
+
+		/* the queues are up, the next refresh reads their logs */
+		mod_timer(&target_timers, &target->refresh_timer,
+			  IDLE_TIMEOUT);
+		return;
+	}
+
+	count_failure(target);
+
+	schedule_reconnect(target);
+}
+
+static void probe_done(struct target *target, int status)
+{
+	/* queues of a healthy target that went down between refreshes, such
+	 * as those of a controller that refused a keep alive timeout
+	 */
+	if (target->health == TARGET_HEALTHY) {
+		if (status)
+			target_unreachable(target);
+		else
+			mod_timer(&target_timers, &target->refresh_timer,
+				  IDLE_TIMEOUT);
+		return;
+	}
+
+	reconnect_done(target, status);
+}
+
+/* fills queue, when given, with the queues of the target that are down */
+static int probe_queues(struct target *target, struct probe_queue *queue)
+{
+	struct ctrl_queue	*dq;
+	struct ctrl_queue	*inb = &target->sc_iface.inb;
+	int			 cnt = 0;
+
+	if (target->mgmt_mode == IN_BAND_MGMT && !inb->connected &&
+	    inb->portid) {
+		if (queue)
+			queue[cnt].dq = inb;
+		cnt++;
+	}
+
+	list_for_each_entry(dq, &target->discovery_queue_list, node)
+		if (!dq->connected) {
+			if (queue)
+				queue[cnt].dq = dq;
+			cnt++;
+		}
+
+	return cnt;
+}
+
+static void start_probe(struct target *target)
+{
+	struct reconnect_probe	*probe;
+	struct probe_queue	*q;
+	int			 cnt;
+	int			 i;
+
+	cnt = probe_queues(target, NULL);
+	if (!cnt) {
+		probe_done(target, 0);
+		return;
+	}
+
+	probe = calloc(1, sizeof(*probe) + cnt * sizeof(*q));
+	if (!probe) {
+		print_err("failed to malloc reconnect probe");
+		if (target->health != TARGET_HEALTHY)
+			schedule_reconnect(target);
+		return;
+	}
+
+	probe->target = target;
+	probe->cnt = probe_queues(target, probe->queue);
+
+	for (i = 0; i < probe->cnt; i++) {
+		q = &probe->queue[i];
+
+		q->portid = *q->dq->portid;
+		q->ctrl.portid = &q->portid;
+		q->ctrl.failed_kato = q->dq->failed_kato;
+		strcpy(q->ctrl.hostnqn, q->dq->hostnqn);
+
+		q->ctrl.ep.ops = register_ops(q->portid.type);
+		if (!q->ctrl.ep.ops) {
+			free(probe);
+			probe_done(target, -EINVAL);
+			return;
 		}
 	}
 
-	target->kato_countdown = KEEP_ALIVE_TIMER / IDLE_TIMEOUT / 2;
+	/* without threads the probe is made here */
+	if (!probe_workers) {
+		run_probe(probe);
+		adopt_queues(probe);
+		probe_done(target, probe->status);
+		free(probe);
+		return;
+	}
+
+	target->probing = true;
 
-	return 0;
+	pthread_mutex_lock(&probe_lock);
+	list_add_tail(&probe->node, &probe_list);
+	pthread_cond_signal(&probe_cond);
+	pthread_mutex_unlock(&probe_lock);
 }
 
-static void periodic_work(void)
+static void reconnect_timer_expired(struct timer *timer)
 {
 	struct target		*target;
 
-	list_for_each_entry(target, target_list, node) {
-		if (keep_alive_work(target))
-			continue;
+	target = container_of(timer, struct target, reconnect_timer);
+
+	if (!target->probing)
+		start_probe(target);
+}
 
-		if (target->log_page_retry_count)
-			if (--target->log_page_retry_count)
-				continue;
+/* the queues of a healthy target that are down are connected by the
+ * probes too, a refresh only reads the queues already up
+ */
+void connect_target_queues(struct target *target)
+{
+	/* startup connects every queue itself */
+	if (starting || target->probing || target->health != TARGET_HEALTHY)
+		return;
 
-		target->refresh_countdown--;
-		if (target->refresh_countdown)
-			continue;
+	start_probe(target);
+}
+
+static void reap_probes(void)
+{
+	struct reconnect_probe	*probe, *next;
+	LINKED_LIST(done);
+
+	pthread_mutex_lock(&probe_lock);
+	list_for_each_entry_safe(probe, next, &probe_list, node)
+		if (probe->state == PROBE_DONE) {
+			list_del(&probe->node);
+			list_add_tail(&probe->node, &done);
+		}
+	pthread_mutex_unlock(&probe_lock);
+
+	list_for_each_entry_safe(probe, next, &done, node) {
+		list_del(&probe->node);
+
+		adopt_queues(probe);
+
+		if (probe->target) {
+			probe->target->probing = false;
+			probe_done(probe->target, probe->status);
+		}
+
+		free(probe);
+	}
+}
+
+static void forget_probes(struct target *target)
+{
+	struct reconnect_probe	*probe;
+
+	if (!target->probing)
+		return;
+
+	pthread_mutex_lock(&probe_lock);
+	list_for_each_entry(probe, &probe_list, node)
+		if (probe->target == target)
+			probe->target = NULL;
+	pthread_mutex_unlock(&probe_lock);
+
+	target->probing = false;
+}
+
+int target_health(char *alias, char **results)
+{
+	struct target		*target;
+	const char		*health;
+	u64			 now, wait = 0;
+
+	target = find_target(alias);
+	if (!target)
+		return -ENOENT;
+
+	if (target->health == TARGET_RECONNECTING)
+		health = TAG_RECONNECTING;
+	else if (target->health == TARGET_UNREACHABLE)
+		health = TAG_UNREACHABLE;
+	else
+		health = TAG_HEALTHY;
 
-		if (target->mgmt_mode != LOCAL_MGMT)
-			get_config(target);
+	now = monotonic_ms();
+	if (target->health != TARGET_HEALTHY && target->next_attempt > now)
+		wait = target->next_attempt - now;
 
-		refresh_log_pages(target);
+	sprintf(*results, "{\"%s\":\"%s\",\"%s\":%d,\"%s\":%llu}",
+		TAG_HEALTH, health, TAG_FAILURES, target->failures,
+		TAG_NEXT_ATTEMPT, (unsigned long long) wait);
+
+	return 0;
+}
+
+static void keep_alive_done(struct endpoint *ep, struct cmd_ctx *ctx,
+			    int status)
+{
+	struct ctrl_queue	*dq = ctx->arg;
+
+	UNUSED(ep);
+
+	dq->kato_pending = 0;
+	dq->kato_status = status;
+}
 
-		target->refresh_countdown =
-			target->refresh * MINUTES / IDLE_TIMEOUT;
+static inline struct ctrl_queue *inb_ctrl(struct target *target)
+{
+	if (target->mgmt_mode != IN_BAND_MGMT || !target->sc_iface.inb.portid)
+		return NULL;
+
+	return &target->sc_iface.inb;
+}
+
+static int send_queue_keep_alive(struct target *target, struct ctrl_queue *dq)
+{
+	int			 ret;
+
+	if (!dq->connected || dq->failed_kato || dq->kato_pending)
+		return 0;
+
+	ret = send_keep_alive_async(&dq->ep, KEEP_ALIVE_WAIT, keep_alive_done,
+				    dq);
+	if (ret) {
+		print_err("keep alive failed %s", target->alias);
+		disconnect_ctrl(dq, 0);
+		target_unreachable(target);
+		return 0;
 	}
+
+	dq->kato_pending = 1;
+
+	return 1;
+}
+
+/* keep alives go out on every queue of the target at once and are
+ * collected KEEP_ALIVE_WAIT ms later, so a target that does not answer
+ * never holds up the poll loop
+ */
+static int send_keep_alives(struct target *target)
+{
+	struct ctrl_queue	*dq;
+	int			 cnt = 0;
+
+	list_for_each_entry(dq, &target->discovery_queue_list, node)
+		cnt += send_queue_keep_alive(target, dq);
+
+	dq = inb_ctrl(target);
+	if (dq)
+		cnt += send_queue_keep_alive(target, dq);
+
+	return cnt;
+}
+
+static int check_keep_alive(struct target *target, struct ctrl_queue *dq)
+{
+	int			 ret;
+
+	if (!dq->connected)
+		return 0;
+
+	/* runs the callback, expiring a keep alive still unanswered */
+	poll_cmds(&dq->ep);
+
+	ret = dq->kato_status;
+	dq->kato_status = 0;
+
+	if (ret) {
+		print_err("keep alive failed %s", target->alias);
+		disconnect_ctrl(dq, 0);
+		target_unreachable(target);
+	}
+
+	return ret;
+}
+
+static int keep_alive_work(struct target *target)
+{
+	struct ctrl_queue	*dq;
+	int			 ret;
+
+	list_for_each_entry(dq, &target->discovery_queue_list, node) {
+		ret = check_keep_alive(target, dq);
+		if (ret)
+			return ret;
+	}
+
+	dq = inb_ctrl(target);
+	if (!dq)
+		return 0;
+
+	/* the in-band ctrl is brought back by the probes like the rest */
+	if (!dq->connected) {
+		connect_target_queues(target);
+		return 0;
+	}
+
+	return check_keep_alive(target, dq);
+}
+
+static void kato_timer_expired(struct timer *timer)
+{
+	struct target		*target;
+	struct ctrl_queue	*dq;
+	int			 ms = KEEP_ALIVE_TIMER / 2;
+
+	target = container_of(timer, struct target, kato_timer);
+
+	if (!target->kato_sent && send_keep_alives(target)) {
+		target->kato_sent = true;
+		ms = KEEP_ALIVE_WAIT + IDLE_TIMEOUT;
+		goto out;
+	}
+
+	target->kato_sent = false;
+
+	list_for_each_entry(dq, &target->discovery_queue_list, node)
+		if (dq->connected)
+			trim_ep_bufs(&dq->ep, EP_BUF_IDLE);
+
+	/* a failed keep alive is retried on the next tick */
+	if (keep_alive_work(target))
+		ms = IDLE_TIMEOUT;
+out:
+	add_timer(&target_timers, timer, ms);
+}
+
+static void refresh_timer_expired(struct timer *timer)
+{
+	struct target		*target;
+
+	target = container_of(timer, struct target, refresh_timer);
+
+	if (target->mgmt_mode != LOCAL_MGMT &&
+	    target->health == TARGET_HEALTHY)
+		get_config(target);
+
+	poll_log_pages(target);
+
+	/* a reconnect may have already scheduled the next refresh */
+	if (target->refresh && !timer_pending(timer))
+		add_timer(&target_timers, timer, target->refresh * MINUTES);
+}
+
+void init_target_timers(struct target *target)
+{
+	init_timer(&target->kato_timer, kato_timer_expired);
+	init_timer(&target->refresh_timer, refresh_timer_expired);
+	init_timer(&target->reconnect_timer, reconnect_timer_expired);
+}
+
+void arm_target_timers(struct target *target)
+{
+	mod_timer(&target_timers, &target->kato_timer, KEEP_ALIVE_TIMER / 2);
+
+	if (target->refresh)
+		mod_timer(&target_timers, &target->refresh_timer,
+			  target->refresh * MINUTES);
+	else
+		del_timer(&target_timers, &target->refresh_timer);
+}
+
+void disarm_target_timers(struct target *target)
+{
+	del_timer(&target_timers, &target->kato_timer);
+	del_timer(&target_timers, &target->refresh_timer);
+	del_timer(&target_timers, &target->reconnect_timer);
+
+	forget_probes(target);
+}
+
+/* config and log page changes are batched for aen_delay ms so a burst of
+ * changes produces at most one log page change notice per host
+ */
+void notify_hosts(void)
+{
+	invalidate_discovery_logs();
+
+	if (!starting)
+		add_timer(&target_timers, &aen_timer, aen_delay);
+}
+
+static void aen_timer_expired(struct timer *timer)
+{
+	UNUSED(timer);
+
+	send_notifications();
 }
 
 static void *poll_loop(struct mg_mgr *mgr)
 {
+	int			 timeout;
+
 	while (!stopped) {
-		mg_mgr_poll(mgr, IDLE_TIMEOUT);
+		timeout = next_timer(&target_timers);
+		if (timeout < 0 || timeout > IDLE_TIMEOUT)
+			timeout = IDLE_TIMEOUT;
+
+		mg_mgr_poll(mgr, timeout);
+
+		if (stopped)
+			break;
 
-		if (!stopped)
-			periodic_work();
+		reap_probes();
+		run_timers(&target_timers);
 	}
 
 	mg_mgr_free(mgr);
@@ -221,8 +823,8 @@ static void show_help(char *app)
 	const char		*arg_list = "{-d} {-s}";
 #endif
 
-	print_info("Usage: %s %s {-p <port>} {-r <root>} {-c <cert_file>}",
-		   app, arg_list);
+	print_info("Usage: %s %s {-p <port>} {-r <root>} {-c <cert_file>} "
+		   "{-n <msec>} {-j <threads>}", app, arg_list);
 #ifdef CONFIG_DEBUG
 	print_info("  -q - quiet mode, no debug prints");
 	print_info("  -d - run as a daemon process (default is standalone)");
@@ -235,6 +837,10 @@ static void show_help(char *app)
 	print_info("  -r - HTTP interface: root (default %s)",
 		   DEFAULT_HTTP_ROOT);
 	print_info("  -c - HTTP interface: SSL cert file (default no SSL)");
+	print_info("  -n - delay for batching change notices to hosts "
+		   "(default %d ms)", DEFAULT_AEN_DELAY);
+	print_info("  -j - threads connecting to targets at startup "
+		   "(default %d)", DEFAULT_STARTUP_WORKERS);
 }
 
 static int init_dem(int argc, char *argv[], char **ssl_cert)
@@ -242,9 +848,9 @@ static int init_dem(int argc, char *argv[], char **ssl_cert)
 	int			 opt;
 	int			 run_as_daemon;
 #ifdef CONFIG_DEBUG
-	const char		*opt_list = "?qdp:r:c:";
+	const char		*opt_list = "?qdp:r:c:n:j:";
 #else
-	const char		*opt_list = "?dsp:r:c:";
+	const char		*opt_list = "?dsp:r:c:n:j:";
 #endif
 
 	curl_show_results = 0;
@@ -294,6 +900,18 @@ static int init_dem(int argc, char *argv[], char **ssl_cert)
 		case 'c':
 			*ssl_cert = optarg;
 			break;
+		case 'n':
+			aen_delay = atoi(optarg);
+			if (aen_delay < 0)
+				aen_delay = 0;
+			break;
+		case 'j':
+			startup_workers = atoi(optarg);
+			if (startup_workers < 1)
+				startup_workers = 1;
+			else if (startup_workers > MAX_STARTUP_WORKERS)
+				startup_workers = MAX_STARTUP_WORKERS;
+			break;
 		case '?':
 		default:
 help:
@@ -349,6 +967,11 @@ static void cleanup_threads(pthread_t *listen_threads)
 {
 	int			i;
 
+	/* wake listeners blocked waiting for a connection */
+	for (i = 0; i < num_interfaces; i++)
+		if (interfaces[i].ops && interfaces[i].listener)
+			interfaces[i].ops->stop_listener(interfaces[i].listener);
+
 	for (i = 0; i < num_interfaces; i++)
 		pthread_kill(listen_threads[i], SIGTERM);
 
@@ -405,16 +1028,14 @@ static int dq_exists(struct target *target, struct subsystem *subsys,
 	       struct portid *portid)
 {
 	struct ctrl_queue	*dq;
-	struct host		*host;
 
 	list_for_each_entry(dq, &target->discovery_queue_list, node) {
 		if (!dq->subsys)
 			continue;
 		if (dq->portid == portid)
 			continue;
-		list_for_each_entry(host, &subsys->host_list, node)
-			if (!strcmp(host->nqn, dq->hostnqn))
-				return 1;
+		if (find_subsys_host(subsys, dq->hostnqn))
+			return 1;
 	}
 
 	return 0;
@@ -458,8 +1079,18 @@ void create_discovery_queue(struct target *target, struct subsystem *subsys,
 		strncpy(dq->hostnqn, host->nqn, MAX_NQN_SIZE);
 	}
 
-	if (connect_ctrl(dq))
+	/* past startup the queue is connected by the probes */
+	if (!starting) {
+		connect_target_queues(target);
 		return;
+	}
+
+	if (connect_ctrl(dq)) {
+		target_unreachable(target);
+		return;
+	}
+
+	dq->connected = 1;
 
 	fetch_log_pages(dq);
 
@@ -477,25 +1108,111 @@ static void init_discovery_queue(struct target *target, struct portid *portid)
 		create_discovery_queue(target, subsys, portid);
 }
 
+/* targets are brought up by a pool of threads so startup takes as long as
+ * the slowest target rather than all of them in turn.  Each thread has its
+ * own curl handle and only takes the json lock to record what a target
+ * reported, connects and config streams only touch the target itself.
+ * Timers and change notices wait until every thread is done.
+ */
+struct target_cursor {
+	pthread_mutex_t		 lock;
+	struct linked_list	*next;
+};
+
+static void init_target(struct target *target)
+{
+	struct portid		*portid;
+
+	if (target->mgmt_mode != LOCAL_MGMT && !get_config(target))
+		config_target(target);
+
+	list_for_each_entry(portid, &target->portid_list, node)
+		init_discovery_queue(target, portid);
+}
+
+static void init_next_targets(struct target_cursor *cursor)
+{
+	struct target		*target;
+
+	while (!stopped) {
+		pthread_mutex_lock(&cursor->lock);
+
+		target = NULL;
+		if (cursor->next != target_list) {
+			target = list_entry(cursor->next, struct target, node);
+			cursor->next = cursor->next->next;
+		}
+
+		pthread_mutex_unlock(&cursor->lock);
+
+		if (!target)
+			break;
+
+		init_target(target);
+	}
+}
+
+static void *init_target_thread(void *arg)
+{
+	/* a thread that cannot set up curl leaves the targets to the rest */
+	if (init_curl_thread())
+		return NULL;
+
+	init_next_targets(arg);
+
+	cleanup_curl_thread();
+
+	return NULL;
+}
+
 static void init_targets(void)
 {
+	struct target_cursor	 cursor;
 	struct target		*target;
-	struct portid		*portid;
+	pthread_t		*threads;
+	int			 count = 0;
+	int			 started = 0;
+	int			 i;
 
-	list_for_each_entry(target, target_list, node) {
-		target->refresh_countdown =
-			target->refresh * MINUTES / IDLE_TIMEOUT;
+	list_for_each_entry(target, target_list, node)
+		count++;
+
+	if (count > startup_workers)
+		count = startup_workers;
+
+	pthread_mutex_init(&cursor.lock, NULL);
+	cursor.next = target_list->next;
+
+	starting = true;
 
-		target->log_page_retry_count = LOG_PAGE_RETRY;
+	threads = calloc(count, sizeof(*threads));
+	if (threads)
+		for (i = 0; i < count; i++)
+			if (!pthread_create(&threads[started], NULL,
+					    init_target_thread, &cursor))
+				started++;
 
-		if (target->mgmt_mode != LOCAL_MGMT)
-			if (!get_config(target))
-				config_target(target);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
 
-		list_for_each_entry(portid, &target->portid_list, node) {
-			init_discovery_queue(target, portid);
+	/* whatever no thread took is brought up one by one here */
+	init_next_targets(&cursor);
+
+	free(threads);
+	pthread_mutex_destroy(&cursor.lock);
+
+	starting = false;
+
+	list_for_each_entry(target, target_list, node) {
+		arm_target_timers(target);
+
+		if (target->reconnect) {
+			target->reconnect = false;
+			target_unreachable(target);
 		}
 	}
+
+	notify_hosts();
 }
 
 static void cleanup_target_list(void)
@@ -530,12 +1247,14 @@ static void cleanup_target_list(void)
 			if (dq->connected)
 				disconnect_ctrl(dq, 1);
 
-			free(dq);
+			free_dq(dq);
 		}
 
 		if (target->mgmt_mode == IN_BAND_MGMT)
 			free(target->sc_iface.inb.portid);
 
+		disarm_target_timers(target);
+
 		free(target);
 	}
 }
@@ -565,6 +1284,7 @@ static void cleanup_lists(void)
 	cleanup_host_list();
 	cleanup_group_list();
 	cleanup_target_list();
+	free_discovery_logs();
 }
 
 static void set_signature(void)
@@ -625,6 +1345,9 @@ int main(int argc, char *argv[])
 
 	init_shared_nqn();
 
+	init_timer_wheel(&target_timers, IDLE_TIMEOUT);
+	init_timer(&aen_timer, aen_timer_expired);
+
 	if (init_dem(argc, argv, &ssl_cert))
 		goto out;
 
@@ -655,8 +1378,12 @@ int main(int argc, char *argv[])
 	if (init_interface_threads(&listen_threads))
 		goto out3;
 
+	start_probe_threads();
+
 	poll_loop(&mgr);
 
+	stop_probe_threads();
+
 	cleanup_threads(listen_threads);
 
 	if (signalled)
@@ -108,11 +108,10 @@ static void check_host(struct subsystem *subsys, json_t *acl,
 
 			memset(host, 0, sizeof(*host));
 
-			host->subsystem = subsys;
 			strcpy(host->nqn, nqn);
 			strcpy(host->alias, alias);
 
-			list_add_tail(&host->node, &subsys->host_list);
+			add_subsys_host(subsys, host);
 		}
 	}
 }
@@ -189,6 +188,7 @@ static void check_hosts(struct subsystem *subsys, json_t *acl, json_t *hosts)
 struct subsystem *new_subsys(struct target *target, char *nqn)
 {
 	struct subsystem	*subsys;
+	int			 i;
 
 	subsys = malloc(sizeof(*subsys));
 	if (!subsys)
@@ -202,6 +202,9 @@ struct subsystem *new_subsys(struct target *target, char *nqn)
 	INIT_LINKED_LIST(&subsys->ns_list);
 	INIT_LINKED_LIST(&subsys->logpage_list);
 
+	for (i = 0; i < HOST_HASH_SIZE; i++)
+		INIT_LINKED_LIST(&subsys->host_hash[i]);
+
 	list_add_tail(&subsys->node, &target->subsys_list);
 
 	return subsys;
@@ -329,6 +332,8 @@ struct target *alloc_target(char *alias)
 	INIT_LINKED_LIST(&target->discovery_queue_list);
 	INIT_LINKED_LIST(&target->unattached_logpage_list);
 
+	init_target_timers(target);
+
 	list_add_tail(&target->node, target_list);
 
 	strncpy(target->alias, alias, MAX_ALIAS_SIZE);
@@ -625,6 +630,8 @@ static void read_dem_config(FILE *fid, struct host_iface *iface)
 		strncpy(iface->address, val, CONFIG_ADDRESS_SIZE);
 	else if (strcasecmp(tag, TAG_TRSVCID) == 0)
 		strncpy(iface->port, val, CONFIG_PORT_SIZE);
+	else if (strcasecmp(tag, TAG_WORKERS) == 0)
+		iface->workers = atoi(val);
 }
 
 static void translate_addr_to_array(struct host_iface *iface)
@@ -644,6 +651,14 @@ static void translate_addr_to_array(struct host_iface *iface)
 		sprintf(iface->port, "%d", NVME_RDMA_IP_PORT);
 }
 
+static void check_host_workers(struct host_iface *iface)
+{
+	if (iface->workers <= 0)
+		iface->workers = DEFAULT_HOST_WORKERS;
+	else if (iface->workers > MAX_HOST_WORKERS)
+		iface->workers = MAX_HOST_WORKERS;
+}
+
 static int read_dem_config_files(struct host_iface *iface)
 {
 	struct dirent		*entry;
@@ -684,6 +699,7 @@ static int read_dem_config_files(struct host_iface *iface)
 					  "ignoring interface", entry->d_name);
 			else {
 				translate_addr_to_array(&iface[count]);
+				check_host_workers(&iface[count]);
 				count++;
 			}
 		} else
@@ -37,11 +37,49 @@
 #include <string.h>
 #include <errno.h>
 #include <dirent.h>
+#include <endian.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
 
 #include "common.h"
 
+/* each host NQN that reads the discovery log gets a fully built copy of it.
+ * Config and log page changes only bump disc_log_gen; a stale copy is
+ * rebuilt the next time its host asks for it, so servicing a get log page
+ * is a memcpy of the cached log.
+ *
+ * genctr is per host and only advances when a rebuild actually changes the
+ * records that host sees, so a host can read the header alone and skip the
+ * full transfer when genctr is unchanged.
+ *
+ * At most DISC_LOG_CACHE_SIZE copies are kept, the least recently read is
+ * dropped to make room.  A copy built again later starts its genctr past
+ * disc_log_gen, which is above any genctr the host was given before.
+ */
+#define DISC_LOG_CACHE_SIZE	1024
+
+struct disc_log {
+	struct linked_list	 node;
+	struct linked_list	 lru;
+	struct nvmf_disc_rsp_page_hdr *log;
+	u64			 genctr;
+	int			 len;
+	unsigned int		 gen;
+	char			 nqn[MAX_NQN_SIZE + 1];
+};
+
+/* cached logs are hashed by host NQN; buckets are set up on first use */
+static struct linked_list	 disc_log_hash[HOST_HASH_SIZE];
+static pthread_mutex_t		 disc_log_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int		 disc_log_gen = 1;
+static LINKED_LIST(disc_log_lru);
+static int			 num_disc_logs;
+
+void invalidate_discovery_logs(void)
+{
+	__atomic_add_fetch(&disc_log_gen, 1, __ATOMIC_RELEASE);
+}
+
 void del_unattached_logpage_list(struct target *target)
 {
 	struct logpage		*lp, *n;
@@ -63,6 +101,8 @@ static inline void invalidate_log_pages(struct target *target)
 			logpage->valid = 0;
 
 	del_unattached_logpage_list(target);
+
+	notify_hosts();
 }
 
 static inline int match_logpage(struct logpage *logpage,
@@ -85,81 +125,304 @@ static inline void store_logpage(struct logpage *logpage,
 	logpage->portid = dq->portid;
 }
 
+/* a merge indexes what the target already holds by (subnqn, trtype,
+ * adrfam, traddr, trsvcid) and its subsystems by nqn, so each log entry
+ * is matched with a hash lookup instead of scanning every list
+ */
+#define LOGPAGE_HASH_SIZE	256	/* power of 2 */
+
+struct logpage_ref {
+	struct logpage_ref	*next;
+	struct logpage		*logpage;
+	struct subsystem	*subsys;	/* NULL when unattached */
+};
+
+struct logpage_index {
+	struct logpage_ref	*logpages[LOGPAGE_HASH_SIZE];
+	struct logpage_ref	*subsystems[LOGPAGE_HASH_SIZE];
+	struct logpage_ref	*refs;
+	int			 count;
+};
+
+static inline u32 hash_logpage(struct nvmf_disc_rsp_page_entry *e)
+{
+	u32			 hash = hash_str(e->subnqn);
+
+	hash = (hash ^ hash_str(e->traddr)) * 16777619U;
+	hash = (hash ^ hash_str(e->trsvcid)) * 16777619U;
+	hash ^= e->trtype << 8 | e->adrfam;
+
+	return hash & (LOGPAGE_HASH_SIZE - 1);
+}
+
+static void index_logpage(struct logpage_index *index,
+			  struct logpage *logpage, struct subsystem *subsys)
+{
+	struct logpage_ref	*ref = &index->refs[index->count++];
+	struct logpage_ref	**bucket;
+
+	bucket = &index->logpages[hash_logpage(&logpage->e)];
+
+	ref->logpage = logpage;
+	ref->subsys = subsys;
+	ref->next = *bucket;
+	*bucket = ref;
+}
+
+static void index_subsys(struct logpage_index *index, struct subsystem *subsys)
+{
+	struct logpage_ref	*ref = &index->refs[index->count++];
+	struct logpage_ref	**bucket;
+
+	bucket = &index->subsystems[hash_str(subsys->nqn) &
+				    (LOGPAGE_HASH_SIZE - 1)];
+
+	ref->logpage = NULL;
+	ref->subsys = subsys;
+	ref->next = *bucket;
+	*bucket = ref;
+}
+
+static struct subsystem *find_index_subsys(struct logpage_index *index,
+					   char *nqn)
+{
+	struct logpage_ref	*ref;
+
+	ref = index->subsystems[hash_str(nqn) & (LOGPAGE_HASH_SIZE - 1)];
+	for (; ref; ref = ref->next)
+		if (!strcmp(ref->subsys->nqn, nqn))
+			return ref->subsys;
+
+	return NULL;
+}
+
+static struct logpage *find_index_logpage(struct logpage_index *index,
+					  struct nvmf_disc_rsp_page_entry *e,
+					  struct subsystem *subsys)
+{
+	struct logpage_ref	*ref;
+
+	for (ref = index->logpages[hash_logpage(e)]; ref; ref = ref->next)
+		if (ref->subsys == subsys && match_logpage(ref->logpage, e) &&
+		    !strcmp(ref->logpage->e.subnqn, e->subnqn))
+			return ref->logpage;
+
+	return NULL;
+}
+
+/* sized for everything the target holds plus the entries being merged */
+static int init_logpage_index(struct logpage_index *index,
+			      struct target *target, int numrec)
+{
+	struct subsystem	*subsys;
+	struct logpage		*logpage;
+	int			 count = numrec;
+
+	list_for_each_entry(subsys, &target->subsys_list, node) {
+		count++;
+		list_for_each_entry(logpage, &subsys->logpage_list, node)
+			count++;
+	}
+
+	list_for_each_entry(logpage, &target->unattached_logpage_list, node)
+		count++;
+
+	memset(index, 0, sizeof(*index));
+
+	index->refs = malloc(count * sizeof(*index->refs));
+	if (!index->refs)
+		return -ENOMEM;
+
+	list_for_each_entry(subsys, &target->subsys_list, node) {
+		index_subsys(index, subsys);
+		list_for_each_entry(logpage, &subsys->logpage_list, node)
+			index_logpage(index, logpage, subsys);
+	}
+
+	list_for_each_entry(logpage, &target->unattached_logpage_list, node)
+		index_logpage(index, logpage, NULL);
+
+	return 0;
+}
+
 static void save_log_pages(struct nvmf_disc_rsp_page_hdr *log, int numrec,
 			   struct target *target, struct ctrl_queue *dq)
 {
-	int				 i;
-	int				 found;
-	int				 create;
+	struct logpage_index		 index;
 	struct subsystem		*subsys;
-	struct logpage			*logpage, *lp;
+	struct logpage			*logpage;
 	struct nvmf_disc_rsp_page_entry *e;
+	int				 i;
+
+	if (init_logpage_index(&index, target, numrec)) {
+		print_err("alloc logpage index failed");
+		return;
+	}
 
 	for (i = 0; i < numrec; i++) {
 		e = &log->entries[i];
-		found = 0;
-		create = 1;
-		list_for_each_entry(subsys, &target->subsys_list, node)
-			if ((strcmp(subsys->nqn, e->subnqn) == 0)) {
-				found = 1;
-				list_for_each_entry(logpage,
-						    &subsys->logpage_list,
-						    node)
-					if (match_logpage(logpage, e)) {
-						store_logpage(logpage, e, dq);
-						create = 0;
-						goto next;
-					}
-next:
-				break;
-			}
 
-		if (!create)
+		subsys = find_index_subsys(&index, e->subnqn);
+
+		logpage = find_index_logpage(&index, e, subsys);
+		if (logpage) {
+			/* unattached entries are kept as first seen */
+			if (subsys)
+				store_logpage(logpage, e, dq);
 			continue;
+		}
 
 		logpage = malloc(sizeof(*logpage));
 		if (!logpage) {
 			print_err("alloc new logpage failed");
-			return;
+			break;
 		}
 
 		store_logpage(logpage, e, dq);
 
-		if (found) {
+		if (subsys)
 			list_add_tail(&logpage->node, &subsys->logpage_list);
-			continue;
-		}
+		else
+			list_add_tail(&logpage->node,
+				      &target->unattached_logpage_list);
+
+		index_logpage(&index, logpage, subsys);
+	}
+
+	free(index.refs);
+
+	notify_hosts();
+}
+
+#define LOG_HEADER_TIMEOUT	100 /* ms */
+
+/* the header read of one discovery queue */
+struct log_header {
+	struct ctrl_queue	*dq;
+	u64			 genctr;
+	u32			 numrec;
+	int			 status;
+};
+
+static void log_header_done(struct endpoint *ep, struct cmd_ctx *ctx,
+			    int status)
+{
+	struct log_header		*hdr = ctx->arg;
+	struct nvmf_disc_rsp_page_hdr	*log = ctx->data;
+
+	UNUSED(ep);
+
+	if (!status) {
+		hdr->genctr = le64toh(log->genctr);
+		hdr->numrec = le32toh(log->numrec);
+		free(log);
+	}
+
+	hdr->status = status;
+}
+
+/* the header reads go out on every queue before any is waited on, so a
+ * target costs one round trip however many queues it has
+ */
+static void read_log_headers(struct log_header *hdrs, int cnt)
+{
+	struct log_header	*hdr;
+	int			 i;
+
+	for (i = 0, hdr = hdrs; i < cnt; i++, hdr++) {
+		hdr->status = get_log_header_async(hdr->dq, LOG_HEADER_TIMEOUT,
+						   log_header_done, hdr);
+		if (!hdr->status)
+			hdr->status = -EINPROGRESS;
+	}
 
-		list_for_each_entry(lp, &target->unattached_logpage_list, node)
-			if (!strcmp(lp->e.subnqn, e->subnqn) &&
-			    match_logpage(lp, e)) {
-				found = 1;
-				free(logpage);
+	/* a queue that fails completes its commands with the error */
+	for (i = 0, hdr = hdrs; i < cnt; i++, hdr++) {
+		while (hdr->status == -EINPROGRESS)
+			if (wait_cmds(&hdr->dq->ep, LOG_HEADER_TIMEOUT) < 0)
 				break;
-			}
 
-		if (!found)
-			list_add_tail(&logpage->node,
-				      &target->unattached_logpage_list);
+		if (hdr->status == -EINPROGRESS)
+			hdr->status = -ENOTCONN;
 	}
 }
 
-void fetch_log_pages(struct ctrl_queue *dq)
+/* the last log each queue returned is kept, so a target whose genctr has
+ * not moved costs a header read and nothing else. Returns 1 when the
+ * records of the queue changed.
+ */
+static int update_dq_log(struct ctrl_queue *dq, struct log_header *hdr)
 {
 	struct nvmf_disc_rsp_page_hdr	*log = NULL;
-	struct target			*target = dq->target;
-	u32				 num_records = 0;
+	u32				 numrec = hdr->numrec;
+	int				 ret;
+
+	if (hdr->status) {
+		print_err("failed to fetch number of discovery log entries");
+		print_err("get logpages for target %s failed",
+			  dq->target->alias);
+		return -ENODATA;
+	}
 
-	if (get_logpages(dq, &log, &num_records)) {
-		print_err("get logpages for target %s failed", target->alias);
-		return;
+	ret = get_changed_log_entries(dq, numrec, hdr->genctr, &log);
+	if (ret == -EALREADY)
+		return 0;
+
+	if (ret) {
+		print_err("get logpages for target %s failed",
+			  dq->target->alias);
+		return ret;
+	}
+
+	print_discovery_log(log, numrec);
+
+	/* a reconnect forgets genctr, the records may well be the same */
+	if (numrec == dq->numrec &&
+	    (!numrec || !memcmp(log->entries, dq->log->entries,
+				numrec * sizeof(*log->entries)))) {
+		free(log);
+		return 0;
 	}
 
-	save_log_pages(log, num_records, target, dq);
+	free(dq->log);
+
+	dq->log = log;
+	dq->numrec = numrec;
+
+	return 1;
+}
+
+static int drop_dq_log(struct ctrl_queue *dq)
+{
+	int				 had_records = dq->numrec != 0;
+
+	free(dq->log);
+
+	dq->log = NULL;
+	dq->numrec = 0;
+
+	return had_records;
+}
+
+void free_dq(struct ctrl_queue *dq)
+{
+	if (dq->connected)
+		disconnect_ctrl(dq, 0);
+
+	list_del(&dq->node);
 
-	print_discovery_log(log, num_records);
+	drop_dq_log(dq);
+	free(dq);
+}
 
-	free(log);
+void fetch_log_pages(struct ctrl_queue *dq)
+{
+	struct log_header	 hdr = { .dq = dq };
+
+	read_log_headers(&hdr, 1);
+
+	if (update_dq_log(dq, &hdr) > 0)
+		save_log_pages(dq->log, dq->numrec, dq->target, dq);
 }
 
 static int target_with_allow_any_subsys(struct target *target)
@@ -181,27 +444,268 @@ static int avilable_dq(struct ctrl_queue *dq)
 	return !list_empty(&dq->subsys->host_list);
 }
 
-void refresh_log_pages(struct target *target)
+/* the target's records are rebuilt from the logs kept per queue, and only
+ * when one of them changed unless a config change asks for it
+ */
+static void update_log_pages(struct target *target, int force)
 {
 	struct ctrl_queue	*dq;
+	struct log_header	*hdrs;
+	int			 changed = force;
+	int			 cnt = 0;
+	int			 i;
 
-	invalidate_log_pages(target);
+	list_for_each_entry(dq, &target->discovery_queue_list, node)
+		cnt++;
+
+	hdrs = calloc(cnt ? cnt : 1, sizeof(*hdrs));
+	if (!hdrs) {
+		print_err("no memory to refresh target %s", target->alias);
+		return;
+	}
+
+	cnt = 0;
 
 	list_for_each_entry(dq, &target->discovery_queue_list, node) {
 		if (!dq->connected) {
-			if (!avilable_dq(dq))
-				continue;
-			if (connect_ctrl(dq)) {
-				target->log_page_retry_count = LOG_PAGE_RETRY;
+			if (!avilable_dq(dq) ||
+			    target->health != TARGET_HEALTHY) {
+				changed |= drop_dq_log(dq);
 				continue;
 			}
+
+			/* connected off the poll loop, the log it last
+			 * reported stands until the probe is done
+			 */
+			connect_target_queues(target);
+			continue;
 		}
 
-		fetch_log_pages(dq);
+		hdrs[cnt++].dq = dq;
+	}
+
+	read_log_headers(hdrs, cnt);
+
+	for (i = 0; i < cnt; i++) {
+		dq = hdrs[i].dq;
+
+		if (update_dq_log(dq, &hdrs[i]) > 0)
+			changed = 1;
 
 		if (dq->failed_kato)
 			disconnect_ctrl(dq, 0);
 	}
+
+	free(hdrs);
+
+	if (!changed)
+		return;
+
+	invalidate_log_pages(target);
+
+	list_for_each_entry(dq, &target->discovery_queue_list, node)
+		if (dq->numrec)
+			save_log_pages(dq->log, dq->numrec, target, dq);
+}
+
+void refresh_log_pages(struct target *target)
+{
+	update_log_pages(target, 1);
+}
+
+void poll_log_pages(struct target *target)
+{
+	update_log_pages(target, 0);
+}
+
+static int build_discovery_log(struct disc_log *cache,
+			       struct nvmf_disc_rsp_page_entry *e, int max)
+{
+	struct target			*target;
+	struct subsystem		*subsys;
+	struct logpage			*p;
+	int				 numrec = 0;
+
+	list_for_each_entry(target, target_list, node) {
+		if (target->group_member && !shared_group(target, cache->nqn))
+			continue;
+
+		list_for_each_entry(subsys, &target->subsys_list, node) {
+			if (!subsys->access &&
+			    !find_subsys_host(subsys, cache->nqn))
+				continue;
+
+			list_for_each_entry(p, &subsys->logpage_list, node) {
+				if (!p->valid)
+					continue;
+				if (numrec < max)
+					memcpy(&e[numrec], &p->e, sizeof(*e));
+				numrec++;
+			}
+		}
+	}
+
+	return numrec;
+}
+
+static int update_discovery_log(struct disc_log *cache, unsigned int gen)
+{
+	struct nvmf_disc_rsp_page_hdr	*log;
+	struct nvmf_disc_rsp_page_hdr	*old = cache->log;
+	int				 numrec;
+	int				 len;
+
+	numrec = build_discovery_log(cache, NULL, 0);
+
+	len = sizeof(*log) + numrec * sizeof(log->entries[0]);
+
+	log = malloc(len);
+	if (!log)
+		return -ENOMEM;
+
+	memset(log, 0, sizeof(*log));
+
+	numrec = build_discovery_log(cache, log->entries, numrec);
+
+	if (!old || len != cache->len ||
+	    memcmp(old->entries, log->entries, len - sizeof(*log)))
+		cache->genctr++;
+
+	log->genctr = htole64(cache->genctr);
+	log->numrec = htole64(numrec);
+	log->recfmt = 0;
+
+	free(old);
+
+	cache->log = log;
+	cache->len = len;
+	cache->gen = gen;
+
+	return 0;
+}
+
+static struct disc_log *find_discovery_log(char *nqn)
+{
+	struct linked_list	*bucket;
+	struct disc_log		*cache;
+	unsigned int		 gen;
+	int			 ret;
+
+	bucket = &disc_log_hash[hash_str(nqn) & (HOST_HASH_SIZE - 1)];
+	if (!bucket->next)
+		INIT_LINKED_LIST(bucket);
+
+	gen = __atomic_load_n(&disc_log_gen, __ATOMIC_ACQUIRE);
+
+	list_for_each_entry(cache, bucket, node)
+		if (!strcmp(cache->nqn, nqn)) {
+			list_del(&cache->lru);
+			goto found;
+		}
+
+	if (num_disc_logs >= DISC_LOG_CACHE_SIZE) {
+		cache = list_first_entry(&disc_log_lru, struct disc_log, lru);
+		list_del(&cache->lru);
+		list_del(&cache->node);
+		free(cache->log);
+		memset(cache, 0, sizeof(*cache));
+	} else {
+		cache = malloc(sizeof(*cache));
+		if (!cache)
+			return NULL;
+
+		memset(cache, 0, sizeof(*cache));
+		num_disc_logs++;
+	}
+
+	strncpy(cache->nqn, nqn, MAX_NQN_SIZE);
+	cache->genctr = gen + 1;
+
+	list_add_tail(&cache->node, bucket);
+found:
+	list_add_tail(&cache->lru, &disc_log_lru);
+
+	if (!cache->log || cache->gen != gen) {
+		ret = update_discovery_log(cache, gen);
+		if (ret)
+			return NULL;
+	}
+
+	return cache;
+}
+
+/* copy len bytes starting at offset of the discovery log visible to host
+ * nqn into buf, zero filling past the end of the log
+ */
+int get_discovery_log(char *nqn, u64 offset, void *buf, int len)
+{
+	struct disc_log		*cache;
+	int			 bytes;
+	int			 ret = 0;
+
+	pthread_mutex_lock(&disc_log_lock);
+
+	cache = find_discovery_log(nqn);
+	if (!cache) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (offset > (u64) cache->len) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	bytes = min((u64) len, cache->len - offset);
+
+	memcpy(buf, (void *) cache->log + offset, bytes);
+	if (bytes < len)
+		memset(buf + bytes, 0, len - bytes);
+out:
+	pthread_mutex_unlock(&disc_log_lock);
+
+	return ret;
+}
+
+/* current generation counter of the discovery log visible to host nqn */
+u64 get_discovery_genctr(char *nqn)
+{
+	struct disc_log		*cache;
+	u64			 genctr = 0;
+
+	pthread_mutex_lock(&disc_log_lock);
+
+	cache = find_discovery_log(nqn);
+	if (cache)
+		genctr = cache->genctr;
+
+	pthread_mutex_unlock(&disc_log_lock);
+
+	return genctr;
+}
+
+void free_discovery_logs(void)
+{
+	struct disc_log		*cache, *next;
+	int			 i;
+
+	pthread_mutex_lock(&disc_log_lock);
+
+	for (i = 0; i < HOST_HASH_SIZE; i++) {
+		if (!disc_log_hash[i].next)
+			continue;
+
+		list_for_each_entry_safe(cache, next, &disc_log_hash[i], node) {
+			list_del(&cache->node);
+			list_del(&cache->lru);
+			free(cache->log);
+			free(cache);
+		}
+	}
+
+	num_disc_logs = 0;
+
+	pthread_mutex_unlock(&disc_log_lock);
 }
 
 static void format_logpage(char *buf, struct nvmf_disc_rsp_page_entry *e)
@@ -37,6 +37,8 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include "mongoose.h"
 #include "common.h"
@@ -45,20 +47,41 @@
 #define RETRY_COUNT	200	// 20 sec since multiplier of delay timeout
 #define DELAY_TIMEOUT	100	// ms
 #define KATO_INTERVAL	500	// ms per spec
+#define MAX_EVENTS	32	// epoll events handled per wakeup
 
 #define NVME_VER ((1 << 16) | (2 << 8) | 1) /* NVMe 1.2.1 */
 
 // #define DEBUG_COMMANDS
 
+struct host_worker;
+
 struct host_conn {
 	struct linked_list	 node;
+	struct linked_list	 aen_node;
+	struct host_conn	*next;
+	struct host_worker	*worker;
 	struct endpoint		*ep;
-	struct timeval		 timeval;
-	int			 countdown;
+	struct timer		 kato_timer;
+	u64			 aen_genctr;
+	u16			 aen_cid;
+	int			 aen_state;
 	int			 kato;
 	int			 inst;
 };
 
+/* hosts with an outstanding async event request wait on aen_list.  When
+ * the notification timer fires, any host whose discovery log genctr moved
+ * since it made the request is taken off the list and flagged, and its
+ * worker sends the notice from its own thread as the completion of that
+ * request.  Other commands are serviced while the request is outstanding.
+ */
+enum { AEN_IDLE = 0, AEN_WAITING, AEN_READY };
+
+static LINKED_LIST(aen_list);
+static pthread_mutex_t		 aen_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void wake_host_worker(struct host_worker *worker);
+
 static int handle_property_set(struct nvme_command *cmd, int *csts)
 {
 	int			 ret = 0;
@@ -149,28 +172,90 @@ static int handle_set_features(struct nvme_command *cmd, struct host_conn *host)
 	return ret;
 }
 
-static int handle_async_event(struct host_conn *host)
+static int handle_async_event(struct nvme_command *cmd,
+			      struct host_conn *host)
 {
-	int			ret = 0;
+	int			 ret = -EINPROGRESS;
 
 #ifdef DEBUG_COMMANDS
 	print_debug("nvme_admin_async_event (request)");
 #endif
 
-	struct event_notification *entry;
+	pthread_mutex_lock(&aen_lock);
 
-	entry = malloc(sizeof(*entry));
-	if (!entry)
-		return -ENOMEM;
+	/* AERL is 0, only one request may be outstanding */
+	if (host->aen_state == AEN_IDLE) {
+		host->aen_cid = cmd->common.command_id;
+		host->aen_genctr = get_discovery_genctr(host->ep->nqn);
+		host->aen_state = AEN_WAITING;
+		list_add_tail(&host->aen_node, &aen_list);
+	} else
+		ret = NVME_SC_ASYNC_LIMIT;
 
-	memset(entry, 0, sizeof(*entry));
+	pthread_mutex_unlock(&aen_lock);
 
-	strcpy(entry->nqn, host->ep->nqn);
-	entry->ep = host->ep;
+	return ret;
+}
 
-	list_add(&entry->node, aen_req_list);
+static void cancel_async_event(struct host_conn *host)
+{
+	pthread_mutex_lock(&aen_lock);
 
-	return ret;
+	if (host->aen_state == AEN_WAITING)
+		list_del(&host->aen_node);
+
+	host->aen_state = AEN_IDLE;
+
+	pthread_mutex_unlock(&aen_lock);
+}
+
+/* runs on the daemon thread when the notification timer fires */
+void send_notifications(void)
+{
+	struct host_conn	*host, *next;
+
+	pthread_mutex_lock(&aen_lock);
+
+	list_for_each_entry_safe(host, next, &aen_list, aen_node) {
+		if (get_discovery_genctr(host->ep->nqn) == host->aen_genctr)
+			continue;
+
+		list_del(&host->aen_node);
+		host->aen_state = AEN_READY;
+
+		wake_host_worker(host->worker);
+	}
+
+	pthread_mutex_unlock(&aen_lock);
+}
+
+static void send_async_event(struct host_conn *host)
+{
+	struct endpoint		*ep = host->ep;
+	struct nvme_completion	*resp = (void *) ep->cmd;
+	int			 ready;
+
+	pthread_mutex_lock(&aen_lock);
+
+	ready = (host->aen_state == AEN_READY);
+	if (ready)
+		host->aen_state = AEN_IDLE;
+
+	pthread_mutex_unlock(&aen_lock);
+
+	if (!ready || !resp)
+		return;
+
+	memset(resp, 0, sizeof(*resp));
+
+	resp->command_id = host->aen_cid;
+	resp->result.U32 = NVME_AER_NOTICE_LOG_PAGE_CHANGE;
+
+	if (ep->state == CONNECTED)
+		ep->ops->send_rsp(ep->ep, resp, sizeof(*resp), ep->mr);
+	else
+		print_err("cannot send AER_NOTICE to %p state %d", ep,
+			  ep->state);
 }
 
 static int handle_connect(struct endpoint *ep, u64 addr, u64 key, u64 len)
@@ -235,122 +320,70 @@ static int handle_identify(struct endpoint *ep, struct nvme_command *cmd,
 				 ep->data_mr, cmd);
 	if (ret) {
 		print_errno("rma_write failed", ret);
-		ret = NVME_SC_WRITE_FAULT;
+		/* a host that stopped reading loses its queue */
+		if (ret != -ETIMEDOUT)
+			ret = NVME_SC_WRITE_FAULT;
 	}
 
 	return ret;
 }
 
-static int host_access(struct subsystem *subsys, char *nqn)
+static int handle_get_log_page(struct endpoint *ep, struct nvme_command *cmd,
+			       u64 addr, u64 key, u64 len)
 {
-	struct host		*entry;
-
-	/* check if host is in subsys host_list it has non-zero access */
-	/* return: 0 if no access; else access rights */
-
-	list_for_each_entry(entry, &subsys->host_list, node)
-		if (strcmp(entry->nqn, nqn) == 0)
-			return 1;
-
-	return 0;
-}
-
-static int handle_get_log_page_count(struct endpoint *ep,
-				     struct nvme_command *cmd, u64 addr,
-				     u64 key, u64 len)
-{
-	struct nvmf_disc_rsp_page_hdr	*log = ep->data;
-	struct target			*target;
-	struct subsystem		*subsys;
-	struct logpage			*p;
-	int				 numrec = 0;
+	struct nvme_get_log_page_command *glp = &cmd->get_log_page;
+	struct xp_mr			*mr = ep->data_mr;
+	struct xp_buf			*buf = NULL;
+	void				*log = ep->data;
+	u64				 offset;
+	u64				 numd;
 	int				 ret;
 
-	list_for_each_entry(target, target_list, node) {
-		if (target->group_member && !shared_group(target, ep->nqn))
-			continue;
+	if (glp->lid != NVME_LOG_DISC)
+		return NVME_SC_INVALID_FIELD;
 
-		list_for_each_entry(subsys, &target->subsys_list, node)
-			list_for_each_entry(p, &subsys->logpage_list, node) {
-				if (!p->valid)
-					continue;
+	offset = ((u64) le32toh(glp->lpou) << 32) | le32toh(glp->lpol);
+	numd = (((u64) le16toh(glp->numdu) << 16) | le16toh(glp->numdl)) + 1;
 
-				if (subsys->access ||
-				    host_access(subsys, ep->nqn))
-					numrec++;
-			}
-	}
+	if (offset & 3)
+		return NVME_SC_INVALID_FIELD;
 
-	log->numrec = numrec;
-	log->genctr = 1;
+	len = min(len, numd * sizeof(u32));
 
-#ifdef DEBUG_COMMANDS
-	print_debug("log_page count %d", numrec);
-#endif
+	/* the header and small partial reads fit the endpoint data buffer */
+	if (len > PAGE_SIZE) {
+		ret = get_ep_buf(ep, len, &buf);
+		if (ret) {
+			print_errno("get_ep_buf failed", ret);
+			return NVME_SC_INTERNAL;
+		}
 
-	ret = ep->ops->rma_write(ep->ep, ep->data, addr, len,
-				 key, ep->data_mr, cmd);
-	if (ret) {
-		print_errno("rma_write failed", ret);
-		ret = NVME_SC_WRITE_FAULT;
+		log = buf->buf;
+		mr = buf->mr;
 	}
 
-	return ret;
-}
-
-static int handle_get_log_pages(struct endpoint *ep, struct nvme_command *cmd,
-				u64 addr, u64 key, u64 len)
-{
-	struct nvmf_disc_rsp_page_hdr	*log;
-	struct nvmf_disc_rsp_page_entry *e;
-	struct logpage			*p;
-	struct xp_mr			*mr;
-	struct target			*target;
-	struct subsystem		*subsys;
-	int				 numrec = 0;
-	int				 ret;
-
-	log = malloc(len);
-	if (!log)
-		return NVME_SC_INTERNAL;
-
-	ret = ep->ops->alloc_key(ep->ep, log, len, &mr);
+	ret = get_discovery_log(ep->nqn, offset, log, len);
 	if (ret) {
-		print_errno("alloc_key failed", ret);
-		return NVME_SC_INTERNAL;
-	}
-
-	e = (void *) (&log[1]);
-
-	list_for_each_entry(target, target_list, node) {
-		if (target->group_member && !shared_group(target, ep->nqn))
-			continue;
-
-		list_for_each_entry(subsys, &target->subsys_list, node)
-			list_for_each_entry(p, &subsys->logpage_list, node) {
-				if (!p->valid)
-					continue;
-
-				if (subsys->access ||
-				    host_access(subsys, ep->nqn)) {
-					memcpy(e, &p->e, sizeof(*e));
-					numrec++;
-					e++;
-				}
-			}
+		print_errno("get_discovery_log failed", ret);
+		ret = (ret == -EINVAL) ? NVME_SC_INVALID_FIELD :
+					 NVME_SC_INTERNAL;
+		goto out;
 	}
 
-	log->numrec = numrec;
-	log->genctr = 1;
+#ifdef DEBUG_COMMANDS
+	print_debug("log_page offset %lld len %lld", offset, len);
+#endif
 
 	ret = ep->ops->rma_write(ep->ep, log, addr, len, key, mr, cmd);
 	if (ret) {
 		print_errno("rma_write failed", ret);
-		ret = NVME_SC_WRITE_FAULT;
+		/* a host that stopped reading loses its queue */
+		if (ret != -ETIMEDOUT)
+			ret = NVME_SC_WRITE_FAULT;
 	}
-
-	ep->ops->dealloc_key(mr);
-	free(log);
+out:
+	if (buf)
+		put_ep_buf(ep, buf);
 
 	return ret;
 }
@@ -405,11 +438,7 @@ static int handle_request(struct host_conn *host, struct qe *qe, void *buf,
 		ret = 0;
 		break;
 	case nvme_admin_get_log_page:
-		if (len == 16)
-			ret = handle_get_log_page_count(ep, cmd, addr, key,
-							len);
-		else
-			ret = handle_get_log_pages(ep, cmd, addr, key, len);
+		ret = handle_get_log_page(ep, cmd, addr, key, len);
 		break;
 	case nvme_admin_get_features:
 		ret = handle_get_features(cmd, resp, host);
@@ -418,179 +447,354 @@ static int handle_request(struct host_conn *host, struct qe *qe, void *buf,
 		ret = handle_set_features(cmd, host);
 		break;
 	case nvme_admin_async_event:
-		ret = handle_async_event(host);
+		ret = handle_async_event(cmd, host);
 		break;
 	default:
 		print_err("unknown nvme opcode %d", cmd->common.opcode);
 		ret = NVME_SC_INVALID_OPCODE;
 	}
 
+	/* held async event requests complete when there is a notice */
+	if (ret == -EINPROGRESS) {
+		ret = 0;
+		goto out;
+	}
+
+	if (ret < 0)
+		goto out;
+
 	if (ret)
 		resp->status = (NVME_SC_DNR | ret) << 1;
 
-	ep->ops->send_rsp(ep->ep, resp, sizeof(*resp), ep->mr);
+	/* an error status fails the command, not the queue */
+	ret = ep->ops->send_rsp(ep->ep, resp, sizeof(*resp), ep->mr);
+out:
 	ep->ops->repost_recv(ep->ep, qe->qe);
 
 	return ret;
 }
 
-#define HOST_QUEUE_MAX 3 /* min of 3 otherwise cannot tell if full */
-struct host_queue {
-	struct endpoint		*ep[HOST_QUEUE_MAX];
-	int			 tail, head;
+/* each interface runs a pool of host workers. A worker owns the hosts
+ * assigned to it and services them from its own epoll set. New connections
+ * are handed from the interface thread to a worker through a lock-free
+ * multi-producer single-consumer list: producers push onto the head, the
+ * worker detaches the whole list in one exchange and reverses it, so
+ * accepts never wait on a worker.
+ */
+struct host_worker {
+	struct host_conn	*head;
+	pthread_t		 thread;
+	int			 event_fd;
+	int			 epfd;
+	int			 num_hosts;
+	bool			 shutdown;
+	bool			 dead;
+	struct timer_wheel	 timers;
 };
 
-static inline int is_empty(struct host_queue *q)
+static void wake_host_worker(struct host_worker *worker)
 {
-	return q->head == q->tail;
+	u64			 val = 1;
+
+	if (write(worker->event_fd, &val, sizeof(val)) != sizeof(val))
+		print_errno("host worker wakeup failed", errno);
 }
 
-static inline int is_full(struct host_queue *q)
+static void flush_new_host_conns(struct host_worker *worker);
+
+static inline void add_new_host_conn(struct host_worker *worker,
+				     struct host_conn *host)
 {
-	return ((q->head + 1) % HOST_QUEUE_MAX) == q->tail;
+	struct host_conn	*head;
+
+	__atomic_add_fetch(&worker->num_hosts, 1, __ATOMIC_RELAXED);
+
+	head = __atomic_load_n(&worker->head, __ATOMIC_RELAXED);
+	do {
+		host->next = head;
+	} while (!__atomic_compare_exchange_n(&worker->head, &head, host, true,
+					      __ATOMIC_SEQ_CST,
+					      __ATOMIC_RELAXED));
+
+	/* a worker that died after it was picked may have already flushed
+	 * its list, so nobody else would drop this host
+	 */
+	if (__atomic_load_n(&worker->dead, __ATOMIC_SEQ_CST)) {
+		flush_new_host_conns(worker);
+		return;
+	}
+
+	wake_host_worker(worker);
 }
 
-#ifdef DEBUG_HOST_QUEUE
-static inline void dump_queue(struct host_queue *q)
+static inline struct host_conn *get_new_host_conns(struct host_worker *worker)
 {
-	print_debug("ep { %p, %p, %p }, tail %d, head %d",
-		    q->ep[0], q->ep[1], q->ep[2], q->tail, q->head);
+	struct host_conn	*host, *next;
+	struct host_conn	*list = NULL;
+
+	host = __atomic_exchange_n(&worker->head, NULL, __ATOMIC_ACQUIRE);
+
+	/* restore arrival order */
+	while (host) {
+		next = host->next;
+		host->next = list;
+		list = host;
+		host = next;
+	}
+
+	return list;
 }
-#endif
 
-static inline int add_new_host_conn(struct host_queue *q, struct endpoint *ep)
+static void flush_new_host_conns(struct host_worker *worker)
 {
-	if (is_full(q))
-		return -1;
+	struct host_conn	*host, *next;
 
-	q->ep[q->head] = ep;
-	q->head = (q->head + 1) % HOST_QUEUE_MAX;
-#ifdef DEBUG_HOST_QUEUE
-	dump_queue(q);
-#endif
-	return 0;
+	for (host = get_new_host_conns(worker); host; host = next) {
+		next = host->next;
+		disconnect_endpoint(host->ep, 1);
+		free(host->ep);
+		free(host);
+	}
 }
 
-static inline int get_new_host_conn(struct host_queue *q, struct endpoint **ep)
+static void drop_host(struct host_worker *worker, struct host_conn *host)
 {
-	if (is_empty(q))
-		return -1;
+	struct endpoint		*ep = host->ep;
+	int			 fd;
 
-	if (!q->ep[q->tail])
-		return 1;
+	fd = ep->ops->event_fd(ep->ep);
+	if (fd >= 0)
+		epoll_ctl(worker->epfd, EPOLL_CTL_DEL, fd, NULL);
+
+	del_timer(&worker->timers, &host->kato_timer);
+
+	cancel_async_event(host);
+
+	disconnect_endpoint(ep, !stopped);
+
+	if (ep->nqn[0])
+		print_info("host '%s' disconnected", ep->nqn);
+	else
+		print_info("host instance %u disconnected", host->inst);
+
+	free(ep);
+	list_del(&host->node);
+	free(host);
+
+	__atomic_sub_fetch(&worker->num_hosts, 1, __ATOMIC_RELAXED);
+}
+
+static void kato_timer_expired(struct timer *timer)
+{
+	struct host_conn	*host;
+
+	host = container_of(timer, struct host_conn, kato_timer);
+
+	drop_host(host->worker, host);
+}
+
+static void add_new_hosts(struct host_worker *worker,
+			  struct linked_list *host_list)
+{
+	struct host_conn	*host, *next;
+	struct endpoint		*ep;
+	struct epoll_event	 event;
+	u64			 val;
+
+	if (read(worker->event_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		print_errno("host worker read failed", errno);
+
+	for (host = get_new_host_conns(worker); host; host = next) {
+		next = host->next;
+		ep = host->ep;
+
+		host->worker	= worker;
+		host->kato	= RETRY_COUNT;
+
+		init_timer(&host->kato_timer, kato_timer_expired);
+		add_timer(&worker->timers, &host->kato_timer,
+			  host->kato * DELAY_TIMEOUT);
+
+		if (ep->nqn[0] == 0)
+			sprintf(ep->nqn, "new host inst %u", host->inst);
+
+		list_add_tail(&host->node, host_list);
+
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.ptr = host;
+
+		if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD,
+			      ep->ops->event_fd(ep->ep), &event)) {
+			print_errno("epoll_ctl failed", errno);
+			drop_host(worker, host);
+		}
+	}
+}
+
+static int service_host(struct host_conn *host)
+{
+	struct endpoint		*ep = host->ep;
+	struct qe		 qe;
+	void			*buf;
+	int			 len;
+	int			 ret;
+
+	while (!stopped) {
+		ret = ep->ops->poll_for_msg(ep->ep, &qe.qe, &buf, &len);
+		if (ret)
+			return (ret == -EAGAIN) ? 0 : ret;
+
+		ret = handle_request(host, &qe, buf, len);
+		if (ret)
+			return ret;
+
+		mod_timer(&host->worker->timers, &host->kato_timer,
+			  host->kato * DELAY_TIMEOUT);
+	}
 
-	*ep = q->ep[q->tail];
-	q->ep[q->tail] = NULL;
-	q->tail = (q->tail + 1) % HOST_QUEUE_MAX;
-#ifdef DEBUG_HOST_QUEUE
-	dump_queue(q);
-#endif
 	return 0;
 }
 
+static void send_async_events(struct linked_list *host_list)
+{
+	struct host_conn	*host;
+
+	list_for_each_entry(host, host_list, node)
+		if (__atomic_load_n(&host->aen_state, __ATOMIC_RELAXED) ==
+		    AEN_READY)
+			send_async_event(host);
+}
+
 static void *host_thread(void *arg)
 {
-	struct host_queue	*q = arg;
-	struct endpoint		*ep = NULL;
-	struct qe		 qe;
-	struct timeval		 timeval;
+	struct host_worker	*worker = arg;
+	struct epoll_event	 events[MAX_EVENTS];
 	struct linked_list	 host_list;
 	struct host_conn	*next;
 	struct host_conn	*host;
-	void			*buf;
-	int			 len;
-	int			 delta;
-	int			 ret;
-	static unsigned int	 host_counter = 1;
+	u64			 next_trim = monotonic_ms() + EP_BUF_IDLE;
+	int			 i, n;
 
 	INIT_LINKED_LIST(&host_list);
 
-	while (!stopped) {
-		gettimeofday(&timeval, NULL);
-
-		do {
-			ret = get_new_host_conn(q, &ep);
-
-			if (!ret) {
-				host = malloc(sizeof(*host));
-				if (!host)
-					goto out;
-
-				host->ep	= ep;
-				host->inst	= host_counter++;
-				host->kato	= RETRY_COUNT;
-				host->countdown	= RETRY_COUNT;
-				host->timeval	= timeval;
-				if (ep->nqn[0] == 0)
-					sprintf(ep->nqn, "new host inst %u",
-						host->inst);
-
-				list_add_tail(&host->node, &host_list);
-			}
-		} while (!ret && !stopped);
-
-		/* Service Host requests */
-		list_for_each_entry_safe(host, next, &host_list, node) {
-			ep = host->ep;
-loop:
-			ret = ep->ops->poll_for_msg(ep->ep, &qe.qe, &buf, &len);
-			if (!ret) {
-				ret = handle_request(host, &qe, buf, len);
-				if (!ret) {
-					host->countdown	= host->kato;
-					host->timeval	= timeval;
-					goto loop;
-				}
-			}
+	while (!stopped &&
+	       !__atomic_load_n(&worker->shutdown, __ATOMIC_ACQUIRE)) {
+		/* sleep until a host sends a command, a new host arrives or
+		 * the next keep alive timer is due
+		 */
+		n = epoll_wait(worker->epfd, events, MAX_EVENTS,
+			       next_timer(&worker->timers));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			print_errno("epoll_wait failed", errno);
+			break;
+		}
 
-			if (ret == -EAGAIN)
-				if (--host->countdown > 0)
-					continue;
+		for (i = 0; i < n && !stopped; i++) {
+			host = events[i].data.ptr;
+			if (!host) {
+				add_new_hosts(worker, &host_list);
+				send_async_events(&host_list);
+				continue;
+			}
 
-			disconnect_endpoint(ep, !stopped);
+			if (service_host(host))
+				drop_host(worker, host);
+		}
 
-			if (ep->nqn[0])
-				print_info("host '%s' disconnected", ep->nqn);
-			else
-				print_info("host instance %u disconnected",
-					   host->inst);
+		run_timers(&worker->timers);
 
-			free(ep);
-			list_del(&host->node);
-			free(host);
+		/* hand back the log buffers of hosts that stopped reading */
+		if (monotonic_ms() >= next_trim) {
+			list_for_each_entry(host, &host_list, node)
+				trim_ep_bufs(host->ep, EP_BUF_IDLE);
+			next_trim = monotonic_ms() + EP_BUF_IDLE;
 		}
+	}
 
-		delta = msec_delta(timeval);
-		if (delta < DELAY_TIMEOUT)
-			usleep((DELAY_TIMEOUT - delta) * 1000);
+	/* keep the interface from handing this worker any more hosts */
+	if (!stopped &&
+	    !__atomic_load_n(&worker->shutdown, __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&worker->dead, true, __ATOMIC_SEQ_CST);
+		flush_new_host_conns(worker);
 	}
-out:
+
 	list_for_each_entry_safe(host, next, &host_list, node) {
+		cancel_async_event(host);
 		disconnect_endpoint(host->ep, 1);
 		free(host->ep);
 		free(host);
 	}
 
-	while (!is_empty(q))
-		if (!get_new_host_conn(q, &ep)) {
-			disconnect_endpoint(ep, 1);
-			free(ep);
-		}
-
 	pthread_exit(NULL);
 
 	return NULL;
 }
 
-static int add_host_to_queue(void *id, struct xp_ops *ops, struct host_queue *q)
+static struct host_worker *pick_host_worker(struct host_worker *workers,
+					    int num_workers)
+{
+	static unsigned int	 next_worker;
+	struct host_worker	*worker, *best = NULL;
+	int			 load, min_load = 0;
+	int			 i, n;
+
+	/* least loaded live worker, scanning from a rotating start so that
+	 * ties are spread round robin
+	 */
+	n = __atomic_fetch_add(&next_worker, 1, __ATOMIC_RELAXED);
+
+	for (i = 0; i < num_workers; i++) {
+		worker = &workers[(n + i) % num_workers];
+		if (__atomic_load_n(&worker->dead, __ATOMIC_ACQUIRE))
+			continue;
+
+		load = __atomic_load_n(&worker->num_hosts, __ATOMIC_RELAXED);
+		if (!best || load < min_load) {
+			best = worker;
+			min_load = load;
+			if (!min_load)
+				break;
+		}
+	}
+
+	return best;
+}
+
+static void reject_host(void *id, struct xp_ops *ops)
 {
+	struct xp_ep		*ep;
+
+	if (ops->create_endpoint(&ep, id, NVMF_DQ_DEPTH))
+		return;
+
+	ops->reject_connection(ep, NULL, 0);
+	ops->destroy_endpoint(ep);
+}
+
+static int add_host_to_worker(void *id, struct xp_ops *ops,
+			      struct host_worker *worker)
+{
+	struct host_conn	*host;
 	struct endpoint		*ep;
+	static unsigned int	 host_counter = 1;
 	int			 ret;
 
+	host = malloc(sizeof(*host));
+	if (!host) {
+		print_err("no memory");
+		return -ENOMEM;
+	}
+
+	memset(host, 0, sizeof(*host));
+
 	ep = malloc(sizeof(*ep));
 	if (!ep) {
 		print_err("no memory");
-		return -ENOMEM;
+		ret = -ENOMEM;
+		goto out1;
 	}
 
 	memset(ep, 0, sizeof(*ep));
@@ -600,30 +804,126 @@ static int add_host_to_queue(void *id, struct xp_ops *ops, struct host_queue *q)
 	ret = run_pseudo_target(ep, id);
 	if (ret) {
 		print_errno("run_pseudo_target failed", ret);
-		goto out;
+		goto out2;
 	}
 
-	while (is_full(q) && !stopped)
-		usleep(100);
-
-	add_new_host_conn(q, ep);
+	host->ep = ep;
+	host->inst = __atomic_fetch_add(&host_counter, 1, __ATOMIC_RELAXED);
 
-	usleep(20);
+	add_new_host_conn(worker, host);
 
 	return 0;
-out:
+out2:
 	free(ep);
+out1:
+	free(host);
 	return ret;
 }
 
+static void stop_host_workers(struct host_worker *workers, int num_workers)
+{
+	struct host_worker	*worker;
+	int			 i;
+
+	/* workers may be sleeping with no hosts, kick them to see shutdown */
+	for (i = 0; i < num_workers; i++) {
+		__atomic_store_n(&workers[i].shutdown, true, __ATOMIC_RELEASE);
+		wake_host_worker(&workers[i]);
+	}
+
+	for (i = 0; i < num_workers; i++) {
+		worker = &workers[i];
+
+		pthread_join(worker->thread, NULL);
+
+		flush_new_host_conns(worker);
+
+		close(worker->epfd);
+		close(worker->event_fd);
+	}
+
+	free(workers);
+}
+
+static int start_host_workers(struct host_worker **_workers, int num_workers)
+{
+	struct host_worker	*workers;
+	struct host_worker	*worker;
+	struct epoll_event	 event;
+	pthread_attr_t		 pthread_attr;
+	int			 i;
+	int			 ret = 0;
+
+	workers = calloc(num_workers, sizeof(*workers));
+	if (!workers)
+		return -ENOMEM;
+
+	pthread_attr_init(&pthread_attr);
+
+	for (i = 0; i < num_workers; i++) {
+		worker = &workers[i];
+
+		worker->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (worker->event_fd < 0) {
+			ret = -errno;
+			print_errno("eventfd failed", ret);
+			break;
+		}
+
+		init_timer_wheel(&worker->timers, DELAY_TIMEOUT);
+
+		worker->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (worker->epfd < 0) {
+			ret = -errno;
+			print_errno("epoll_create1 failed", ret);
+			close(worker->event_fd);
+			break;
+		}
+
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.ptr = NULL;
+
+		if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, worker->event_fd,
+			      &event)) {
+			ret = -errno;
+			print_errno("epoll_ctl failed", ret);
+			close(worker->epfd);
+			close(worker->event_fd);
+			break;
+		}
+
+		ret = pthread_create(&worker->thread, &pthread_attr,
+				     host_thread, worker);
+		if (ret) {
+			print_err("failed to start host thread");
+			print_errno("pthread_create failed", ret);
+			ret = -ret;
+			close(worker->epfd);
+			close(worker->event_fd);
+			break;
+		}
+	}
+
+	pthread_attr_destroy(&pthread_attr);
+
+	if (ret) {
+		stop_host_workers(workers, i);
+		return ret;
+	}
+
+	*_workers = workers;
+
+	return 0;
+}
+
 void *interface_thread(void *arg)
 {
 	struct host_iface	*iface = arg;
+	struct host_worker	*workers;
+	struct host_worker	*worker;
 	struct xp_pep		*listener;
 	void			*id;
-	struct host_queue	 q;
-	pthread_attr_t		 pthread_attr;
-	pthread_t		 pthread;
 	int			 ret;
 
 	ret = start_pseudo_target(iface);
@@ -637,18 +937,9 @@ void *interface_thread(void *arg)
 
 	signal(SIGTERM, SIG_IGN);
 
-	memset(&q, 0, sizeof(q));
-
-	pthread_attr_init(&pthread_attr);
-
-	ret = pthread_create(&pthread, &pthread_attr, host_thread, &q);
-	if (ret) {
-		print_err("failed to start host thread");
-		print_errno("pthread_create failed", ret);
+	ret = start_host_workers(&workers, iface->workers);
+	if (ret)
 		goto out2;
-	}
-
-	pthread_attr_destroy(&pthread_attr);
 
 	while (!stopped) {
 		ret = iface->ops->wait_for_connection(listener, &id);
@@ -656,13 +947,19 @@ void *interface_thread(void *arg)
 		if (stopped)
 			break;
 
-		if (ret == 0)
-			add_host_to_queue(id, iface->ops, &q);
-		else if (ret != -EAGAIN)
+		if (ret == 0) {
+			worker = pick_host_worker(workers, iface->workers);
+			if (worker)
+				add_host_to_worker(id, iface->ops, worker);
+			else {
+				print_err("no host workers left");
+				reject_host(id, iface->ops);
+			}
+		} else if (ret != -EAGAIN)
 			print_errno("Host connection failed", ret);
 	}
 
-	pthread_join(pthread, NULL);
+	stop_host_workers(workers, iface->workers);
 out2:
 	iface->ops->destroy_listener(listener);
 out1:
@@ -209,6 +209,10 @@ static int get_target_request(char *target, char **p, int n, char *query,
 		ret = target_logpage(target, resp);
 		if (ret)
 			sprintf(*resp, "%s '%s' not found", TAG_TARGET, target);
+	} else if (n == 1 && !strcmp(*p, URI_HEALTH)) {
+		ret = target_health(target, resp);
+		if (ret)
+			sprintf(*resp, "%s '%s' not found", TAG_TARGET, target);
 	} else
 		ret = bad_request(*resp);
 
@@ -392,6 +392,9 @@ static int init_mg_mgr(struct mg_mgr *mgr, char *ssl_cert)
 
 static void cleanup_inb_thread(pthread_t *listen_thread)
 {
+	if (host_iface.ops && host_iface.listener)
+		host_iface.ops->stop_listener(host_iface.listener);
+
 	pthread_kill(*listen_thread, SIGTERM);
 
 	/* wait for threads to cleanup before exiting so they can properly
@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: DUAL GPL-2.0/BSD */
+/*
+ * NVMe over Fabrics Distributed Endpoint Management (NVMe-oF DEM).
+ * Copyright (c) 2017-2019 Intel Corporation, Inc. All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *	- Redistributions of source code must retain the above
+ *	  copyright notice, this list of conditions and the following
+ *	  disclaimer.
+ *
+ *	- Redistributions in binary form must reproduce the above
+ *	  copyright notice, this list of conditions and the following
+ *	  disclaimer in the documentation and/or other materials
+ *	  provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __CRC32C_H__
+#define __CRC32C_H__
+
+/* CRC32C (Castagnoli) as used for NVMe/TCP header and data digests.
+ * crc32c() neither pre nor post inverts, so a digest over several
+ * buffers is ~crc32c(crc32c(~0, a, alen), b, blen)
+ */
+u32 crc32c(u32 crc, const void *buf, size_t len);
+
+/* the table driven and SSE4.2 versions, exposed for benchmarking.
+ * crc32c_hw falls back to the table when the CPU lacks SSE4.2/PCLMULQDQ
+ */
+u32 crc32c_sw(u32 crc, const void *buf, size_t len);
+u32 crc32c_hw(u32 crc, const void *buf, size_t len);
+int crc32c_hw_available(void);
+
+#endif
@@ -34,6 +34,8 @@
 
 int init_curl(int debug);
 void cleanup_curl(void);
+int init_curl_thread(void);
+void cleanup_curl_thread(void);
 int exec_get(char *url, char **result);
 int exec_delete(char *url);
 int exec_delete_ex(char *url, char *data, int len);
@@ -44,7 +44,15 @@
 #define PAGE_SIZE		4096
 #define BUF_SIZE		4096
 #define BODY_SIZE		1024
-#define NVMF_DQ_DEPTH		2
+/* discovery queue depth, each outstanding command needs a slot in the
+ * endpoint's single registered command page
+ */
+#ifndef NVMF_DQ_DEPTH
+#define NVMF_DQ_DEPTH		16
+#endif
+#if NVMF_DQ_DEPTH < 2 || NVMF_DQ_DEPTH > (PAGE_SIZE / 64)
+#error "NVMF_DQ_DEPTH must be between 2 and PAGE_SIZE / 64"
+#endif
 #define IDLE_TIMEOUT		100
 #define MINUTES			(60 * 1000) /* convert ms to minutes */
 #define LOG_PAGE_RETRY		200
@@ -82,6 +90,15 @@ static inline int msec_delta(struct timeval t0)
 		(t1.tv_usec - t0.tv_usec) / 1000;
 }
 
+static inline u64 monotonic_ms(void)
+{
+	struct timespec		 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (u64) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 #define UUID_LEN		36
 #define UUID_PARTS		6
 #define UUID_FORMAT		"%08X-%04X-%04X-%04X-%08X%04X"
@@ -150,6 +167,55 @@ struct qe {
 	u8			*buf;
 };
 
+/* registered data buffers kept per endpoint, one per power of 2 size class
+ * from 2 pages up to 2 << (NUM_BUF_CLASSES - 1) pages; larger transfers get
+ * a buffer registered for the one request.  A pooled buffer left unused for
+ * EP_BUF_IDLE ms is released by trim_ep_bufs so idle endpoints hold no
+ * registered memory.
+ */
+#define NUM_BUF_CLASSES		6
+#define EP_BUF_IDLE		30000 /* ms */
+
+struct xp_buf {
+	void			*buf;
+	struct xp_mr		*mr;
+	u64			 used;		/* ms, monotonic */
+	int			 size;
+	int			 busy;
+	int			 pooled;
+};
+
+struct endpoint;
+struct cmd_ctx;
+
+/* called once per submitted command, with the status of its completion or
+ * -ETIMEDOUT / -ENOTCONN, after its command id has been released.  For
+ * commands that receive data ctx->data is a copy the callback must free.
+ */
+typedef void (*cmd_done_fn)(struct endpoint *ep, struct cmd_ctx *ctx,
+			    int status);
+
+/* completion state of a command issued on a queue, indexed by command id.
+ * async commands (AER) have no waiter and are reaped by process_nvme_rsp,
+ * commands with a callback are completed by whoever reaps the queue.  The
+ * id of a command given up on stays stale, and so not handed out again,
+ * until its late completion arrives or the queue is reset.
+ */
+struct cmd_ctx {
+	u64			 result;
+	u64			 deadline;	/* ms, monotonic */
+	cmd_done_fn		 fn;
+	void			*arg;
+	struct xp_buf		*buf;
+	void			*data;
+	int			 len;		/* bytes to copy out of buf */
+	int			 status;
+	int			 busy;
+	int			 stale;
+	int			 done;
+	int			 async;
+};
+
 struct endpoint {
 	struct xp_ep		*ep;
 	struct xp_mr		*mr;
@@ -158,6 +224,8 @@ struct endpoint {
 	struct nvme_command	*cmd;
 	struct qe		*qe;
 	void			*data;
+	struct xp_buf		 pool[NUM_BUF_CLASSES];
+	struct cmd_ctx		 ctx[NVMF_DQ_DEPTH];
 	char			 nqn[MAX_NQN_SIZE + 1];
 	int			 state;
 	int			 csts;
@@ -172,6 +240,12 @@ struct ctrl_queue {
 	char			 hostnqn[MAX_NQN_SIZE + 1];
 	int			 connected;
 	int			 failed_kato;
+	int			 kato_pending;
+	int			 kato_status;
+	u64			 genctr;	/* of the last log read */
+	int			 have_genctr;
+	struct nvmf_disc_rsp_page_hdr *log;	/* kept by the dem */
+	u32			 numrec;
 };
 
 enum { VALID_LOGPAGE = 0, DELETED_LOGPAGE, NEW_LOGPAGE };
@@ -189,6 +263,11 @@ void disconnect_ctrl(struct ctrl_queue *ctrl, int shutdown);
 int client_connect(struct endpoint *ep, void *data, int bytes);
 void disconnect_endpoint(struct endpoint *ep, int shutdown);
 
+int get_ep_buf(struct endpoint *ep, int len, struct xp_buf **buf);
+void put_ep_buf(struct endpoint *ep, struct xp_buf *buf);
+void free_ep_bufs(struct endpoint *ep);
+void trim_ep_bufs(struct endpoint *ep, int idle_ms);
+
 int send_get_log_page(struct endpoint *ep, int log_size,
 		      struct nvmf_disc_rsp_page_hdr **log);
 int send_get_features(struct endpoint *ep, u8 fid, u64 *result);
@@ -202,9 +281,22 @@ int send_del_target(struct target *target);
 
 int process_nvme_rsp(struct endpoint *ep, int ignore_status, u64 *result);
 
+int send_keep_alive_async(struct endpoint *ep, int timeout, cmd_done_fn fn,
+			  void *arg);
+int send_get_log_page_async(struct endpoint *ep, int log_size, int timeout,
+			    cmd_done_fn fn, void *arg);
+int send_mi_send_async(struct endpoint *ep, int fcid, int len, void *data,
+		       int timeout, cmd_done_fn fn, void *arg);
+int poll_cmds(struct endpoint *ep);
+int wait_cmds(struct endpoint *ep, int ms);
+
 void print_discovery_log(struct nvmf_disc_rsp_page_hdr *log, int numrec);
 int get_logpages(struct ctrl_queue *dq, struct nvmf_disc_rsp_page_hdr **logp,
 		 u32 *numrec);
+int get_log_header_async(struct ctrl_queue *dq, int timeout, cmd_done_fn fn,
+			 void *arg);
+int get_changed_log_entries(struct ctrl_queue *dq, u32 numrec, u64 genctr,
+			    struct nvmf_disc_rsp_page_hdr **logp);
 
 const char *trtype_str(u8 trtype);
 const char *adrfam_str(u8 adrfam);
@@ -51,6 +51,7 @@ struct xp_ops {
 	int (*init_listener)(struct xp_pep **pep, char *port);
 	void (*destroy_listener)(struct xp_pep *pep);
 	int (*wait_for_connection)(struct xp_pep *pep, void **id);
+	void (*stop_listener)(struct xp_pep *pep);
 	int (*accept_connection)(struct xp_ep *ep);
 	int (*reject_connection)(struct xp_ep *ep, void *data, int len);
 	int (*client_connect)(struct xp_ep *ep, struct sockaddr *dst,
@@ -68,6 +69,7 @@ struct xp_ops {
 			struct xp_mr *mr);
 	int (*poll_for_msg)(struct xp_ep *ep, struct xp_qe **qe, void **msg,
 			    int *bytes);
+	int (*event_fd)(struct xp_ep *ep);
 	int (*alloc_key)(struct xp_ep *ep, void *buf, int len,
 			 struct xp_mr **mr);
 	u32 (*remote_key)(struct xp_mr *mr);
@@ -75,10 +77,15 @@ struct xp_ops {
 	int (*build_connect_data)(void **req, char *hostnqn);
 	void (*set_sgl)(struct nvme_command *cmd, u8 opcode, int len,
 			void *data, int key);
+	void (*release_cid)(struct xp_ep *ep, u16 cid);
 };
 
 struct xp_ops *rdma_register_ops(void);
 struct xp_ops *tcp_register_ops(void);
+struct xp_ops *loop_register_ops(void);
+#ifdef CONFIG_IO_URING
+struct xp_ops *uring_register_ops(void);
+#endif
 
 static inline struct xp_ops *register_ops(char *type)
 {
@@ -88,8 +95,19 @@ static inline struct xp_ops *register_ops(char *type)
 	if (strcmp(type, TRTYPE_STR_RDMA) == 0)
 		return rdma_register_ops();
 
-	if (strcmp(type, TRTYPE_STR_TCP) == 0)
+	if (strcmp(type, TRTYPE_STR_LOOP) == 0)
+		return loop_register_ops();
+
+	if (strcmp(type, TRTYPE_STR_TCP) == 0) {
+#ifdef CONFIG_IO_URING
+		/* same wire protocol, falls back if the kernel lacks io_uring */
+		struct xp_ops	*ops = uring_register_ops();
+
+		if (ops)
+			return ops;
+#endif
 		return tcp_register_ops();
+	}
 
 	return NULL;
 }
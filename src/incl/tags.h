@@ -48,6 +48,7 @@
 #define TAG_FAMILY		"ADRFAM"
 #define TAG_ADDRESS		"TRADDR"
 #define TAG_TRSVCID		"TRSVCID"
+#define TAG_WORKERS		"WORKERS"
 #define TAG_TREQ		"TREQ"
 #define TAG_PORTID		"PORTID"
 #define TAG_PORTIDS		"PortIDs"
@@ -86,6 +87,14 @@
 #define TAG_NEW			"NEW"
 #define TAG_OLD			"OLD"
 
+/* Target health specific */
+#define TAG_HEALTH		"Health"
+#define TAG_FAILURES		"Failures"
+#define TAG_NEXT_ATTEMPT	"NextAttempt"
+#define TAG_HEALTHY		"Healthy"
+#define TAG_RECONNECTING	"Reconnecting"
+#define TAG_UNREACHABLE		"Unreachable"
+
 #define URI_GROUP		"group"
 #define URI_TARGET		"target"
 #define URI_HOST		"host"
@@ -98,6 +107,7 @@
 #define URI_SIGNATURE		"signature"
 #define URI_LOG_PAGE		"logpage"
 #define URI_USAGE		"usage"
+#define URI_HEALTH		"health"
 #define URI_PARM_MODE		"mode="
 #define URI_PARM_FABRIC		"fabric="
 
@@ -118,6 +128,7 @@
 #define TRTYPE_STR_RDMA		"rdma"
 #define TRTYPE_STR_FC		"fc"
 #define TRTYPE_STR_TCP		"tcp"
+#define TRTYPE_STR_LOOP		"loop"
 
 #define ADRFAM_STR_IPV4		"ipv4"
 #define ADRFAM_STR_IPV6		"ipv6"
@@ -59,6 +59,20 @@ enum {
 	NVME_TCP_SINGLE_INFLIGHT_READY_TO_XMIT = 1,
 };
 
+/* common header flags */
+enum {
+	NVME_TCP_F_HDGST	= (1 << 0),
+	NVME_TCP_F_DDGST	= (1 << 1),
+};
+
+/* ICReq/ICResp dgst field */
+enum {
+	NVME_TCP_HDR_DIGEST_ENABLE	= (1 << 0),
+	NVME_TCP_DATA_DIGEST_ENABLE	= (1 << 1),
+};
+
+#define NVME_TCP_DIGEST_LEN	4
+
 struct nvme_tcp_common_hdr {
 	__u8			pdu_type;
 	__u8                    flags;
@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: DUAL GPL-2.0/BSD */
+/*
+ * NVMe over Fabrics Distributed Endpoint Management (NVMe-oF DEM).
+ * Copyright (c) 2017-2019 Intel Corporation, Inc. All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *	- Redistributions of source code must retain the above
+ *	  copyright notice, this list of conditions and the following
+ *	  disclaimer.
+ *
+ *	- Redistributions in binary form must reproduce the above
+ *	  copyright notice, this list of conditions and the following
+ *	  disclaimer in the documentation and/or other materials
+ *	  provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+/* hierarchical timer wheel: TIMER_LEVELS levels of TIMER_SLOTS slots, each
+ * level covering TIMER_SLOTS times the span of the one below it.  Timers
+ * are placed by expiry tick and cascade down a level as the wheel turns,
+ * so running the wheel only touches timers that are about to fire.
+ */
+#define TIMER_BITS		6
+#define TIMER_SLOTS		(1 << TIMER_BITS)
+#define TIMER_MASK		(TIMER_SLOTS - 1)
+#define TIMER_LEVELS		4
+
+struct timer {
+	struct linked_list	 node;
+	u64			 expires;	/* tick */
+	void			(*fn)(struct timer *timer);
+	int			 pending;
+};
+
+struct timer_wheel {
+	struct linked_list	 slots[TIMER_LEVELS][TIMER_SLOTS];
+	u64			 start;		/* ms, monotonic */
+	u64			 now;		/* next tick to run */
+	int			 tick;		/* ms per tick */
+	int			 count;		/* pending timers */
+};
+
+static inline void init_timer(struct timer *timer,
+			      void (*fn)(struct timer *timer))
+{
+	INIT_LINKED_LIST(&timer->node);
+	timer->fn = fn;
+	timer->pending = 0;
+}
+
+static inline int timer_pending(struct timer *timer)
+{
+	return timer->pending;
+}
+
+void init_timer_wheel(struct timer_wheel *wheel, int tick);
+void add_timer(struct timer_wheel *wheel, struct timer *timer, int ms);
+void del_timer(struct timer_wheel *wheel, struct timer *timer);
+void mod_timer(struct timer_wheel *wheel, struct timer *timer, int ms);
+int run_timers(struct timer_wheel *wheel);
+int next_timer(struct timer_wheel *wheel);
+
+#endif
@@ -176,6 +176,19 @@ static inline int list_empty(const struct linked_list *list)
 
 #define min(x, y) ((x < y) ? x : y)
 
+/* FNV-1a string hash */
+static inline u32 hash_str(const char *str)
+{
+	u32			 hash = 2166136261U;
+
+	while (*str) {
+		hash ^= (u8) *str++;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
 #define __round_mask(x, y) ((__typeof__(x))((y) - 1))
 #define round_up(x, y) ((((x) - 1) | __round_mask(x, y)) + 1)
 
@@ -34,6 +34,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <linux/types.h>
 
 extern int stopped;
 enum { DISCONNECTED = 0, CONNECTED };
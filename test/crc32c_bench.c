@@ -0,0 +1,114 @@
+/*
+ * NVMe over Fabrics Distributed Endpoint Management (NVMe-oF DEM).
+ * Copyright (c) 2017-2019 Intel Corporation, Inc.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *	- Redistributions of source code must retain the above
+ *	  copyright notice, this list of conditions and the following
+ *	  disclaimer.
+ *
+ *	- Redistributions in binary form must reproduce the above
+ *	  copyright notice, this list of conditions and the following
+ *	  disclaimer in the documentation and/or other materials
+ *	  provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* compares the table driven and SSE4.2 CRC32C used for NVMe/TCP digests
+ * over buffer sizes typical of PDU headers, capsules and log pages
+ */
+
+#include "common.h"
+#include <time.h>
+
+#include "crc32c.h"
+
+#define BENCH_BYTES	(256 * 1024 * 1024)
+
+int stopped;
+
+static double now(void)
+{
+	struct timespec		 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench(u32 (*fn)(u32, const void *, size_t), void *buf,
+		    size_t len, u32 *crc)
+{
+	size_t			 n = BENCH_BYTES / len;
+	size_t			 i;
+	double			 start;
+
+	*crc = ~0;
+
+	start = now();
+	for (i = 0; i < n; i++)
+		*crc = fn(*crc, buf, len);
+
+	return (n * len) / (now() - start) / (1024 * 1024 * 1024);
+}
+
+int main(void)
+{
+	static const size_t	 sizes[] = {
+		24, 72, 128, 512, 4096, 16384, 65536, 1024 * 1024
+	};
+	char			*buf;
+	double			 sw, hw;
+	u32			 crc_sw, crc_hw;
+	size_t			 i;
+	int			 ret = 0;
+
+	buf = malloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+	if (!buf)
+		return 1;
+
+	for (i = 0; i < sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]; i++)
+		buf[i] = rand();
+
+	if (~crc32c_sw(~0, "123456789", 9) != 0xe3069283) {
+		print_err("crc32c check value mismatch");
+		ret = 1;
+	}
+
+	printf("hardware crc32c %savailable\n",
+	       crc32c_hw_available() ? "" : "not ");
+	printf("%10s %12s %12s %8s\n", "bytes", "table GB/s", "sse4.2 GB/s",
+	       "speedup");
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		sw = bench(crc32c_sw, buf, sizes[i], &crc_sw);
+		hw = bench(crc32c_hw, buf, sizes[i], &crc_hw);
+
+		printf("%10zu %12.2f %12.2f %7.1fx%s\n", sizes[i], sw, hw,
+		       hw / sw, (crc_sw == crc_hw) ? "" : "  MISMATCH");
+
+		if (crc_sw != crc_hw)
+			ret = 1;
+	}
+
+	free(buf);
+
+	return ret;
+}
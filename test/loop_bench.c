@@ -0,0 +1,251 @@
+/*
+ * NVMe over Fabrics Distributed Endpoint Management (NVMe-oF DEM).
+ * Copyright (c) 2017-2019 Intel Corporation, Inc.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *	- Redistributions of source code must retain the above
+ *	  copyright notice, this list of conditions and the following
+ *	  disclaimer.
+ *
+ *	- Redistributions in binary form must reproduce the above
+ *	  copyright notice, this list of conditions and the following
+ *	  disclaimer in the documentation and/or other materials
+ *	  provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/* round trips get log page and keep alive commands over the in-process
+ * loop transport to show the cost of the transport-independent path
+ * without a network in the way
+ */
+
+#include "../src/auto_connect/common.h"
+#include <poll.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#define BENCH_PORT	"4422"
+#define BENCH_ITERS	200000
+
+int stopped;
+
+static struct xp_ops	*ops;
+
+static double now(void)
+{
+	struct timespec		 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int wait_msg(struct xp_ep *ep, struct xp_qe **qe, void **msg)
+{
+	struct pollfd		 fds = { .fd = ops->event_fd(ep) };
+	int			 bytes;
+	int			 ret;
+
+	fds.events = POLLIN;
+
+	while (!stopped) {
+		ret = ops->poll_for_msg(ep, qe, msg, &bytes);
+		if (ret != -EAGAIN)
+			return ret;
+
+		poll(&fds, 1, 100);
+	}
+
+	return -ESHUTDOWN;
+}
+
+/* answers every command, copying the log page into the host buffer */
+static void *target(void *arg)
+{
+	struct xp_pep		*pep = arg;
+	struct xp_ep		*ep;
+	struct xp_qe		*qe;
+	struct nvme_command	*cmd;
+	struct nvme_completion	 resp;
+	void			*log;
+	void			*id;
+	u64			 addr;
+	u32			 key;
+	int			 len;
+	int			 ret;
+
+	if (posix_memalign(&log, PAGE_SIZE, 1024 * 1024))
+		return NULL;
+
+	memset(log, 0x5a, 1024 * 1024);
+
+	ret = ops->wait_for_connection(pep, &id);
+	if (ret)
+		goto out;
+
+	ret = ops->create_endpoint(&ep, id, NVMF_DQ_DEPTH);
+	if (ret)
+		goto out;
+
+	ret = ops->accept_connection(ep);
+	if (ret)
+		goto err;
+
+	while (wait_msg(ep, &qe, (void **) &cmd) == 0) {
+		memset(&resp, 0, sizeof(resp));
+		resp.command_id = cmd->common.command_id;
+
+		if (cmd->common.opcode == nvme_admin_get_log_page) {
+			addr = cmd->common.dptr.ksgl.addr;
+			key = get_unaligned_le32(cmd->common.dptr.ksgl.key);
+			len = get_unaligned_le24(cmd->common.dptr.ksgl.length);
+
+			ret = ops->rma_write(ep, log, addr, len, key, NULL,
+					     cmd);
+			if (ret)
+				resp.status = NVME_SC_INTERNAL << 1;
+		}
+
+		ops->repost_recv(ep, qe);
+		ops->send_rsp(ep, &resp, sizeof(resp), NULL);
+	}
+err:
+	ops->destroy_endpoint(ep);
+out:
+	free(log);
+
+	return NULL;
+}
+
+static int round_trip(struct xp_ep *ep, struct nvme_command *cmd)
+{
+	struct nvme_completion	*resp;
+	struct xp_qe		*qe;
+	int			 ret;
+
+	ret = ops->send_msg(ep, cmd, sizeof(*cmd), NULL);
+	if (ret)
+		return ret;
+
+	ret = wait_msg(ep, &qe, (void **) &resp);
+	if (ret)
+		return ret;
+
+	ret = resp->status;
+
+	ops->repost_recv(ep, qe);
+
+	return ret;
+}
+
+static double bench(struct xp_ep *ep, struct nvme_command *cmd, int *err)
+{
+	double			 start;
+	int			 i;
+
+	start = now();
+	for (i = 0; i < BENCH_ITERS; i++) {
+		cmd->common.command_id = i;
+
+		*err = round_trip(ep, cmd);
+		if (*err)
+			break;
+	}
+
+	return (now() - start) * 1e6 / BENCH_ITERS;
+}
+
+int main(void)
+{
+	static const int	 sizes[] = { 1024, 4096, 16384, 65536 };
+	struct sockaddr_in	 dst = { .sin_family = AF_INET };
+	struct nvme_command	 cmd;
+	struct xp_pep		*pep;
+	struct xp_ep		*ep;
+	struct xp_mr		*mr;
+	pthread_t		 thread;
+	char			*buf;
+	double			 usec;
+	unsigned int		 i;
+	int			 err = 0;
+	int			 ret = 1;
+
+	ops = loop_register_ops();
+
+	if (ops->init_listener(&pep, BENCH_PORT))
+		return 1;
+
+	if (pthread_create(&thread, NULL, target, pep))
+		goto out1;
+
+	if (ops->init_endpoint(&ep, NVMF_DQ_DEPTH))
+		goto out2;
+
+	dst.sin_port = htons(atoi(BENCH_PORT));
+
+	if (ops->client_connect(ep, (struct sockaddr *) &dst, NULL, 0))
+		goto out3;
+
+	if (posix_memalign((void **) &buf, PAGE_SIZE, sizes[3]))
+		goto out3;
+
+	if (ops->alloc_key(ep, buf, sizes[3], &mr))
+		goto out4;
+
+	printf("%12s %10s\n", "command", "usec/op");
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.common.opcode = nvme_admin_keep_alive;
+
+	usec = bench(ep, &cmd, &err);
+	printf("%12s %10.2f\n", "keep alive", usec);
+
+	for (i = 0; !err && i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		ops->set_sgl(&cmd, nvme_admin_get_log_page, sizes[i], buf,
+			     ops->remote_key(mr));
+
+		buf[sizes[i] - 1] = 0;
+
+		usec = bench(ep, &cmd, &err);
+		printf("%7d byte %10.2f\n", sizes[i], usec);
+
+		if (buf[sizes[i] - 1] != 0x5a)
+			err = -EIO;
+	}
+
+	if (err)
+		print_err("round trip failed %d", err);
+	else
+		ret = 0;
+
+	ops->dealloc_key(mr);
+out4:
+	free(buf);
+out3:
+	ops->destroy_endpoint(ep);
+out2:
+	stopped = 1;
+	pthread_join(thread, NULL);
+out1:
+	ops->destroy_listener(pep);
+
+	return ret;
+}
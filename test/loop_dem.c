@@ -0,0 +1,387 @@
+/*
+ * NVMe over Fabrics Distributed Endpoint Management (NVMe-oF DEM).
+ * Copyright (c) 2017-2019 Intel Corporation, Inc.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *	- Redistributions of source code must retain the above
+ *	  copyright notice, this list of conditions and the following
+ *	  disclaimer.
+ *
+ *	- Redistributions in binary form must reproduce the above
+ *	  copyright notice, this list of conditions and the following
+ *	  disclaimer in the documentation and/or other materials
+ *	  provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/* runs the DEM discovery controller, pseudo_target.c and the discovery
+ * log builder in logpages.c, on the loop transport and reads its log
+ * back with the host helpers in nvmeof.c the way dem-ac and dem-dm do
+ */
+
+#include "../src/dem/common.h"
+#include <netinet/in.h>
+
+#define TEST_PORT	"4423"
+#define TEST_HOSTNQN	"nqn.2014-08.org.nvmexpress:loop-test-host"
+#define TEST_SUBNQN	"nqn.2014-08.org.nvmexpress:loop-test-subsys"
+#define TEST_RECORDS	64	/* spans several pages of log */
+#define TEST_TIMEOUT	5000	/* ms */
+
+int			 stopped;
+int			 num_interfaces;
+struct linked_list	*target_list;
+
+static LINKED_LIST(targets);
+
+/* the rest of the DEM the pseudo target calls into, not exercised here */
+struct host *find_subsys_host(struct subsystem *subsys, char *nqn)
+{
+	UNUSED(subsys);
+	UNUSED(nqn);
+
+	return NULL;
+}
+
+bool shared_group(struct target *target, char *nqn)
+{
+	UNUSED(target);
+	UNUSED(nqn);
+
+	return false;
+}
+
+bool indirect_shared_group(struct target *target, char *alias)
+{
+	UNUSED(target);
+	UNUSED(alias);
+
+	return false;
+}
+
+void notify_hosts(void)
+{
+}
+
+/* stands in for the probe workers of the daemon */
+void connect_target_queues(struct target *target)
+{
+	struct ctrl_queue	*dq;
+
+	list_for_each_entry(dq, &target->discovery_queue_list, node)
+		if (!dq->connected && !connect_ctrl(dq))
+			dq->connected = 1;
+}
+
+void target_unreachable(struct target *target)
+{
+	UNUSED(target);
+}
+
+struct xp_ops *rdma_register_ops(void)
+{
+	return NULL;
+}
+
+struct xp_ops *tcp_register_ops(void)
+{
+	return NULL;
+}
+
+/* one target with an allow any subsystem carrying TEST_RECORDS records */
+static void build_target(void)
+{
+	static struct target	 target;
+	static struct subsystem	 subsys;
+	static struct logpage	 logpage[TEST_RECORDS];
+	struct nvmf_disc_rsp_page_entry *e;
+	int			 i;
+
+	INIT_LINKED_LIST(&target.subsys_list);
+	INIT_LINKED_LIST(&target.portid_list);
+	INIT_LINKED_LIST(&target.device_list);
+	INIT_LINKED_LIST(&target.discovery_queue_list);
+	INIT_LINKED_LIST(&target.unattached_logpage_list);
+	INIT_LINKED_LIST(&target.fabric_iface_list);
+	strcpy(target.alias, "loop-test");
+
+	INIT_LINKED_LIST(&subsys.host_list);
+	INIT_LINKED_LIST(&subsys.ns_list);
+	INIT_LINKED_LIST(&subsys.logpage_list);
+	strcpy(subsys.nqn, TEST_SUBNQN);
+	subsys.target = &target;
+	subsys.access = ALLOW_ANY;
+
+	for (i = 0; i < TEST_RECORDS; i++) {
+		e = &logpage[i].e;
+
+		e->trtype = NVMF_TRTYPE_RDMA;
+		e->adrfam = NVMF_ADDR_FAMILY_IP4;
+		e->subtype = NVME_NQN_NVME;
+		e->portid = htole16(i);
+		e->cntlid = htole16(NVME_CNTLID_DYNAMIC);
+		sprintf(e->trsvcid, "%d", 4420 + i);
+		sprintf(e->traddr, "192.168.22.%d", i + 1);
+		sprintf(e->subnqn, "%s-%d", TEST_SUBNQN, i);
+
+		logpage[i].valid = 1;
+		list_add_tail(&logpage[i].node, &subsys.logpage_list);
+	}
+
+	list_add_tail(&subsys.node, &target.subsys_list);
+	list_add_tail(&target.node, &targets);
+
+	target_list = &targets;
+}
+
+static int check_log(struct nvmf_disc_rsp_page_hdr *log, int numrec)
+{
+	char			 nqn[NVMF_NQN_FIELD_LEN];
+	int			 i;
+
+	if (le64toh(log->numrec) != TEST_RECORDS) {
+		print_err("log has %lld records, expected %d",
+			  (long long) le64toh(log->numrec), TEST_RECORDS);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < numrec; i++) {
+		sprintf(nqn, "%s-%d", TEST_SUBNQN, i);
+		if (strcmp(log->entries[i].subnqn, nqn) ||
+		    le16toh(log->entries[i].portid) != i) {
+			print_err("record %d is '%s'", i,
+				  log->entries[i].subnqn);
+			return -EIO;
+		}
+	}
+
+	return 0;
+}
+
+static int async_status = -EINPROGRESS;
+
+static void log_page_done(struct endpoint *ep, struct cmd_ctx *ctx, int status)
+{
+	UNUSED(ep);
+
+	if (!status)
+		status = check_log(ctx->data, TEST_RECORDS);
+
+	free(ctx->data);
+
+	async_status = status;
+}
+
+static int run_host(struct ctrl_queue *ctrl)
+{
+	struct nvmf_disc_rsp_page_hdr *log;
+	struct endpoint		*ep = &ctrl->ep;
+	int			 len;
+	int			 ret;
+
+	ret = connect_ctrl(ctrl);
+	if (ret) {
+		print_errno("connect_ctrl failed", ret);
+		return ret;
+	}
+
+	/* the header says how big the log is, as a host finds out */
+	ret = send_get_log_page(ep, sizeof(*log), &log);
+	if (ret) {
+		print_errno("header send_get_log_page failed", ret);
+		goto out;
+	}
+
+	ret = check_log(log, 0);
+	free(log);
+	if (ret)
+		goto out;
+
+	len = sizeof(*log) + TEST_RECORDS * sizeof(log->entries[0]);
+
+	ret = send_get_log_page(ep, len, &log);
+	if (ret) {
+		print_errno("send_get_log_page failed", ret);
+		goto out;
+	}
+
+	ret = check_log(log, TEST_RECORDS);
+	free(log);
+	if (ret)
+		goto out;
+
+	ret = send_get_log_page_async(ep, len, TEST_TIMEOUT, log_page_done,
+				      NULL);
+	if (ret) {
+		print_errno("send_get_log_page_async failed", ret);
+		goto out;
+	}
+
+	while (async_status == -EINPROGRESS && !ret)
+		ret = poll_cmds(ep) < 0 ? -EIO : 0;
+
+	if (!ret)
+		ret = async_status;
+	if (ret) {
+		print_errno("async log page failed", ret);
+		goto out;
+	}
+
+	ret = send_keep_alive(ep);
+	if (ret)
+		print_errno("send_keep_alive failed", ret);
+out:
+	disconnect_ctrl(ctrl, 0);
+
+	return ret;
+}
+
+static int count_logpages(struct linked_list *list)
+{
+	struct logpage		*logpage;
+	int			 cnt = 0;
+
+	list_for_each_entry(logpage, list, node)
+		if (logpage->valid)
+			cnt++;
+
+	return cnt;
+}
+
+/* a second target whose discovery queue is the DEM itself, so refreshing
+ * it reads the records of the first back through the DEM's refresh path
+ */
+static int run_refresh(struct portid *portid)
+{
+	static struct target	 peer;
+	static struct subsystem	 subsys;
+	struct ctrl_queue	*dq;
+	struct logpage		*logpage, *next;
+	int			 ret = 0;
+	int			 i;
+
+	INIT_LINKED_LIST(&peer.subsys_list);
+	INIT_LINKED_LIST(&peer.discovery_queue_list);
+	INIT_LINKED_LIST(&peer.unattached_logpage_list);
+	strcpy(peer.alias, "loop-peer");
+	peer.health = TARGET_HEALTHY;
+
+	INIT_LINKED_LIST(&subsys.host_list);
+	INIT_LINKED_LIST(&subsys.logpage_list);
+	sprintf(subsys.nqn, "%s-%d", TEST_SUBNQN, 0);
+	subsys.target = &peer;
+	subsys.access = ALLOW_ANY;
+	list_add_tail(&subsys.node, &peer.subsys_list);
+
+	dq = calloc(1, sizeof(*dq));
+	if (!dq)
+		return -ENOMEM;
+
+	dq->portid = portid;
+	dq->target = &peer;
+	dq->ep.ops = loop_register_ops();
+	strcpy(dq->hostnqn, TEST_HOSTNQN);
+	list_add_tail(&dq->node, &peer.discovery_queue_list);
+
+	/* the first refresh only has the queue connected, the second reads
+	 * its log and the third finds genctr unchanged and keeps what it has
+	 */
+	refresh_log_pages(&peer);
+
+	for (i = 0; i < 2 && !ret; i++) {
+		if (i)
+			poll_log_pages(&peer);
+		else
+			refresh_log_pages(&peer);
+
+		if (!dq->connected || !dq->have_genctr ||
+		    dq->numrec != TEST_RECORDS ||
+		    count_logpages(&subsys.logpage_list) != 1 ||
+		    count_logpages(&peer.unattached_logpage_list) !=
+		    TEST_RECORDS - 1) {
+			print_err("refresh %d of target %s failed", i,
+				  peer.alias);
+			ret = -EIO;
+		}
+	}
+
+	free_dq(dq);
+
+	del_unattached_logpage_list(&peer);
+
+	list_for_each_entry_safe(logpage, next, &subsys.logpage_list, node) {
+		list_del(&logpage->node);
+		free(logpage);
+	}
+
+	return ret;
+}
+
+int main(void)
+{
+	struct host_iface	 iface;
+	struct ctrl_queue	 ctrl;
+	struct portid		 portid;
+	pthread_t		 thread;
+	int			 ret;
+
+	build_target();
+
+	memset(&iface, 0, sizeof(iface));
+	strcpy(iface.type, TRTYPE_STR_LOOP);
+	strcpy(iface.family, "ipv4");
+	strcpy(iface.address, "127.0.0.1");
+	strcpy(iface.port, TEST_PORT);
+	iface.workers = 2;
+
+	num_interfaces = 1;
+
+	if (pthread_create(&thread, NULL, interface_thread, &iface))
+		return 1;
+
+	while (!__atomic_load_n(&iface.listener, __ATOMIC_ACQUIRE) &&
+	       num_interfaces)
+		usleep(1000);
+
+	memset(&portid, 0, sizeof(portid));
+	strcpy(portid.type, TRTYPE_STR_LOOP);
+	strcpy(portid.family, "ipv4");
+	strcpy(portid.address, "127.0.0.1");
+	portid.port_num = atoi(TEST_PORT);
+
+	memset(&ctrl, 0, sizeof(ctrl));
+	ctrl.portid = &portid;
+	ctrl.ep.ops = loop_register_ops();
+	strcpy(ctrl.hostnqn, TEST_HOSTNQN);
+
+	ret = num_interfaces ? run_host(&ctrl) : -ENODEV;
+	if (!ret)
+		ret = run_refresh(&portid);
+
+	stopped = 1;
+	pthread_join(thread, NULL);
+
+	free_discovery_logs();
+
+	printf("loop_dem %s\n", ret ? "FAILED" : "passed");
+
+	return ret ? 1 : 0;
+}
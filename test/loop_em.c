@@ -0,0 +1,282 @@
+/*
+ * NVMe over Fabrics Distributed Endpoint Management (NVMe-oF DEM).
+ * Copyright (c) 2017-2019 Intel Corporation, Inc.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *	- Redistributions of source code must retain the above
+ *	  copyright notice, this list of conditions and the following
+ *	  disclaimer.
+ *
+ *	- Redistributions in binary form must reproduce the above
+ *	  copyright notice, this list of conditions and the following
+ *	  disclaimer in the documentation and/or other materials
+ *	  provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/* runs the endpoint manager's in-band pseudo target and its MI handlers
+ * on the loop transport, configured through the host helpers in nvmeof.c
+ * the way the DEM drives an in-band dem-em
+ */
+
+#include "../src/endpoint/common.h"
+#include "../src/incl/ops.h"
+#include <netinet/in.h>
+
+#define TEST_PORT	"4424"
+#define TEST_HOSTNQN	"nqn.2014-08.org.nvmexpress:loop-test-dem"
+#define TEST_SUBNQN	"nqn.2014-08.org.nvmexpress:loop-test-subsys"
+#define TEST_DENIED	"nqn.2014-08.org.nvmexpress:loop-test-denied"
+#define TEST_DEVICES	4
+#define TEST_TIMEOUT	5000	/* ms */
+
+int			 stopped;
+struct linked_list	*devices;
+struct linked_list	*interfaces;
+struct ops		*ops;
+
+static LINKED_LIST(device_list);
+static LINKED_LIST(interface_list);
+
+static char		 created[MAX_NQN_SIZE + 1];
+static int		 allowany = -1;
+
+struct xp_ops *rdma_register_ops(void)
+{
+	return NULL;
+}
+
+struct xp_ops *tcp_register_ops(void)
+{
+	return NULL;
+}
+
+/* stands in for configfs, remembering what it was asked to create */
+static int create_subsys(char *subsys, int _allowany)
+{
+	if (!strcmp(subsys, TEST_DENIED))
+		return -EPERM;
+
+	strncpy(created, subsys, MAX_NQN_SIZE);
+	allowany = _allowany;
+
+	return 0;
+}
+
+static struct ops test_ops = {
+	.create_subsys		= create_subsys,
+};
+
+static void build_config(void)
+{
+	static struct nsdev	 dev[TEST_DEVICES];
+	static struct portid	 xport;
+	int			 i;
+
+	for (i = 0; i < TEST_DEVICES; i++) {
+		dev[i].devid = i;
+		dev[i].nsid = i + 1;
+		list_add_tail(&dev[i].node, &device_list);
+	}
+
+	strcpy(xport.type, TRTYPE_STR_RDMA);
+	strcpy(xport.family, "ipv4");
+	strcpy(xport.address, "192.168.22.1");
+	list_add_tail(&xport.node, &interface_list);
+
+	devices = &device_list;
+	interfaces = &interface_list;
+	ops = &test_ops;
+}
+
+static int check_config(struct endpoint *ep)
+{
+	struct nvmf_get_ns_devices_hdr	*nsdevs;
+	struct nvmf_get_ns_devices_entry *dev;
+	struct nvmf_get_transports_hdr	*xports;
+	struct nvmf_get_transports_entry *xport;
+	int				 i;
+	int				 ret;
+
+	ret = send_mi_receive(ep, nvmf_get_ns_config, PAGE_SIZE,
+			      (void **) &nsdevs);
+	if (ret) {
+		print_errno("get ns config failed", ret);
+		return ret;
+	}
+
+	dev = (struct nvmf_get_ns_devices_entry *) &nsdevs->data;
+
+	if (nsdevs->num_entries != TEST_DEVICES)
+		ret = -EINVAL;
+
+	for (i = 0; !ret && i < TEST_DEVICES; i++, dev++)
+		if (dev->devid != i || dev->nsid != i + 1)
+			ret = -EIO;
+
+	free(nsdevs);
+
+	if (ret) {
+		print_err("bad ns config");
+		return ret;
+	}
+
+	ret = send_mi_receive(ep, nvmf_get_xport_config, PAGE_SIZE,
+			      (void **) &xports);
+	if (ret) {
+		print_errno("get xport config failed", ret);
+		return ret;
+	}
+
+	xport = (struct nvmf_get_transports_entry *) &xports->data;
+
+	if (xports->num_entries != 1 || xport->trtype != NVMF_TRTYPE_RDMA ||
+	    strcmp(xport->traddr, "192.168.22.1")) {
+		print_err("bad xport config");
+		ret = -EIO;
+	}
+
+	free(xports);
+
+	return ret;
+}
+
+static int async_status = -EINPROGRESS;
+
+static void set_config_done(struct endpoint *ep, struct cmd_ctx *ctx,
+			    int status)
+{
+	UNUSED(ep);
+	UNUSED(ctx);
+
+	async_status = status;
+}
+
+static int set_config(struct endpoint *ep)
+{
+	struct nvmf_subsys_config_entry entry;
+	int				ret;
+
+	memset(&entry, 0, sizeof(entry));
+	strcpy(entry.subnqn, TEST_SUBNQN);
+	entry.allowanyhost = 1;
+
+	ret = send_mi_send(ep, nvmf_set_subsys_config, sizeof(entry), &entry);
+	if (ret || strcmp(created, TEST_SUBNQN) || allowany != 1) {
+		print_err("set subsys config failed %d", ret);
+		return ret ? ret : -EIO;
+	}
+
+	strcpy(entry.subnqn, TEST_SUBNQN "-async");
+	entry.allowanyhost = 0;
+
+	ret = send_mi_send_async(ep, nvmf_set_subsys_config, sizeof(entry),
+				 &entry, TEST_TIMEOUT, set_config_done, NULL);
+	if (ret) {
+		print_errno("send_mi_send_async failed", ret);
+		return ret;
+	}
+
+	while (async_status == -EINPROGRESS && !ret)
+		ret = poll_cmds(ep) < 0 ? -EIO : 0;
+
+	if (!ret)
+		ret = async_status;
+	if (ret || strcmp(created, TEST_SUBNQN "-async") || allowany != 0) {
+		print_err("async set subsys config failed %d", ret);
+		return ret ? ret : -EIO;
+	}
+
+	/* a config the target refuses comes back as a status, and the
+	 * endpoint drops the queue after a failed command so this goes last
+	 */
+	strcpy(entry.subnqn, TEST_DENIED);
+
+	ret = send_mi_send(ep, nvmf_set_subsys_config, sizeof(entry), &entry);
+	if (ret != (NVME_SC_DNR | NVME_SC_ACCESS_DENIED)) {
+		print_err("denied subsys config returned %d", ret);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int run_host(struct ctrl_queue *ctrl)
+{
+	int			 ret;
+
+	ret = connect_ctrl(ctrl);
+	if (ret) {
+		print_errno("connect_ctrl failed", ret);
+		return ret;
+	}
+
+	ret = check_config(&ctrl->ep);
+	if (!ret)
+		ret = set_config(&ctrl->ep);
+
+	disconnect_ctrl(ctrl, 0);
+
+	return ret;
+}
+
+int main(void)
+{
+	struct host_iface	 iface;
+	struct ctrl_queue	 ctrl;
+	struct portid		 portid;
+	pthread_t		 thread;
+	int			 ret;
+
+	build_config();
+
+	memset(&iface, 0, sizeof(iface));
+	strcpy(iface.type, TRTYPE_STR_LOOP);
+	strcpy(iface.family, "ipv4");
+	strcpy(iface.address, "127.0.0.1");
+	strcpy(iface.port, TEST_PORT);
+
+	if (pthread_create(&thread, NULL, interface_thread, &iface))
+		return 1;
+
+	while (!__atomic_load_n(&iface.listener, __ATOMIC_ACQUIRE))
+		usleep(1000);
+
+	memset(&portid, 0, sizeof(portid));
+	strcpy(portid.type, TRTYPE_STR_LOOP);
+	strcpy(portid.family, "ipv4");
+	strcpy(portid.address, "127.0.0.1");
+	portid.port_num = atoi(TEST_PORT);
+
+	memset(&ctrl, 0, sizeof(ctrl));
+	ctrl.portid = &portid;
+	ctrl.ep.ops = loop_register_ops();
+	strcpy(ctrl.hostnqn, TEST_HOSTNQN);
+
+	ret = run_host(&ctrl);
+
+	stopped = 1;
+	pthread_join(thread, NULL);
+
+	printf("loop_em %s\n", ret ? "FAILED" : "passed");
+
+	return ret ? 1 : 0;
+}